@@ -0,0 +1,177 @@
+//###########################################################################
+// FILE:   chksum_test.c
+// TITLE:  Host check and benchmark of the M3 Internet checksum
+//###########################################################################
+//
+// Checks EthernetChksum() from m3/enet_chksum.c against uIP's byte at a
+// time chksum() over every length up to a full frame, from every alignment,
+// with several starting sums and several kinds of data, and then times the
+// two.  The host has to be little endian, as the M3 is.
+//
+//     make check
+//
+// The times are the host's, so they show the ratio between the two rather
+// than M3 cycles.
+//
+//###########################################################################
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "enet_chksum.h"
+
+#define MAX_LEN                 1600
+#define BENCH_BYTES             (64UL * 1024 * 1024)
+
+//*****************************************************************************
+// uIP 1.0's chksum(), the reference.
+//*****************************************************************************
+static uint16_t
+RefChksum(uint16_t usSum, const uint8_t *pucData, uint16_t usLen)
+{
+    const uint8_t *pucLast;
+    uint16_t usTemp;
+
+    pucLast = pucData + usLen - 1;
+    while(pucData < pucLast)
+    {
+        usTemp = (pucData[0] << 8) + pucData[1];
+        usSum += usTemp;
+        if(usSum < usTemp)
+        {
+            usSum++;
+        }
+        pucData += 2;
+    }
+    if(pucData == pucLast)
+    {
+        usTemp = (pucData[0] << 8) + 0;
+        usSum += usTemp;
+        if(usSum < usTemp)
+        {
+            usSum++;
+        }
+    }
+
+    return(usSum);
+}
+
+static double
+Now(void)
+{
+    struct timespec sTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &sTime);
+    return(sTime.tv_sec + (sTime.tv_nsec / 1e9));
+}
+
+//*****************************************************************************
+// Time ulCalls sums of usLen bytes.
+//*****************************************************************************
+static double
+Bench(uint16_t (*pfnSum)(uint16_t, const uint8_t *, uint16_t),
+      const uint8_t *pucData, uint16_t usLen, unsigned long ulCalls)
+{
+    volatile uint16_t usSink;
+    unsigned long ulIdx;
+    double dStart;
+
+    usSink = 0;
+    dStart = Now();
+    for(ulIdx = 0; ulIdx < ulCalls; ulIdx++)
+    {
+        usSink += pfnSum(usSink, pucData, usLen);
+    }
+
+    return((Now() - dStart) * 1e9 / ulCalls);
+}
+
+int
+main(void)
+{
+    static const uint8_t pucRfc1071[8] =
+    {
+        0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7
+    };
+    static const uint16_t pusStart[] = { 0, 0x1234, 0xfffe, 0xffff };
+    static const uint16_t pusBenchLen[] = { 20, 40, 64, 536, 1460 };
+    static uint32_t pulBuf[(MAX_LEN + 8) / 4];
+    uint8_t *pucBuf;
+    unsigned long ulChecks, ulFailures;
+    unsigned int uiFill, uiOffset, uiStart, uiIdx;
+    uint16_t usLen, usRef, usSum;
+    double dRef, dSum;
+
+    pucBuf = (uint8_t *)pulBuf;
+    ulChecks = 0;
+    ulFailures = 0;
+
+    // The example of RFC 1071, section 3.
+    usSum = EthernetChksum(0, pucRfc1071, sizeof(pucRfc1071));
+    ulChecks++;
+    if(usSum != 0xddf2)
+    {
+        printf("FAIL RFC 1071 example: %04x, not ddf2\n", usSum);
+        ulFailures++;
+    }
+
+    // Random data, all ones, which carries on every add, and all zeros.
+    for(uiFill = 0; uiFill < 3; uiFill++)
+    {
+        srand(1);
+        for(uiIdx = 0; uiIdx < sizeof(pulBuf); uiIdx++)
+        {
+            pucBuf[uiIdx] = (uiFill == 0) ? (uint8_t)rand() :
+                            (uiFill == 1) ? 0xff : 0x00;
+        }
+
+        for(uiOffset = 0; uiOffset < 4; uiOffset++)
+        {
+            for(usLen = 0; usLen <= MAX_LEN; usLen++)
+            {
+                for(uiStart = 0;
+                    uiStart < (sizeof(pusStart) / sizeof(pusStart[0]));
+                    uiStart++)
+                {
+                    usRef = RefChksum(pusStart[uiStart], pucBuf + uiOffset,
+                                      usLen);
+                    usSum = EthernetChksum(pusStart[uiStart],
+                                           pucBuf + uiOffset, usLen);
+                    ulChecks++;
+                    if(usSum != usRef)
+                    {
+                        if(ulFailures++ < 10)
+                        {
+                            printf("FAIL fill %u offset %u length %u start "
+                                   "%04x: %04x, not %04x\n", uiFill,
+                                   uiOffset, usLen, pusStart[uiStart],
+                                   usSum, usRef);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%lu checks, %lu failures\n", ulChecks, ulFailures);
+
+    // The benchmark, over the random data from a word boundary.
+    srand(1);
+    for(uiIdx = 0; uiIdx < sizeof(pulBuf); uiIdx++)
+    {
+        pucBuf[uiIdx] = (uint8_t)rand();
+    }
+    printf("\n%8s %12s %12s %8s\n", "bytes", "uIP ns", "word ns", "speedup");
+    for(uiIdx = 0; uiIdx < (sizeof(pusBenchLen) / sizeof(pusBenchLen[0]));
+        uiIdx++)
+    {
+        usLen = pusBenchLen[uiIdx];
+        dRef = Bench(RefChksum, pucBuf, usLen, BENCH_BYTES / usLen);
+        dSum = Bench(EthernetChksum, pucBuf, usLen, BENCH_BYTES / usLen);
+        printf("%8u %12.1f %12.1f %7.1fx\n", usLen, dRef, dSum, dRef / dSum);
+    }
+
+    return(ulFailures ? 1 : 0);
+}
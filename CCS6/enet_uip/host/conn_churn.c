@@ -0,0 +1,247 @@
+//###########################################################################
+// FILE:   conn_churn.c
+// TITLE:  TCP connection churn benchmark for the enet_uip web server
+//###########################################################################
+//
+// Keeps a number of HTTP/1.0 requests in flight against the board, each on
+// a connection of its own that the server closes when it has answered, so
+// that the server's connection table fills with connections waiting out a
+// close.  Prints the connections served each second, and at the end the
+// board's tcp.conn and tcp.syn counters, which show how many connections
+// were reclaimed and how many SYNs were held or reset.
+//
+//     conn_churn <address> [seconds [in flight [port]]]
+//
+// Run it against a build of each UIP_CONF_CONN_PROFILE with the same number
+// in flight to compare the profiles.
+//
+//###########################################################################
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IN_FLIGHT           64
+#define REQUEST_TIMEOUT_MS      3000
+
+static const char g_pcRequest[] = "GET /stats.bin HTTP/1.0\r\n\r\n";
+
+//*****************************************************************************
+// One request in flight.
+//*****************************************************************************
+typedef struct
+{
+    int iSocket;
+    int iSent;
+    double dStart;
+}
+tRequest;
+
+static struct sockaddr_in g_sAddr;
+static unsigned long g_ulServed;
+static unsigned long g_ulFailed;
+
+static double
+Now(void)
+{
+    struct timespec sTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &sTime);
+    return(sTime.tv_sec + (sTime.tv_nsec / 1e9));
+}
+
+//*****************************************************************************
+// Start a request with a new connection.
+//*****************************************************************************
+static void
+RequestStart(tRequest *psReq)
+{
+    psReq->iSocket = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(psReq->iSocket, F_SETFL, O_NONBLOCK);
+    connect(psReq->iSocket, (struct sockaddr *)&g_sAddr, sizeof(g_sAddr));
+    psReq->iSent = 0;
+    psReq->dStart = Now();
+}
+
+//*****************************************************************************
+// Finish a request, counting it, and start the next one in its place.
+//*****************************************************************************
+static void
+RequestEnd(tRequest *psReq, int iServed)
+{
+    close(psReq->iSocket);
+    if(iServed)
+    {
+        g_ulServed++;
+    }
+    else
+    {
+        g_ulFailed++;
+    }
+    RequestStart(psReq);
+}
+
+//*****************************************************************************
+// Fetch the text counters and print those for TCP connections and SYNs.
+//*****************************************************************************
+static void
+PrintConnStats(void)
+{
+    static const char pcRequest[] = "GET /stats HTTP/1.0\r\n\r\n";
+    static char pcBuf[8192];
+    char *pcLine, *pcNext;
+    int iSocket, iLen, iRead;
+
+    iSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(iSocket, (struct sockaddr *)&g_sAddr, sizeof(g_sAddr)) ||
+       (send(iSocket, pcRequest, sizeof(pcRequest) - 1, 0) < 0))
+    {
+        printf("could not fetch /stats: %s\n", strerror(errno));
+        close(iSocket);
+        return;
+    }
+    iLen = 0;
+    while((iLen < (int)sizeof(pcBuf) - 1) &&
+          ((iRead = recv(iSocket, pcBuf + iLen,
+                         sizeof(pcBuf) - 1 - iLen, 0)) > 0))
+    {
+        iLen += iRead;
+    }
+    pcBuf[iLen] = 0;
+    close(iSocket);
+
+    for(pcLine = pcBuf; pcLine && *pcLine; pcLine = pcNext)
+    {
+        pcNext = strchr(pcLine, '\n');
+        if(pcNext)
+        {
+            *pcNext++ = 0;
+        }
+        if(!strncmp(pcLine, "tcp.conn.", 9) || !strncmp(pcLine, "tcp.syn", 7))
+        {
+            printf("    %s\n", pcLine);
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    static tRequest psReq[MAX_IN_FLIGHT];
+    static struct pollfd psPoll[MAX_IN_FLIGHT];
+    static char pcDiscard[2048];
+    unsigned long ulSeconds, ulSecond, ulLastServed, ulLastFailed;
+    unsigned int uiInFlight, uiIdx;
+    double dStart, dNow;
+    int iRead;
+
+    if(argc < 2)
+    {
+        fprintf(stderr,
+                "usage: %s <address> [seconds [in flight [port]]]\n",
+                argv[0]);
+        return(2);
+    }
+    memset(&g_sAddr, 0, sizeof(g_sAddr));
+    g_sAddr.sin_family = AF_INET;
+    g_sAddr.sin_port = htons((argc > 4) ? atoi(argv[4]) : 80);
+    if(inet_pton(AF_INET, argv[1], &g_sAddr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", argv[1]);
+        return(2);
+    }
+    ulSeconds = (argc > 2) ? strtoul(argv[2], 0, 0) : 10;
+    uiInFlight = (argc > 3) ? strtoul(argv[3], 0, 0) : 8;
+    if((uiInFlight < 1) || (uiInFlight > MAX_IN_FLIGHT))
+    {
+        fprintf(stderr, "in flight must be 1 to %d\n", MAX_IN_FLIGHT);
+        return(2);
+    }
+
+    printf("before:\n");
+    PrintConnStats();
+
+    for(uiIdx = 0; uiIdx < uiInFlight; uiIdx++)
+    {
+        RequestStart(&psReq[uiIdx]);
+    }
+
+    dStart = Now();
+    ulSecond = 0;
+    ulLastServed = 0;
+    ulLastFailed = 0;
+    printf("\n%8s %10s %10s\n", "second", "served/s", "failed/s");
+    while(ulSecond < ulSeconds)
+    {
+        for(uiIdx = 0; uiIdx < uiInFlight; uiIdx++)
+        {
+            psPoll[uiIdx].fd = psReq[uiIdx].iSocket;
+            psPoll[uiIdx].events = psReq[uiIdx].iSent ? POLLIN : POLLOUT;
+            psPoll[uiIdx].revents = 0;
+        }
+        poll(psPoll, uiInFlight, 100);
+
+        dNow = Now();
+        for(uiIdx = 0; uiIdx < uiInFlight; uiIdx++)
+        {
+            if(psPoll[uiIdx].revents & POLLOUT)
+            {
+                // Connected, or refused.
+                if(send(psReq[uiIdx].iSocket, g_pcRequest,
+                        sizeof(g_pcRequest) - 1, MSG_NOSIGNAL) < 0)
+                {
+                    RequestEnd(&psReq[uiIdx], 0);
+                    continue;
+                }
+                psReq[uiIdx].iSent = 1;
+            }
+            else if(psPoll[uiIdx].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                iRead = recv(psReq[uiIdx].iSocket, pcDiscard,
+                             sizeof(pcDiscard), 0);
+                if(iRead == 0)
+                {
+                    RequestEnd(&psReq[uiIdx], 1);
+                }
+                else if((iRead < 0) && (errno != EAGAIN))
+                {
+                    RequestEnd(&psReq[uiIdx], 0);
+                }
+            }
+            else if((dNow - psReq[uiIdx].dStart) * 1000 > REQUEST_TIMEOUT_MS)
+            {
+                RequestEnd(&psReq[uiIdx], 0);
+            }
+        }
+
+        if((dNow - dStart) >= (ulSecond + 1))
+        {
+            ulSecond++;
+            printf("%8lu %10lu %10lu\n", ulSecond, g_ulServed - ulLastServed,
+                   g_ulFailed - ulLastFailed);
+            ulLastServed = g_ulServed;
+            ulLastFailed = g_ulFailed;
+        }
+    }
+
+    for(uiIdx = 0; uiIdx < uiInFlight; uiIdx++)
+    {
+        close(psReq[uiIdx].iSocket);
+    }
+
+    printf("\n%lu served, %lu failed, %.1f connections/s with %u in flight\n",
+           g_ulServed, g_ulFailed, g_ulServed / (double)ulSeconds,
+           uiInFlight);
+    printf("\nafter:\n");
+    PrintConnStats();
+
+    return(0);
+}
@@ -0,0 +1,158 @@
+//###########################################################################
+// FILE:   q16_test.c
+// TITLE:  Host check and benchmark of the web server's Q16 value parser
+//###########################################################################
+//
+// Checks httpd_q16() from m3/httpd_q16.c against strtod(), rounded to the
+// nearest Q16 step, over a list of edge cases and random values with up to
+// six decimals, and then times it against the atof() and float conversion
+// it replaced.
+//
+//     make check
+//
+// The times are the host's, which has an FPU, so they only illustrate the
+// difference.  What counts is the M3, which has none; there the firmware
+// reports the clocks the last conversion took as http.value.cycles.
+//
+//###########################################################################
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "httpd_q16.h"
+
+#define RANDOM_VALUES           2000000
+#define BENCH_VALUES            1024
+#define BENCH_ROUNDS            2000
+
+//*****************************************************************************
+// The edge cases, and whether each is a number in range.  32767.99999 is,
+// as it rounds to the largest Q16 value.
+//*****************************************************************************
+typedef struct
+{
+    const char *pcText;
+    int iValid;
+}
+tCase;
+
+static const tCase g_psCases[] =
+{
+    { "0", 1 }, { "1", 1 }, { "-1", 1 }, { "+2.25", 1 }, { "-0", 1 },
+    { ".5", 1 }, { "5.", 1 }, { "3.14159", 1 }, { "0.00001", 1 },
+    { "0.0000076", 1 }, { "0.0000077", 1 }, { "0.999999999999", 1 },
+    { "00000000000001.5", 1 }, { "32767.99998", 1 }, { "-32768", 1 },
+    { "32767.99999", 1 }, { "32767.999993", 0 }, { "-32768.00001", 0 },
+    { "32768", 0 }, { "100000", 0 }, { "", 0 }, { "-", 0 }, { ".", 0 },
+    { "+", 0 }, { "1.5x", 0 }, { "abc", 0 }, { "1e3", 0 }, { " 1", 0 },
+    { "1 ", 0 }, { "--1", 0 }, { "1.2.3", 0 },
+};
+
+//*****************************************************************************
+// The value strtod() gives, rounded to the nearest Q16 step.
+//*****************************************************************************
+static long
+RefQ16(const char *pcText)
+{
+    return((long)llround(strtod(pcText, 0) * 65536.0));
+}
+
+static double
+Now(void)
+{
+    struct timespec sTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &sTime);
+    return(sTime.tv_sec + (sTime.tv_nsec / 1e9));
+}
+
+int
+main(void)
+{
+    static char ppcBench[BENCH_VALUES][16];
+    volatile long lSink;
+    volatile float fSink;
+    unsigned long ulChecks, ulFailures;
+    unsigned int uiIdx, uiRound;
+    double dValue, dStart, dQ16, dAtof;
+    char pcText[32];
+    long lValue;
+    int iValid;
+
+    ulChecks = 0;
+    ulFailures = 0;
+
+    for(uiIdx = 0; uiIdx < (sizeof(g_psCases) / sizeof(g_psCases[0]));
+        uiIdx++)
+    {
+        lValue = 12345;
+        iValid = httpd_q16(g_psCases[uiIdx].pcText, &lValue);
+        ulChecks++;
+        if((iValid != g_psCases[uiIdx].iValid) ||
+           (iValid && (lValue != RefQ16(g_psCases[uiIdx].pcText))) ||
+           (!iValid && (lValue != 12345)))
+        {
+            printf("FAIL \"%s\": %s, %ld\n", g_psCases[uiIdx].pcText,
+                   iValid ? "taken" : "refused", lValue);
+            ulFailures++;
+        }
+    }
+
+    // Random values over the whole range, with 0 to 6 decimals.
+    srand(1);
+    for(uiIdx = 0; uiIdx < RANDOM_VALUES; uiIdx++)
+    {
+        dValue = ((rand() / (double)RAND_MAX) - 0.5) * 65534.0;
+        snprintf(pcText, sizeof(pcText), "%.*f", rand() % 7, dValue);
+        ulChecks++;
+        if(!httpd_q16(pcText, &lValue) || (lValue != RefQ16(pcText)))
+        {
+            if(ulFailures++ < 10)
+            {
+                printf("FAIL \"%s\": %ld, not %ld\n", pcText, lValue,
+                       RefQ16(pcText));
+            }
+        }
+    }
+
+    printf("%lu checks, %lu failures\n", ulChecks, ulFailures);
+
+    // The benchmark, over values such as the page sends.
+    for(uiIdx = 0; uiIdx < BENCH_VALUES; uiIdx++)
+    {
+        dValue = ((rand() / (double)RAND_MAX) - 0.5) * 20.0;
+        snprintf(ppcBench[uiIdx], sizeof(ppcBench[uiIdx]), "%.*f",
+                 rand() % 4, dValue);
+    }
+
+    lSink = 0;
+    dStart = Now();
+    for(uiRound = 0; uiRound < BENCH_ROUNDS; uiRound++)
+    {
+        for(uiIdx = 0; uiIdx < BENCH_VALUES; uiIdx++)
+        {
+            httpd_q16(ppcBench[uiIdx], &lValue);
+            lSink += lValue;
+        }
+    }
+    dQ16 = (Now() - dStart) * 1e9 / (BENCH_ROUNDS * BENCH_VALUES);
+
+    fSink = 0;
+    dStart = Now();
+    for(uiRound = 0; uiRound < BENCH_ROUNDS; uiRound++)
+    {
+        for(uiIdx = 0; uiIdx < BENCH_VALUES; uiIdx++)
+        {
+            fSink += (float)atof(ppcBench[uiIdx]);
+        }
+    }
+    dAtof = (Now() - dStart) * 1e9 / (BENCH_ROUNDS * BENCH_VALUES);
+
+    printf("\n%12s %12s %8s\n", "atof ns", "q16 ns", "speedup");
+    printf("%12.1f %12.1f %7.1fx\n", dAtof, dQ16, dAtof / dQ16);
+
+    return(ulFailures ? 1 : 0);
+}
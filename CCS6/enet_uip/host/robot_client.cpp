@@ -0,0 +1,889 @@
+//###########################################################################
+// FILE:   robot_client.cpp
+// TITLE:  Host side client for the enet_uip robot command protocol
+//###########################################################################
+
+#include "robot_client.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace robot
+{
+
+typedef std::chrono::steady_clock Clock;
+
+//*****************************************************************************
+// The layout of the protocol, as in enet_uip.c and httpd.c.
+//*****************************************************************************
+static const uint8_t kUdpCmdVersion = 1;
+static const int kCmdLen = 8;
+static const int kUdpHdrLen = 8;
+static const uint8_t kStateVersion = 2;
+static const int kStateHdrLen = 12;
+
+static const uint8_t kWsFin = 0x80;
+static const uint8_t kWsMask = 0x80;
+static const uint8_t kWsBinary = 0x2;
+static const uint8_t kWsClose = 0x8;
+static const uint8_t kWsPing = 0x9;
+static const uint8_t kWsPong = 0xA;
+
+static const Command kCommands[kSetpoints] =
+{
+    Command::Velocity, Command::Omega, Command::Left, Command::Right,
+    Command::Grip, Command::Magnitude, Command::Degree, Command::InverseX,
+    Command::InverseY, Command::InverseTheta
+};
+
+// The names of the set points in a "/cmd" query, as param_name in httpd.c.
+static const char *const kHttpNames[kSetpoints] =
+{
+    "v", "w", "l", "r", "g", "m", "d", "x", "y", "t"
+};
+
+//*****************************************************************************
+// The index of a set point in the state frame.
+//*****************************************************************************
+static int
+SetpointIndex(Command command)
+{
+    for(int i = 0; i < kSetpoints; i++)
+    {
+        if(kCommands[i] == command)
+        {
+            return(i);
+        }
+    }
+
+    return(-1);
+}
+
+//*****************************************************************************
+// A value as the firmware will hold it, after the trip through 16.16 fixed
+// point.
+//*****************************************************************************
+static int32_t
+ToFixed(float value)
+{
+    double fixed = std::round((double)value * 65536.0);
+
+    fixed = std::max(std::min(fixed, 2147483647.0), -2147483648.0);
+    return((int32_t)fixed);
+}
+
+static float
+FromFixed(int32_t fixed)
+{
+    return((float)fixed / 65536.0f);
+}
+
+static void
+Put32(uint8_t *data, uint32_t value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static uint32_t
+Get32(const uint8_t *data)
+{
+    return(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8) | data[3]);
+}
+
+static float
+GetFloat(const uint8_t *data)
+{
+    uint32_t bits = Get32(data);
+    float value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return(value);
+}
+
+//*****************************************************************************
+// Format a value for "/cmd".  Five decimals are finer than a step of 16.16
+// fixed point, so the firmware, which rounds to the nearest step, ends up
+// with the same value as the other transports send.
+//*****************************************************************************
+static std::string
+HttpValue(float value)
+{
+    char text[32];
+
+    snprintf(text, sizeof(text), "%.5f", ToFixed(value) / 65536.0);
+    return(text);
+}
+
+//*****************************************************************************
+// The link to the board and what is in flight on it.  Only the client's
+// thread touches it.
+//*****************************************************************************
+struct Client::Impl
+{
+    struct Frame
+    {
+        Clock::time_point sent;
+        std::array<int32_t, kSetpoints> expect;
+        unsigned mask;
+        unsigned carried;
+    };
+
+    Client &client;
+    int fd = -1;
+    bool open = false;
+    std::vector<uint8_t> rx;
+    std::deque<Frame> inFlight;
+    std::array<int32_t, kSetpoints> model{};
+    unsigned modelMask = 0;
+    uint32_t sequence = 1;
+    Clock::time_point retryAt;
+    std::mt19937 rng{std::random_device{}()};
+
+    explicit Impl(Client &c) : client(c) {}
+
+    bool connectTo(int type, uint16_t port);
+    bool sendAll(const void *data, size_t len);
+    bool wsHandshake();
+    bool wsFrame(uint8_t opcode, const uint8_t *payload, size_t len);
+    void close();
+    bool service(std::array<float, kSetpoints> &values, unsigned dirty);
+    bool input();
+    bool wsInput();
+    bool httpInput();
+    void confirm(const State &state);
+    void expire();
+    void latency(Clock::time_point sent);
+};
+
+//*****************************************************************************
+// Open a socket to the board.  The TCP ones go without Nagle, since every
+// write is a whole message that should leave at once.
+//*****************************************************************************
+bool
+Client::Impl::connectTo(int type, uint16_t port)
+{
+    struct addrinfo hints, *result;
+    char service[8];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = type;
+    snprintf(service, sizeof(service), "%u", port);
+    if(getaddrinfo(client.m_options.host.c_str(), service, &hints, &result))
+    {
+        return(false);
+    }
+
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if((fd >= 0) && (type == SOCK_STREAM))
+    {
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if((fd < 0) || (::connect(fd, result->ai_addr, result->ai_addrlen) < 0))
+    {
+        freeaddrinfo(result);
+        close();
+        return(false);
+    }
+    freeaddrinfo(result);
+
+    return(true);
+}
+
+bool
+Client::Impl::sendAll(const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while(len)
+    {
+        ssize_t sent = ::send(fd, bytes, len, MSG_NOSIGNAL);
+
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return(false);
+        }
+        bytes += sent;
+        len -= sent;
+    }
+
+    return(true);
+}
+
+void
+Client::Impl::close()
+{
+    if(fd >= 0)
+    {
+        ::close(fd);
+    }
+    fd = -1;
+    open = false;
+    rx.clear();
+    inFlight.clear();
+    modelMask = 0;
+}
+
+//*****************************************************************************
+// Upgrade the connection to a WebSocket.  Blocks until the board answers,
+// which it does with the ACK of the request.
+//*****************************************************************************
+bool
+Client::Impl::wsHandshake()
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string key, request;
+    char buffer[512];
+    size_t got = 0;
+
+    // Sixteen random bytes in base64, which the board only echoes hashed.
+    for(int i = 0; i < 21; i++)
+    {
+        key += digits[rng() % 64];
+    }
+    key += "A==";
+
+    request = "GET /ws HTTP/1.1\r\n"
+              "Host: " + client.m_options.host + "\r\n"
+              "Upgrade: websocket\r\n"
+              "Connection: Upgrade\r\n"
+              "Sec-WebSocket-Key: " + key + "\r\n"
+              "Sec-WebSocket-Version: 13\r\n"
+              "\r\n";
+    if(!sendAll(request.data(), request.size()))
+    {
+        return(false);
+    }
+
+    while(got < sizeof(buffer))
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ssize_t len;
+
+        if(poll(&pfd, 1, 2000) <= 0)
+        {
+            return(false);
+        }
+        len = recv(fd, buffer + got, sizeof(buffer) - got, 0);
+        if(len <= 0)
+        {
+            return(false);
+        }
+        got += len;
+
+        std::string reply(buffer, got);
+        size_t end = reply.find("\r\n\r\n");
+
+        if(end != std::string::npos)
+        {
+            rx.assign(buffer + end + 4, buffer + got);
+            return(reply.compare(0, 12, "HTTP/1.1 101") == 0);
+        }
+    }
+
+    return(false);
+}
+
+//*****************************************************************************
+// Send a masked WebSocket frame, as a client must.
+//*****************************************************************************
+bool
+Client::Impl::wsFrame(uint8_t opcode, const uint8_t *payload, size_t len)
+{
+    std::vector<uint8_t> frame;
+    uint32_t mask = rng();
+
+    frame.push_back(kWsFin | opcode);
+    if(len < 126)
+    {
+        frame.push_back(kWsMask | len);
+    }
+    else
+    {
+        frame.push_back(kWsMask | 126);
+        frame.push_back(len >> 8);
+        frame.push_back(len & 0xff);
+    }
+    for(int i = 0; i < 4; i++)
+    {
+        frame.push_back(mask >> (i * 8));
+    }
+    for(size_t i = 0; i < len; i++)
+    {
+        frame.push_back(payload[i] ^ (uint8_t)(mask >> ((i & 3) * 8)));
+    }
+
+    return(sendAll(frame.data(), frame.size()));
+}
+
+//*****************************************************************************
+// Send what is waiting, opening the link first if need be.  Returns false if
+// the link failed.
+//*****************************************************************************
+bool
+Client::Impl::service(std::array<float, kSetpoints> &values, unsigned dirty)
+{
+    const Options &options = client.m_options;
+    std::vector<uint8_t> message;
+    Frame frame;
+    int count = 0;
+
+    if(!open)
+    {
+        if(Clock::now() < retryAt)
+        {
+            return(true);
+        }
+        retryAt = Clock::now() + options.reconnectDelay;
+
+        switch(options.transport)
+        {
+        case Transport::WebSocket:
+            open = connectTo(SOCK_STREAM, options.httpPort) && wsHandshake();
+            break;
+
+        case Transport::Udp:
+            open = connectTo(SOCK_DGRAM, options.udpPort);
+            break;
+
+        case Transport::Http:
+            open = connectTo(SOCK_STREAM, options.httpPort);
+            break;
+        }
+        if(!open)
+        {
+            close();
+            return(true);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(client.m_mutex);
+            client.m_connected = true;
+            client.m_metrics.connects++;
+        }
+
+        // A state frame may have come in behind the handshake.
+        if((options.transport == Transport::WebSocket) && !wsInput())
+        {
+            return(false);
+        }
+    }
+
+    if(!dirty)
+    {
+        return(true);
+    }
+
+    // Every set point waiting goes in one "/cmd" query, which the board
+    // writes to the C28 as one update.
+    if(options.transport == Transport::Http)
+    {
+        std::string request = "GET /cmd";
+        char separator = '?';
+
+        for(int i = 0; i < kSetpoints; i++)
+        {
+            if(dirty & (1u << i))
+            {
+                request += separator;
+                request += kHttpNames[i];
+                request += '=';
+                request += HttpValue(values[i]);
+                separator = '&';
+            }
+        }
+        request += " HTTP/1.1\r\nHost: " + options.host + "\r\n\r\n";
+
+        for(int i = 0; i < kSetpoints; i++)
+        {
+            frame.expect[i] = ToFixed(values[i]);
+        }
+        frame.sent = Clock::now();
+        frame.mask = 0;
+        frame.carried = dirty;
+        inFlight.push_back(frame);
+        return(sendAll(request.data(), request.size()));
+    }
+
+    if(options.transport == Transport::Udp)
+    {
+        message.resize(kUdpHdrLen);
+        message[0] = kUdpCmdVersion;
+        Put32(&message[4], sequence++);
+    }
+    frame.expect = model;
+    frame.mask = modelMask;
+    frame.carried = dirty;
+    for(int i = 0; i < kSetpoints; i++)
+    {
+        if(dirty & (1u << i))
+        {
+            uint8_t command[kCmdLen] = { (uint8_t)kCommands[i] };
+
+            Put32(&command[4], ToFixed(values[i]));
+            message.insert(message.end(), command, command + kCmdLen);
+            frame.expect[i] = ToFixed(values[i]);
+            frame.mask |= 1u << i;
+            count++;
+        }
+    }
+    model = frame.expect;
+    modelMask = frame.mask;
+
+    if(options.transport == Transport::Udp)
+    {
+        message[1] = count;
+        return(::send(fd, message.data(), message.size(), 0) >= 0);
+    }
+
+    frame.sent = Clock::now();
+    inFlight.push_back(frame);
+    return(wsFrame(kWsBinary, message.data(), message.size()));
+}
+
+//*****************************************************************************
+// Record the time to a confirmation.
+//*****************************************************************************
+void
+Client::Impl::latency(Clock::time_point sent)
+{
+    Metrics &metrics = client.m_metrics;
+    double us = std::chrono::duration<double, std::micro>(Clock::now() -
+                                                          sent).count();
+
+    metrics.confirmed++;
+    metrics.lastLatencyUs = us;
+    metrics.meanLatencyUs += (us - metrics.meanLatencyUs) /
+                             (double)metrics.confirmed;
+    metrics.maxLatencyUs = std::max(metrics.maxLatencyUs, us);
+}
+
+//*****************************************************************************
+// A state frame confirms the newest frame in flight whose set points it
+// shows, and with it all those sent before.
+//*****************************************************************************
+void
+Client::Impl::confirm(const State &state)
+{
+    std::lock_guard<std::mutex> lock(client.m_mutex);
+    int newest = -1;
+
+    for(int f = 0; f < (int)inFlight.size(); f++)
+    {
+        const Frame &frame = inFlight[f];
+        bool match = true;
+
+        for(int i = 0; match && (i < kSetpoints); i++)
+        {
+            match = !(frame.mask & (1u << i)) ||
+                    (state.setpoints[i] == FromFixed(frame.expect[i]));
+        }
+        if(match)
+        {
+            newest = f;
+        }
+    }
+    for(; newest >= 0; newest--)
+    {
+        latency(inFlight.front().sent);
+        inFlight.pop_front();
+    }
+}
+
+//*****************************************************************************
+// Give up on frames that have waited too long for a confirmation.
+//*****************************************************************************
+void
+Client::Impl::expire()
+{
+    std::lock_guard<std::mutex> lock(client.m_mutex);
+
+    while(!inFlight.empty() &&
+          ((Clock::now() - inFlight.front().sent) >
+           client.m_options.confirmTimeout))
+    {
+        inFlight.pop_front();
+        client.m_metrics.unconfirmed++;
+    }
+}
+
+//*****************************************************************************
+// Take the frames the board has sent.  Returns false if the link failed.
+//*****************************************************************************
+bool
+Client::Impl::wsInput()
+{
+    while(rx.size() >= 2)
+    {
+        size_t len = rx[1] & 0x7f;
+        size_t header = 2;
+
+        if(len == 126)
+        {
+            if(rx.size() < 4)
+            {
+                break;
+            }
+            len = (rx[2] << 8) | rx[3];
+            header = 4;
+        }
+        else if(len == 127)
+        {
+            return(false);
+        }
+        if(rx.size() < header + len)
+        {
+            break;
+        }
+
+        const uint8_t *payload = &rx[header];
+        uint8_t opcode = rx[0] & 0x0f;
+
+        if(opcode == kWsClose)
+        {
+            return(false);
+        }
+        if(opcode == kWsPing)
+        {
+            wsFrame(kWsPong, payload, len);
+        }
+        if((opcode == kWsBinary) && (len >= kStateHdrLen) &&
+           (payload[0] == kStateVersion) &&
+           (len >= kStateHdrLen + ((size_t)payload[1] + payload[2]) * 4))
+        {
+            State state;
+            const uint8_t *value = payload + kStateHdrLen;
+
+            state.timeUs = Get32(&payload[4]);
+            state.sample = Get32(&payload[8]);
+            for(int i = 0; i < payload[1]; i++, value += 4)
+            {
+                if(i < (int)state.c28.size())
+                {
+                    state.c28[i] = GetFloat(value);
+                }
+            }
+            for(int i = 0; i < payload[2]; i++, value += 4)
+            {
+                if(i < kSetpoints)
+                {
+                    state.setpoints[i] = FromFixed((int32_t)Get32(value));
+                }
+            }
+
+            confirm(state);
+
+            std::function<void(const State &)> callback;
+            {
+                std::lock_guard<std::mutex> lock(client.m_mutex);
+                client.m_state = state;
+                client.m_metrics.states++;
+                callback = client.m_onState;
+            }
+            if(callback)
+            {
+                callback(state);
+            }
+        }
+
+        rx.erase(rx.begin(), rx.begin() + header + len);
+    }
+
+    return(true);
+}
+
+//*****************************************************************************
+// Take the responses to "/cmd" requests, each with its Content-Length.
+//*****************************************************************************
+bool
+Client::Impl::httpInput()
+{
+    for(;;)
+    {
+        std::string text(rx.begin(), rx.end());
+        size_t end = text.find("\r\n\r\n");
+        size_t length = 0;
+        size_t field;
+
+        if(end == std::string::npos)
+        {
+            return(true);
+        }
+        field = text.find("Content-Length:");
+        if((field != std::string::npos) && (field < end))
+        {
+            length = strtoul(text.c_str() + field + 15, 0, 10);
+        }
+        if(text.size() < end + 4 + length)
+        {
+            return(true);
+        }
+        rx.erase(rx.begin(), rx.begin() + end + 4 + length);
+
+        std::lock_guard<std::mutex> lock(client.m_mutex);
+        if(!inFlight.empty())
+        {
+            latency(inFlight.front().sent);
+            inFlight.pop_front();
+        }
+    }
+}
+
+bool
+Client::Impl::input()
+{
+    uint8_t buffer[2048];
+    ssize_t len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if(len == 0)
+    {
+        return(false);
+    }
+    if(len < 0)
+    {
+        return((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+               (errno == EINTR));
+    }
+    if(client.m_options.transport == Transport::Udp)
+    {
+        return(true);
+    }
+    rx.insert(rx.end(), buffer, buffer + len);
+
+    return((client.m_options.transport == Transport::WebSocket) ?
+           wsInput() : httpInput());
+}
+
+//*****************************************************************************
+// Start the client's thread, which connects in the background.
+//*****************************************************************************
+Client::Client(const Options &options) : m_options(options)
+{
+    if(pipe(m_wake) == 0)
+    {
+        fcntl(m_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(m_wake[1], F_SETFL, O_NONBLOCK);
+    }
+    m_thread = std::thread(&Client::run, this);
+}
+
+Client::~Client()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    if(write(m_wake[1], "", 1) < 0)
+    {
+    }
+    m_thread.join();
+    ::close(m_wake[0]);
+    ::close(m_wake[1]);
+}
+
+//*****************************************************************************
+// Queue set points, replacing any earlier values still waiting, and wake the
+// client's thread to send them.
+//*****************************************************************************
+void
+Client::set(std::initializer_list<std::pair<Command, float>> commands)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for(const std::pair<Command, float> &command : commands)
+        {
+            int index = SetpointIndex(command.first);
+
+            if(index < 0)
+            {
+                continue;
+            }
+            m_metrics.setCalls++;
+            if(m_dirty & (1u << index))
+            {
+                m_metrics.coalesced++;
+            }
+            m_pending[index] = command.second;
+            m_dirty |= 1u << index;
+        }
+    }
+
+    if(write(m_wake[1], "", 1) < 0)
+    {
+        // The pipe is full, so the thread is due to wake anyway.
+    }
+}
+
+void
+Client::set(Command command, float value)
+{
+    set({ std::make_pair(command, value) });
+}
+
+void
+Client::onState(std::function<void(const State &)> callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_onState = callback;
+}
+
+bool
+Client::flush(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    return(m_idle.wait_for(lock, timeout, [this]
+                           { return(!m_dirty && m_quiet); }));
+}
+
+bool
+Client::connected() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_connected);
+}
+
+Metrics
+Client::metrics() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_metrics);
+}
+
+State
+Client::state() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_state);
+}
+
+//*****************************************************************************
+// The client's thread: wait for set points or data from the board, and send
+// what is waiting once there is room for it.
+//*****************************************************************************
+void
+Client::run()
+{
+    Impl impl(*this);
+    const unsigned limit = (m_options.transport == Transport::Http) ? 1 :
+                           std::max(1u, m_options.maxInFlight);
+
+    for(;;)
+    {
+        std::array<float, kSetpoints> values;
+        unsigned dirty = 0;
+        struct pollfd pfd[2];
+        int timeout = 50;
+        bool ok = true;
+
+        impl.expire();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(m_stop)
+            {
+                break;
+            }
+            if(impl.open && (impl.inFlight.size() < limit))
+            {
+                values = m_pending;
+                dirty = m_dirty;
+                m_dirty = 0;
+            }
+        }
+
+        if(!impl.service(values, dirty))
+        {
+            ok = false;
+        }
+        else if(dirty)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_metrics.sent++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quiet = impl.inFlight.empty();
+            if(!m_dirty && m_quiet)
+            {
+                m_idle.notify_all();
+            }
+        }
+
+        pfd[0].fd = m_wake[0];
+        pfd[0].events = POLLIN;
+        pfd[1].fd = impl.fd;
+        pfd[1].events = POLLIN;
+        if(ok && (poll(pfd, impl.open ? 2 : 1, timeout) > 0))
+        {
+            if(pfd[0].revents & POLLIN)
+            {
+                char drain[64];
+
+                while(read(m_wake[0], drain, sizeof(drain)) > 0)
+                {
+                }
+            }
+            if(impl.open && (pfd[1].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                ok = impl.input();
+            }
+        }
+
+        if(!ok)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_metrics.unconfirmed += impl.inFlight.size();
+            m_connected = false;
+
+            // What the board may not have taken goes again once the link is
+            // back, unless a newer value is already waiting.  The newest
+            // frame is looked at first, so that its values win.
+            for(auto frame = impl.inFlight.rbegin();
+                frame != impl.inFlight.rend(); ++frame)
+            {
+                for(int i = 0; i < kSetpoints; i++)
+                {
+                    if((frame->carried & (1u << i)) && !(m_dirty & (1u << i)))
+                    {
+                        m_pending[i] = FromFixed(frame->expect[i]);
+                        m_dirty |= 1u << i;
+                    }
+                }
+            }
+            impl.inFlight.clear();
+            impl.close();
+        }
+    }
+
+    impl.close();
+}
+
+} // namespace robot
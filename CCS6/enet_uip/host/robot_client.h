@@ -0,0 +1,172 @@
+//###########################################################################
+// FILE:   robot_client.h
+// TITLE:  Host side client for the enet_uip robot command protocol
+//###########################################################################
+//
+// One Client owns the link to one board, on a thread of its own.  Host tools
+// hand it set points with set(), which never blocks; the client sends them
+// over whichever transport it was opened with:
+//
+//     Transport::WebSocket  One TCP connection to "/ws", kept open and
+//                           reopened when it drops.  Command frames are
+//                           pipelined, up to Options::maxInFlight of them
+//                           unconfirmed, and each is confirmed by the
+//                           first state frame whose set points show it.
+//     Transport::Udp        Datagrams to UDP_CMD_PORT, with sequence
+//                           numbers.  Nothing comes back, so nothing is
+//                           confirmed and there are no latency figures.
+//     Transport::Http       "GET /cmd?v=<value>&w=<value>..." requests on
+//                           one keep-alive connection, for firmware
+//                           without the other two.  One request is sent at
+//                           a time, and is confirmed by its response.
+//
+// A set point given again before the last value went out replaces it, so
+// the board only ever sees the latest value of each.  The set points that
+// are waiting go out together, in one frame, datagram or request.  Those
+// still unconfirmed when a connection drops go again on the next one.
+//
+// Build with the rest of the tool, for example
+//
+//     g++ -std=c++14 -O2 -c robot_client.cpp
+//
+// and link with -pthread.  robot_client_test.cpp runs the client against a
+// stand-in for the board; "make check" builds and runs it.
+//
+//###########################################################################
+
+#ifndef __ROBOT_CLIENT_H__
+#define __ROBOT_CLIENT_H__
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace robot
+{
+
+//*****************************************************************************
+// The set points, by their command words in the firmware.
+//*****************************************************************************
+enum class Command : uint8_t
+{
+    Velocity = 0xA1,
+    Omega = 0xA2,
+    Left = 0xA3,
+    Right = 0xA4,
+    Grip = 0xA7,
+    Magnitude = 0xA9,
+    Degree = 0xAA,
+    InverseX = 0xAB,
+    InverseY = 0xAC,
+    InverseTheta = 0xAD
+};
+
+static const int kSetpoints = 10;
+
+enum class Transport
+{
+    WebSocket,
+    Udp,
+    Http
+};
+
+struct Options
+{
+    std::string host;
+    Transport transport = Transport::WebSocket;
+    uint16_t httpPort = 80;
+    uint16_t udpPort = 4210;
+
+    // Unconfirmed command frames allowed on the WebSocket.
+    unsigned maxInFlight = 4;
+
+    // A frame not confirmed in this time is given up on, as when another
+    // host has changed the same set point since.
+    std::chrono::milliseconds confirmTimeout{500};
+
+    std::chrono::milliseconds reconnectDelay{500};
+};
+
+//*****************************************************************************
+// A state frame from the WebSocket: the latest C28 sample and the set points
+// last written to the C28, in the order of kSetpoints above.
+//*****************************************************************************
+struct State
+{
+    uint32_t timeUs = 0;
+    uint32_t sample = 0;
+    std::array<float, 6> c28{};
+    std::array<float, kSetpoints> setpoints{};
+};
+
+//*****************************************************************************
+// Counters, and the time from sending a set point to its confirmation.
+//*****************************************************************************
+struct Metrics
+{
+    uint64_t setCalls = 0;
+    uint64_t coalesced = 0;
+    uint64_t sent = 0;
+    uint64_t confirmed = 0;
+    uint64_t unconfirmed = 0;
+    uint64_t connects = 0;
+    uint64_t states = 0;
+    double lastLatencyUs = 0;
+    double meanLatencyUs = 0;
+    double maxLatencyUs = 0;
+};
+
+class Client
+{
+public:
+    explicit Client(const Options &options);
+    ~Client();
+
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    // Queue set points.  Never blocks on the network.
+    void set(Command command, float value);
+    void set(std::initializer_list<std::pair<Command, float>> commands);
+
+    // Called on the client's thread for every state frame.
+    void onState(std::function<void(const State &)> callback);
+
+    // Wait until everything queued has been sent, and on the WebSocket and
+    // HTTP confirmed or given up on.  Returns false on timeout.
+    bool flush(std::chrono::milliseconds timeout);
+
+    bool connected() const;
+    Metrics metrics() const;
+    State state() const;
+
+private:
+    struct Impl;
+
+    void run();
+
+    Options m_options;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_idle;
+    std::array<float, kSetpoints> m_pending{};
+    unsigned m_dirty = 0;
+    bool m_stop = false;
+    bool m_connected = false;
+    bool m_quiet = true;
+    Metrics m_metrics;
+    State m_state;
+    std::function<void(const State &)> m_onState;
+    int m_wake[2] = { -1, -1 };
+    std::thread m_thread;
+};
+
+} // namespace robot
+
+#endif // __ROBOT_CLIENT_H__
@@ -0,0 +1,616 @@
+//###########################################################################
+// FILE:   robot_client_test.cpp
+// TITLE:  Test of the robot client against a stand-in for the board
+//###########################################################################
+//
+// Board below plays the firmware's side of "/ws" and "/cmd" on a loopback
+// port: it answers every WebSocket command frame with a state frame, as
+// EthernetStateGet() builds them, and every "/cmd" query with a response
+// carrying a Content-Length.  It can be told to answer slowly, so that
+// frames pile up, and to drop the first WebSocket after a number of frames.
+// The tests check
+//
+//     - that WebSocket frames are pipelined, up to Options::maxInFlight
+//     - that set points given faster than they can be sent are coalesced,
+//       and that the board ends up with the last value of each
+//     - that the client reconnects after the board drops the WebSocket and
+//       loses nothing
+//     - that the HTTP transport sends every set point waiting in one
+//       "/cmd?v=..&w=.." request
+//
+//     make check
+//
+// The handshake is not checked by the client, so the stand-in does not
+// compute a real Sec-WebSocket-Accept.
+//
+//###########################################################################
+
+#include "robot_client.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace robot;
+
+static int g_failures;
+
+#define CHECK(condition)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if(!(condition))                                                    \
+        {                                                                   \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);     \
+            g_failures++;                                                   \
+        }                                                                   \
+    }                                                                       \
+    while(0)
+
+//*****************************************************************************
+// The command words and "/cmd" names of the set points, in state frame
+// order.
+//*****************************************************************************
+static const uint8_t kWords[kSetpoints] =
+{
+    0xA1, 0xA2, 0xA3, 0xA4, 0xA7, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD
+};
+
+static const char *const kNames[kSetpoints] =
+{
+    "v", "w", "l", "r", "g", "m", "d", "x", "y", "t"
+};
+
+static int32_t
+Fixed(double value)
+{
+    return((int32_t)std::round(value * 65536.0));
+}
+
+static void
+Put32(uint8_t *data, uint32_t value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static uint32_t
+Get32(const uint8_t *data)
+{
+    return(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8) | data[3]);
+}
+
+//*****************************************************************************
+// The whole WebSocket frames at the start of rx.  Client frames are all
+// masked, and none of those sent here is over 125 bytes.
+//*****************************************************************************
+static int
+WholeFrames(const std::vector<uint8_t> &rx)
+{
+    size_t at = 0;
+    int frames = 0;
+
+    while((rx.size() >= at + 6) &&
+          (rx.size() >= at + 6 + (rx[at + 1] & 0x7f)))
+    {
+        at += 6 + (rx[at + 1] & 0x7f);
+        frames++;
+    }
+
+    return(frames);
+}
+
+//*****************************************************************************
+// The stand-in for the board.
+//*****************************************************************************
+class Board
+{
+public:
+    Board(std::chrono::milliseconds replyDelay, int dropAfter);
+    ~Board();
+
+    uint16_t port() const { return(m_port); }
+
+    int32_t setpoint(int index);
+    int maxUnanswered();
+    int frames();
+    int connects();
+    std::vector<std::string> queries();
+
+private:
+    void accept();
+    void serve(int fd);
+    void serveWs(int fd, std::vector<uint8_t> &rx);
+    void serveHttp(int fd, std::vector<uint8_t> &rx);
+    bool receive(int fd, std::vector<uint8_t> &rx, int timeout);
+    std::vector<uint8_t> stateFrame();
+
+    std::chrono::milliseconds m_replyDelay;
+    int m_dropAfter;
+    int m_listen = -1;
+    uint16_t m_port = 0;
+    std::atomic<bool> m_stop{false};
+    std::mutex m_mutex;
+    std::array<int32_t, kSetpoints> m_setpoints{};
+    int m_maxUnanswered = 0;
+    int m_frames = 0;
+    int m_connects = 0;
+    std::vector<std::string> m_queries;
+    std::vector<std::thread> m_threads;
+    std::thread m_acceptor;
+};
+
+Board::Board(std::chrono::milliseconds replyDelay, int dropAfter) :
+    m_replyDelay(replyDelay), m_dropAfter(dropAfter)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    m_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if((m_listen < 0) ||
+       (bind(m_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+       (listen(m_listen, 4) < 0) ||
+       (getsockname(m_listen, (struct sockaddr *)&addr, &len) < 0))
+    {
+        perror("stand-in board");
+        exit(2);
+    }
+    m_port = ntohs(addr.sin_port);
+    m_acceptor = std::thread(&Board::accept, this);
+}
+
+Board::~Board()
+{
+    m_stop = true;
+    m_acceptor.join();
+    for(std::thread &thread : m_threads)
+    {
+        thread.join();
+    }
+    close(m_listen);
+}
+
+int32_t
+Board::setpoint(int index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_setpoints[index]);
+}
+
+int
+Board::maxUnanswered()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_maxUnanswered);
+}
+
+int
+Board::frames()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_frames);
+}
+
+int
+Board::connects()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_connects);
+}
+
+std::vector<std::string>
+Board::queries()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return(m_queries);
+}
+
+void
+Board::accept()
+{
+    while(!m_stop)
+    {
+        struct pollfd pfd = { m_listen, POLLIN, 0 };
+
+        if(poll(&pfd, 1, 20) > 0)
+        {
+            int fd = ::accept(m_listen, 0, 0);
+
+            if(fd >= 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_connects++;
+                m_threads.emplace_back(&Board::serve, this, fd);
+            }
+        }
+    }
+}
+
+//*****************************************************************************
+// Wait up to timeout ms for more bytes.  Returns false once the connection
+// has closed or the board is stopping.
+//*****************************************************************************
+bool
+Board::receive(int fd, std::vector<uint8_t> &rx, int timeout)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    uint8_t buffer[2048];
+    ssize_t len;
+
+    if(m_stop)
+    {
+        return(false);
+    }
+    if(poll(&pfd, 1, timeout) <= 0)
+    {
+        return(true);
+    }
+    len = recv(fd, buffer, sizeof(buffer), 0);
+    if(len <= 0)
+    {
+        return(false);
+    }
+    rx.insert(rx.end(), buffer, buffer + len);
+
+    return(true);
+}
+
+void
+Board::serve(int fd)
+{
+    std::vector<uint8_t> rx;
+    std::string text;
+
+    while(receive(fd, rx, 20))
+    {
+        text.assign(rx.begin(), rx.end());
+        if(text.find("\r\n\r\n") == std::string::npos)
+        {
+            continue;
+        }
+        if(text.compare(0, 8, "GET /ws ") == 0)
+        {
+            serveWs(fd, rx);
+        }
+        else
+        {
+            serveHttp(fd, rx);
+        }
+        break;
+    }
+
+    close(fd);
+}
+
+//*****************************************************************************
+// A state frame with the set points as they stand.
+//*****************************************************************************
+std::vector<uint8_t>
+Board::stateFrame()
+{
+    std::vector<uint8_t> frame(2 + 12 + (6 + kSetpoints) * 4);
+    uint8_t *payload = &frame[2];
+
+    frame[0] = 0x82;
+    frame[1] = frame.size() - 2;
+    payload[0] = 2;
+    payload[1] = 6;
+    payload[2] = kSetpoints;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Put32(&payload[8], m_frames);
+    for(int i = 0; i < kSetpoints; i++)
+    {
+        Put32(&payload[12 + (6 + i) * 4], m_setpoints[i]);
+    }
+
+    return(frame);
+}
+
+//*****************************************************************************
+// Answer the upgrade, then every command frame with a state frame, one at a
+// time and after the reply delay, counting the frames that have piled up.
+//*****************************************************************************
+void
+Board::serveWs(int fd, std::vector<uint8_t> &rx)
+{
+    static const char reply[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: c3RhbmQtaW4gYm9hcmQ=\r\n"
+        "\r\n";
+    std::string text(rx.begin(), rx.end());
+    std::vector<uint8_t> state;
+    int served = 0;
+    bool first;
+
+    rx.erase(rx.begin(), rx.begin() + text.find("\r\n\r\n") + 4);
+    state = stateFrame();
+    if((send(fd, reply, sizeof(reply) - 1, MSG_NOSIGNAL) < 0) ||
+       (send(fd, state.data(), state.size(), MSG_NOSIGNAL) < 0))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        first = (m_connects == 1);
+    }
+
+    do
+    {
+        int waiting = WholeFrames(rx);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_maxUnanswered = std::max(m_maxUnanswered, waiting);
+        }
+        if(!waiting)
+        {
+            continue;
+        }
+
+        uint8_t opcode = rx[0] & 0x0f;
+        size_t len = rx[1] & 0x7f;
+        std::vector<uint8_t> payload(len);
+
+        for(size_t i = 0; i < len; i++)
+        {
+            payload[i] = rx[6 + i] ^ rx[2 + (i & 3)];
+        }
+        rx.erase(rx.begin(), rx.begin() + 6 + len);
+        if(opcode != 0x2)
+        {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for(size_t i = 0; i + 8 <= len; i += 8)
+            {
+                const uint8_t *word = std::find(kWords, kWords + kSetpoints,
+                                                payload[i]);
+
+                if(word != kWords + kSetpoints)
+                {
+                    m_setpoints[word - kWords] =
+                        (int32_t)Get32(&payload[i + 4]);
+                }
+            }
+            m_frames++;
+        }
+
+        std::this_thread::sleep_for(m_replyDelay);
+        state = stateFrame();
+        if(send(fd, state.data(), state.size(), MSG_NOSIGNAL) < 0)
+        {
+            return;
+        }
+        if(first && (++served == m_dropAfter))
+        {
+            return;
+        }
+    }
+    while(receive(fd, rx, WholeFrames(rx) ? 0 : 20));
+}
+
+//*****************************************************************************
+// Answer "/cmd" queries on a keep-alive connection.
+//*****************************************************************************
+void
+Board::serveHttp(int fd, std::vector<uint8_t> &rx)
+{
+    static const char reply[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 2\r\n"
+        "\r\n"
+        "OK";
+
+    do
+    {
+        std::string text(rx.begin(), rx.end());
+        size_t end = text.find("\r\n\r\n");
+
+        if(end == std::string::npos)
+        {
+            continue;
+        }
+        rx.erase(rx.begin(), rx.begin() + end + 4);
+
+        std::string query = text.substr(0, text.find(' ', 4)).substr(4);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            size_t at = query.find('?');
+
+            m_queries.push_back(query);
+            while(at != std::string::npos)
+            {
+                size_t next = query.find('&', at + 1);
+                std::string param = query.substr(at + 1, next - at - 1);
+                size_t equals = param.find('=');
+
+                for(int i = 0; i < kSetpoints; i++)
+                {
+                    if(param.compare(0, equals, kNames[i]) == 0)
+                    {
+                        m_setpoints[i] =
+                            Fixed(strtod(param.c_str() + equals + 1, 0));
+                    }
+                }
+                at = next;
+            }
+        }
+
+        std::this_thread::sleep_for(m_replyDelay);
+        if(send(fd, reply, sizeof(reply) - 1, MSG_NOSIGNAL) < 0)
+        {
+            return;
+        }
+    }
+    while(receive(fd, rx, 20));
+}
+
+static Options
+BoardOptions(const Board &board, Transport transport)
+{
+    Options options;
+
+    options.host = "127.0.0.1";
+    options.httpPort = board.port();
+    options.transport = transport;
+    options.reconnectDelay = std::chrono::milliseconds(50);
+
+    return(options);
+}
+
+//*****************************************************************************
+// Set points given faster than the board answers pile up as pipelined
+// frames, no more than maxInFlight of them, and the rest are coalesced.
+//*****************************************************************************
+static void
+TestPipelining(void)
+{
+    Board board(std::chrono::milliseconds(5), 0);
+    Options options = BoardOptions(board, Transport::WebSocket);
+    Metrics metrics;
+
+    options.maxInFlight = 4;
+    {
+        Client client(options);
+
+        for(int i = 0; i < 400; i++)
+        {
+            client.set({ { Command::Velocity, i * 0.01f },
+                         { Command::Omega, -0.5f } });
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        CHECK(client.flush(std::chrono::seconds(5)));
+        metrics = client.metrics();
+    }
+
+    printf("pipelining: %llu set, %llu coalesced, %llu frames, "
+           "%d in flight at most, mean latency %.0f us\n",
+           (unsigned long long)metrics.setCalls,
+           (unsigned long long)metrics.coalesced,
+           (unsigned long long)metrics.sent, board.maxUnanswered(),
+           metrics.meanLatencyUs);
+    CHECK(board.maxUnanswered() >= 2);
+    CHECK(board.maxUnanswered() <= 4);
+    CHECK(metrics.coalesced > 0);
+    CHECK(metrics.sent < metrics.setCalls / 2);
+    CHECK((int)metrics.sent == board.frames());
+    CHECK(metrics.confirmed == metrics.sent);
+    CHECK(metrics.unconfirmed == 0);
+    CHECK(board.setpoint(0) == Fixed(399 * 0.01f));
+    CHECK(board.setpoint(1) == Fixed(-0.5));
+}
+
+//*****************************************************************************
+// The board drops the WebSocket after three frames; the client opens another
+// and every set point still gets there.
+//*****************************************************************************
+static void
+TestReconnect(void)
+{
+    Board board(std::chrono::milliseconds(0), 3);
+    Options options = BoardOptions(board, Transport::WebSocket);
+    Metrics metrics;
+
+    {
+        Client client(options);
+
+        for(int i = 1; i <= 10; i++)
+        {
+            client.set(Command::Right, (float)i);
+            CHECK(client.flush(std::chrono::seconds(2)));
+            CHECK(board.setpoint(3) == Fixed(i));
+        }
+        metrics = client.metrics();
+        CHECK(client.connected());
+    }
+
+    printf("reconnect: %llu connects, %llu frames, %llu unconfirmed\n",
+           (unsigned long long)metrics.connects,
+           (unsigned long long)metrics.sent,
+           (unsigned long long)metrics.unconfirmed);
+    CHECK(metrics.connects == 2);
+    CHECK(board.connects() == 2);
+}
+
+//*****************************************************************************
+// The HTTP transport puts every set point waiting in one "/cmd" query, and
+// coalesces those given while a request is out.
+//*****************************************************************************
+static void
+TestHttp(void)
+{
+    Board board(std::chrono::milliseconds(10), 0);
+    Options options = BoardOptions(board, Transport::Http);
+    std::vector<std::string> queries;
+    Metrics metrics;
+
+    {
+        Client client(options);
+
+        client.set({ { Command::Velocity, 0.25f }, { Command::Omega, -1.5f },
+                     { Command::Grip, 1.0f } });
+        CHECK(client.flush(std::chrono::seconds(2)));
+        client.set(Command::InverseTheta, 0.1f);
+        CHECK(client.flush(std::chrono::seconds(2)));
+        for(int i = 0; i < 50; i++)
+        {
+            client.set(Command::Left, i * 0.5f);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        CHECK(client.flush(std::chrono::seconds(2)));
+        metrics = client.metrics();
+    }
+
+    queries = board.queries();
+    printf("http: %zu requests for %llu set points, first \"%s\"\n",
+           queries.size(), (unsigned long long)metrics.setCalls,
+           queries.empty() ? "" : queries[0].c_str());
+    CHECK(queries.size() >= 3);
+    CHECK(queries.size() < 20);
+    if(queries.size() >= 2)
+    {
+        CHECK(queries[0] == "/cmd?v=0.25000&w=-1.50000&g=1.00000");
+        CHECK(queries[1] == "/cmd?t=0.10001");
+    }
+    CHECK((int)queries.size() == (int)metrics.sent);
+    CHECK(metrics.confirmed == metrics.sent);
+    CHECK(board.setpoint(0) == Fixed(0.25));
+    CHECK(board.setpoint(1) == Fixed(-1.5));
+    CHECK(board.setpoint(4) == Fixed(1.0));
+    CHECK(board.setpoint(9) == Fixed(0.1f));
+    CHECK(board.setpoint(2) == Fixed(49 * 0.5f));
+}
+
+int
+main(void)
+{
+    TestPipelining();
+    TestReconnect();
+    TestHttp();
+
+    printf("%s, %d failures\n", g_failures ? "FAILED" : "passed", g_failures);
+
+    return(g_failures ? 1 : 0);
+}
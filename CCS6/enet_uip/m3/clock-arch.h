@@ -12,12 +12,19 @@
 #define __CLOCK_ARCH_H__
 
 // Define how many clock ticks in one second.
-// Note:  This should match the value of SYSTICKHZ in the main program.
-#define CLOCK_CONF_SECOND       100
+// Note:  clock_time() counts in milliseconds of the timebase, which is kept
+// by the SysTick at SYSTICKHZ in the main program.
+#define CLOCK_CONF_SECOND       1000
 
 // Define the clock type used for returning system ticks.
 typedef unsigned long clock_time_t;
 
+// The microsecond timebase, for timing events (see enet_uip.c).
+extern unsigned long long TimebaseGetUs(void);
+extern unsigned long TimebaseStamp(void);
+extern unsigned long TimebaseCycles(void);
+extern unsigned long TimebaseGetMs(void);
+
 #endif // __CLOCK_ARCH_H__
 
 
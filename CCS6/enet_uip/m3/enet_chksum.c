@@ -0,0 +1,126 @@
+//###########################################################################
+// FILE:   enet_chksum.c
+// TITLE:  The Internet checksum, a word at a time
+//###########################################################################
+//
+// Kept apart from enet_uip.c, with nothing but <stdint.h> to depend on, so
+// that host/chksum_test.c can check it against uIP's byte at a time sum and
+// time it.
+//
+//###########################################################################
+
+#include "enet_chksum.h"
+
+//*****************************************************************************
+// The sum a byte pair at a time, as uIP's own chksum() does it.
+//*****************************************************************************
+static uint16_t
+EthernetChksumBytes(uint16_t usSum, const uint8_t *pucData, uint16_t usLen)
+{
+    const uint8_t *pucLast;
+    uint16_t usTemp;
+
+    // Add up the data as big endian 16-bit words, folding in the carries.
+    pucLast = pucData + usLen - 1;
+    while(pucData < pucLast)
+    {
+        usTemp = (pucData[0] << 8) + pucData[1];
+        usSum += usTemp;
+        if(usSum < usTemp)
+        {
+            usSum++;
+        }
+        pucData += 2;
+    }
+
+    // Pad an odd last byte with zero.
+    if(pucData == pucLast)
+    {
+        usTemp = pucData[0] << 8;
+        usSum += usTemp;
+        if(usSum < usTemp)
+        {
+            usSum++;
+        }
+    }
+
+    return(usSum);
+}
+
+//*****************************************************************************
+// The same sum a word at a time.  The one's complement sum does not depend on
+// the byte order, so the data is added up as little endian words into a
+// 64-bit accumulator, which the compiler keeps in a register pair with an
+// ADDS/ADC per word, and the carries are folded in and the bytes swapped
+// back at the end.  The main loop is unrolled eight words deep so that the
+// loads can be issued as LDM bursts.  Every sum in this driver starts on an
+// even address; the rare odd one is left to the byte loop above.
+//*****************************************************************************
+uint16_t
+EthernetChksum(uint16_t usSum, const uint8_t *pucData, uint16_t usLen)
+{
+    const uint32_t *pulData;
+    uint64_t ullSum;
+    uint32_t ulSum;
+
+    if((uintptr_t)pucData & 1)
+    {
+        return(EthernetChksumBytes(usSum, pucData, usLen));
+    }
+
+    // Bring the pointer to a word boundary.
+    ullSum = 0;
+    if(((uintptr_t)pucData & 2) && (usLen >= 2))
+    {
+        ullSum = *(const uint16_t *)pucData;
+        pucData += 2;
+        usLen -= 2;
+    }
+
+    pulData = (const uint32_t *)pucData;
+    while(usLen >= 32)
+    {
+        ullSum += pulData[0];
+        ullSum += pulData[1];
+        ullSum += pulData[2];
+        ullSum += pulData[3];
+        ullSum += pulData[4];
+        ullSum += pulData[5];
+        ullSum += pulData[6];
+        ullSum += pulData[7];
+        pulData += 8;
+        usLen -= 32;
+    }
+    while(usLen >= 4)
+    {
+        ullSum += *pulData++;
+        usLen -= 4;
+    }
+
+    // A trailing half word, and an odd last byte, which is the high byte of
+    // a big endian word padded with zero.
+    pucData = (const uint8_t *)pulData;
+    if(usLen >= 2)
+    {
+        ullSum += *(const uint16_t *)pucData;
+        pucData += 2;
+        usLen -= 2;
+    }
+    if(usLen)
+    {
+        ullSum += *pucData;
+    }
+
+    // Fold the carries into 16 bits.
+    ullSum = (ullSum & 0xffffffff) + (ullSum >> 32);
+    ulSum = (uint32_t)((ullSum & 0xffffffff) + (ullSum >> 32));
+    ulSum = (ulSum & 0xffff) + (ulSum >> 16);
+    ulSum = (ulSum & 0xffff) + (ulSum >> 16);
+
+    // Swap back to a big endian sum and add it to the one passed in.
+    ulSum = ((ulSum & 0xff) << 8) | (ulSum >> 8);
+    ulSum += usSum;
+    ulSum = (ulSum & 0xffff) + (ulSum >> 16);
+
+    return((uint16_t)ulSum);
+}
@@ -0,0 +1,19 @@
+//###########################################################################
+// FILE:   enet_chksum.h
+// TITLE:  The Internet checksum, a word at a time
+//###########################################################################
+
+#ifndef __ENET_CHKSUM_H__
+#define __ENET_CHKSUM_H__
+
+#include <stdint.h>
+
+//*****************************************************************************
+// Add usLen bytes at pucData, as big endian 16-bit words, to the one's
+// complement sum usSum, and return the new sum, in host byte order.  An odd
+// last byte is padded with zero.  Needs a little endian processor.
+//*****************************************************************************
+extern uint16_t EthernetChksum(uint16_t usSum, const uint8_t *pucData,
+                               uint16_t usLen);
+
+#endif // __ENET_CHKSUM_H__
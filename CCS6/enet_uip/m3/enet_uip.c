@@ -40,6 +40,7 @@
 #include "uip/uip.h"
 #include "uip/uip_arp.h"
 #include "httpd.h"
+#include "enet_chksum.h"
 #include "dhcpc/dhcpc.h"
 
 //*****************************************************************************
@@ -101,14 +102,30 @@
 #define M3_MASTER 0
 #define C28_MASTER 1
 void Shared_Ram_dataRead_m3(void);
-void Shared_Ram_dataWrite_m3(int,float);
+void Shared_Ram_dataWrite_m3(int,long);
 
 float m3_r_array[2048]; // this array is mapped to S0
-float m3_r_w_array[2048]; // this array is mapped to S2
+long m3_r_w_array[2048]; // this array is mapped to S2
 
 #pragma DATA_SECTION(m3_r_array,"SHARERAMS0");
 #pragma DATA_SECTION(m3_r_w_array,"SHARERAMS2");
 
+//
+// Words 0 to 9 of S2 are the set points the C28 runs on, in Q16 fixed point
+// (signed, 16 fractional bits); the M3 has no FPU, so only the C28 turns
+// them into floats.  Word 10 counts changes to them: it is odd while the M3
+// is writing them, so the C28 can tell a half written update and keep its
+// last set points instead.  Both are written through volatile so the stores
+// stay in order.
+//
+#define SHARED_SEQ              10
+#define SHARED_SETPOINT(n)      (((volatile long *)m3_r_w_array)[n])
+#define SHARED_SEQ_WORD                                                     \
+    (((volatile unsigned long *)m3_r_w_array)[SHARED_SEQ])
+void Shared_Ram_updateBegin_m3(void);
+void Shared_Ram_updateEnd_m3(void);
+static unsigned long g_ulSharedDepth;
+
 
 #ifdef _FLASH
 // These are defined by the linker (see device linker command file)
@@ -125,7 +142,7 @@ extern unsigned long RamfuncsLoadSize;
 //*****************************************************************************
 // Defines for setting up the system clock.
 //*****************************************************************************
-#define SYSTICKHZ               CLOCK_CONF_SECOND
+#define SYSTICKHZ               100
 #define SYSTICKMS               (1000 / SYSTICKHZ)
 #define SYSTICKUS               (1000000 / SYSTICKHZ)
 #define SYSTICKNS               (1000000000 / SYSTICKHZ)
@@ -133,10 +150,176 @@ extern unsigned long RamfuncsLoadSize;
 //*****************************************************************************
 // Macro for accessing the Ethernet header information in the buffer.
 //*****************************************************************************
-u8_t ucUIPBuffer[UIP_BUFSIZE + 2];
 u8_t *uip_buf;
 
 #define BUF                     ((struct uip_eth_hdr *)uip_buf)
+#define TCPBUF                  ((uip_tcpip_hdr *)&uip_buf[UIP_LLH_LEN])
+
+//*****************************************************************************
+// The packet buffer pool.  Every packet the driver receives or sends lives in
+// one of these fixed size blocks.  The blocks are word aligned and the frame
+// is stored two bytes in, so that the data following the two length bytes
+// exchanged with the FIFO is word aligned for the uDMA (the odd half-word
+// rule).  Room is left for the extra word the DMA transfers past the end of
+// the frame.  The free blocks are kept on a stack, so that a block is taken
+// or given back in constant time from the interrupt or the main loop.  The
+// pool lives in DMARAM, shared RAM the uDMA can reach (see
+// enet_uip_m3_flash.cmd).
+//*****************************************************************************
+#ifndef NUM_PKT_BUFFERS
+#define NUM_PKT_BUFFERS         6
+#endif
+
+#define PKT_BUFFER_WORDS        ((UIP_BUFSIZE + 2 + 3 + 3) / 4)
+#define PKT_BUFFER(ulIdx)       ((u8_t *)g_pulPktPool[ulIdx] + 2)
+
+#pragma DATA_SECTION(g_pulPktPool, "DMARAM")
+static unsigned long g_pulPktPool[NUM_PKT_BUFFERS][PKT_BUFFER_WORDS];
+static u8_t *g_ppucPktFree[NUM_PKT_BUFFERS];
+static unsigned long g_ulPktFree;
+
+//*****************************************************************************
+// Pool counters: the lowest number of free blocks seen and the number of
+// times a block was wanted but none was left.
+//*****************************************************************************
+unsigned long g_ulPktFreeMin;
+unsigned long g_ulPktEmpty;
+
+//*****************************************************************************
+// States of a receive ring slot.
+//*****************************************************************************
+#define PKT_FREE                0
+#define PKT_FILLING             1
+#define PKT_READY               2
+
+//*****************************************************************************
+// The receive ring.  The Ethernet interrupt takes a block from the pool for
+// each received frame and DMAs the frame into it in the background, and the
+// main loop hands the blocks to uIP in place.  A reply built over a received
+// frame is transmitted straight from its block, otherwise the block goes
+// back to the pool.
+//*****************************************************************************
+#define NUM_RX_BUFFERS          4
+
+static u8_t * volatile g_ppucRxBuf[NUM_RX_BUFFERS];
+static volatile unsigned short g_pusRxLength[NUM_RX_BUFFERS];
+static volatile unsigned char g_pucRxState[NUM_RX_BUFFERS];
+
+//*****************************************************************************
+// Set when the interrupt has left a frame in the FIFO for want of a ring slot
+// or a block, so that the stall is only counted once.
+//*****************************************************************************
+static tBoolean g_bRxStalled;
+
+//*****************************************************************************
+// The ring indices.  The head is the slot the interrupt fills next and is
+// only written by the interrupt, the tail is the next slot to be handed to
+// uIP and is only written by the main loop.
+//*****************************************************************************
+static volatile unsigned long g_ulRxHead;
+static unsigned long g_ulRxTail;
+
+//*****************************************************************************
+// The early frame classifier.  The interrupt reads the headers of each frame
+// out of the FIFO itself before starting the DMA, and discards frames that
+// uIP has no use for without moving the rest of them.  TCP and UDP frames
+// are only accepted for the local ports listed here.  The classifier can be
+// switched off at run time through g_bEthFilter.
+//*****************************************************************************
+#ifndef ETH_FILTER_TCP_PORTS
+#define ETH_FILTER_TCP_PORTS    80
+#endif
+
+#ifndef UDP_CMD_PORT
+#define UDP_CMD_PORT            4210
+#endif
+
+#ifndef TELEM_PORT
+#define TELEM_PORT              4211
+#endif
+
+#ifndef ETH_FILTER_UDP_PORTS
+#define ETH_FILTER_UDP_PORTS    68, UDP_CMD_PORT, TELEM_PORT
+#endif
+
+static const unsigned short g_pusFilterTCPPorts[] = { ETH_FILTER_TCP_PORTS };
+static const unsigned short g_pusFilterUDPPorts[] = { ETH_FILTER_UDP_PORTS };
+volatile tBoolean g_bEthFilter = true;
+
+//*****************************************************************************
+// The number of words after WORD 0 read to classify a frame.  They cover the
+// Ethernet header, the IPv4 header and the TCP/UDP ports, and the target
+// address of an ARP packet.
+//*****************************************************************************
+#define ETH_PEEK_WORDS          10
+
+//*****************************************************************************
+// Reasons for discarding a received frame before it reaches uIP, and the
+// number of frames discarded for each.
+//     ETH_DROP_SIZE  -> too large for a receive buffer.
+//     ETH_DROP_TYPE  -> neither IPv4 nor ARP (IPv6, ...).
+//     ETH_DROP_ARP   -> ARP for another host.
+//     ETH_DROP_ADDR  -> IPv4 for another host, broadcast or multicast.
+//     ETH_DROP_PROTO -> IPv4 other than ICMP, TCP or UDP.
+//     ETH_DROP_PORT  -> TCP or UDP for a port nobody listens on.
+//*****************************************************************************
+#define ETH_DROP_SIZE           0
+#define ETH_DROP_TYPE           1
+#define ETH_DROP_ARP            2
+#define ETH_DROP_ADDR           3
+#define ETH_DROP_PROTO          4
+#define ETH_DROP_PORT           5
+#define NUM_ETH_DROPS           6
+#define ETH_DROP_NONE           NUM_ETH_DROPS
+
+unsigned long g_pulEthDrops[NUM_ETH_DROPS];
+
+//*****************************************************************************
+// The transmit queue.  The main loop queues packets and the Ethernet interrupt
+// moves them into the MAC one after the other.  Once a packet has been DMAed
+// into the FIFO its block is no longer needed, and the interrupt gives it
+// back to the pool.  A packet with a payload of its own has only its headers
+// in pucBuf; the lPayloadLen bytes at pucPayload are chained on behind them
+// by the uDMA.
+//*****************************************************************************
+#define NUM_TX_DESCRIPTORS      4
+
+typedef struct
+{
+    unsigned char *pucBuf;
+    long lBufLen;
+    const unsigned char *pucPayload;
+    long lPayloadLen;
+}
+tTxDescriptor;
+
+static tTxDescriptor g_psTxQueue[NUM_TX_DESCRIPTORS];
+
+//*****************************************************************************
+// The free running queue indices.  The head is only written by the main loop
+// and the tail only by the interrupt.
+//*****************************************************************************
+static volatile unsigned long g_ulTxHead;
+static volatile unsigned long g_ulTxTail;
+
+#define TX_QUEUE_SPACE()        ((g_ulTxHead - g_ulTxTail) < NUM_TX_DESCRIPTORS)
+
+//*****************************************************************************
+// The scatter-gather task list for a packet with a separate payload: one
+// task for the headers and one for the payload.  The uDMA reads it, so it is
+// in DMARAM too.
+//*****************************************************************************
+#pragma DATA_SECTION(g_psTxTaskList, "DMARAM")
+#pragma DATA_ALIGN(g_psTxTaskList, 16)
+static tDMAControlTable g_psTxTaskList[2];
+
+//*****************************************************************************
+// The payload of the TCP segment uIP is building, when the application has
+// handed it over with EthernetSendNoCopy() instead of uip_send().  uIP leaves
+// the payload area of uip_buf empty and the checksum and transmit code take
+// the data from here.
+//*****************************************************************************
+static const unsigned char *g_pucTxPayload;
 
 //*****************************************************************************
 // A set of flags.  The flag bits are defined as follows:
@@ -144,11 +327,17 @@ u8_t *uip_buf;
 //     1 -> An RX Packet has been received.
 //     2 -> A TX packet DMA transfer is pending.
 //     3 -> A RX packet DMA transfer is pending.
+//     4 -> The main loop is draining the receive ring (RX polling mode).
+//     5 -> A TX packet has been moved into the MAC.
+//     6 -> The PHY has raised an interrupt (link state change).
 //*****************************************************************************
 #define FLAG_SYSTICK            0
 #define FLAG_RXPKT              1
 #define FLAG_TXPKT              2
 #define FLAG_RXPKTPEND          3
+#define FLAG_RXPOLL             4
+#define FLAG_TXDONE             5
+#define FLAG_PHYINT             6
 static volatile unsigned long g_ulFlags;
 
 //*****************************************************************************
@@ -156,13 +345,429 @@ static volatile unsigned long g_ulFlags;
 //*****************************************************************************
 volatile unsigned long g_ulTickCounter = 0;
 
+//*****************************************************************************
+// The timebase: the tick count plus the cycles the SysTick has counted down
+// since the last tick, which gives the time since start up to the
+// microsecond.  g_ulTimebaseCyclesPerUs is the number of processor clocks in
+// a microsecond and g_ulTimebaseReload the value the SysTick counts down
+// from.  clock_time(), and so every uIP timer, counts in ms on it.
+//*****************************************************************************
+static unsigned long g_ulTimebaseCyclesPerUs;
+static unsigned long g_ulTimebaseReload;
+
+//*****************************************************************************
+// Ethernet servicing modes.  In interrupt mode the Ethernet and uDMA
+// interrupts drive the driver.  Under heavy load the main loop switches to
+// polling mode, where those interrupts are masked in the NVIC and the main
+// loop calls the Ethernet interrupt handler directly on every pass.
+//*****************************************************************************
+#define ETH_MODE_INT            0
+#define ETH_MODE_POLL           1
+
+//*****************************************************************************
+// Thresholds for the switch between the servicing modes, in received frames
+// per second measured over a window of ETH_LOAD_WINDOW_MS.  The gap between
+// the two keeps the mode from flapping.
+//*****************************************************************************
+#ifndef ETH_LOAD_WINDOW_MS
+#define ETH_LOAD_WINDOW_MS      100
+#endif
+
+#ifndef ETH_POLL_ENTER_FPS
+#define ETH_POLL_ENTER_FPS      2000
+#endif
+
+#ifndef ETH_POLL_EXIT_FPS
+#define ETH_POLL_EXIT_FPS       200
+#endif
+
+//*****************************************************************************
+// Load counters.  g_ulEthMode is the mode currently active,
+// g_pulEthModeTicks holds the time spent in each mode in SysTicks, and
+// g_ulRxFrames counts every frame taken out of the receive FIFO.
+//*****************************************************************************
+volatile unsigned long g_ulEthMode = ETH_MODE_INT;
+volatile unsigned long g_pulEthModeTicks[2];
+unsigned long g_ulEthModeSwitches;
+volatile unsigned long g_ulRxFrames;
+
+//*****************************************************************************
+// TCP connection reclaim.  Once per periodic timer the connection table is
+// checked, and when fewer than CONN_RESERVE connections are free, those only
+// waiting out the end of a close (TIME_WAIT, or FIN_WAIT_2 for longer than
+// CONN_FIN_WAIT_TICKS periodic ticks) are closed at once to make room for new
+// ones.  The web server also drops idle connections sooner while the table
+// is that full.  tcp.conn.accept counts the connections the web server has
+// taken, and tcp.conn.aps the rate over the last second, so that a churn run
+// (host/conn_churn.c) can be read off against tcp.conn.reclaim.
+//*****************************************************************************
+#ifndef CONN_RESERVE
+#define CONN_RESERVE            2
+#endif
+
+#ifndef CONN_FIN_WAIT_TICKS
+#define CONN_FIN_WAIT_TICKS     4
+#endif
+
+static unsigned long g_ulConnFree = UIP_CONNS;
+unsigned long g_ulConnReclaimed;
+unsigned long g_ulConnAcceptPerSec;
+
+//*****************************************************************************
+// SYN overload handling.  uIP silently drops a SYN for a new connection when
+// its connection table is full, and the client only tries again a second or
+// more later.  Instead such a SYN is held, with its block, in a backlog of
+// SYN_BACKLOG entries and handed to uIP as soon as a connection is free.  A
+// SYN that finds the backlog full, or has waited in it for SYN_BACKLOG_MS,
+// is answered with a RST straight away.
+//*****************************************************************************
+#ifndef SYN_BACKLOG
+#define SYN_BACKLOG             2
+#endif
+
+#ifndef SYN_BACKLOG_MS
+#define SYN_BACKLOG_MS          500
+#endif
+
+typedef struct
+{
+    u8_t *pucBuf;
+    unsigned short usLen;
+    unsigned long ulTick;
+}
+tSynBacklog;
+
+static tSynBacklog g_psSynBacklog[SYN_BACKLOG];
+static unsigned long g_ulSynBacklogLen;
+
+//*****************************************************************************
+// The number of SYNs put in the backlog, served from it, and reset.
+//*****************************************************************************
+unsigned long g_ulSynBacklogged;
+unsigned long g_ulSynServed;
+unsigned long g_ulSynReset;
+
+//*****************************************************************************
+// What to do with a received IP packet, as decided by EthernetSynCheck().
+//*****************************************************************************
+#define SYN_PASS                0
+#define SYN_HOLD                1
+#define SYN_RESET               2
+#define SYN_DROP                3
+
+//*****************************************************************************
+// TCP header flags, which uIP keeps to itself.
+//*****************************************************************************
+#define TCP_FLAG_FIN            0x01
+#define TCP_FLAG_SYN            0x02
+#define TCP_FLAG_RST            0x04
+#define TCP_FLAG_PSH            0x08
+#define TCP_FLAG_ACK            0x10
+
+//*****************************************************************************
+// The segments the web server sends beyond the one uIP builds (see
+// EthernetSendMore()).  Each has a block of its own for its headers, and for
+// its data too when that is copied; they are queued behind uIP's segment,
+// with headers made from its, once uip_arp_out() has resolved it.
+//*****************************************************************************
+typedef struct
+{
+    unsigned char *pucBuf;
+    const unsigned char *pucPayload;
+    long lLen;
+    unsigned long ulSeq;
+}
+tTxMore;
+
+static tTxMore g_psTxMore[NUM_TX_DESCRIPTORS - 1];
+static unsigned long g_ulTxMore;
+static struct uip_conn *g_psTxMoreConn;
+
+//*****************************************************************************
+// CPU load.  In interrupt mode the main loop sleeps in WFI while it has
+// nothing to do, and the cycles spent asleep are added up in g_ulIdleCycles.
+// Once a second they are turned into the idle cycles and the load in percent
+// over that second.  Polling mode never sleeps and shows as fully loaded.
+//*****************************************************************************
+static unsigned long g_ulIdleCycles;
+unsigned long g_ulIdleCyclesPerSec;
+unsigned long g_ulCpuLoad;
+
+//*****************************************************************************
+// Link handling.  The PHY raises ETH_INT_PHY when the link goes up or down,
+// and the main loop pauses the network stack while it is down.  The PHY
+// interrupt is enabled through ETH_PHY_INT_REG; in case the PHY interrupt is
+// not wired to the MAC the link state is also read every ETH_LINK_POLL_MS.
+//*****************************************************************************
+#ifndef ETH_PHY_INT_REG
+#define ETH_PHY_INT_REG         PHY_MR17
+#define ETH_PHY_INT_ENABLE      PHY_MR17_LSCHG_IE
+#endif
+
+#ifndef ETH_LINK_POLL_MS
+#define ETH_LINK_POLL_MS        1000
+#endif
+
+static tBoolean g_bLinkUp;
+unsigned long g_ulLinkChanges;
+
+//*****************************************************************************
+// ARP.  When uip_arp_out() has no entry for the next hop it overwrites the
+// first ARP_PKT_LEN bytes of the packet in uip_buf with an ARP request, and
+// the packet is lost until TCP retransmits it.  Instead the ARP request goes
+// out from a block of its own and the packet is held, one per next hop and
+// up to ARP_HOLD of them, until an ARP packet arrives that lets it through,
+// or for at most ARP_HOLD_MS.
+//*****************************************************************************
+#define ARP_PKT_LEN             42
+#define ARP_SIPADDR             28
+#define ARP_DIPADDR             38
+#define ARP_OP_REQUEST          1
+#define ARP_OP_REPLY            2
+
+#ifndef ARP_HOLD
+#define ARP_HOLD                2
+#endif
+
+#ifndef ARP_HOLD_MS
+#define ARP_HOLD_MS             1000
+#endif
+
+typedef struct
+{
+    u8_t *pucBuf;
+    unsigned short usLen;
+    const unsigned char *pucPayload;
+    uip_ipaddr_t sNextHop;
+    unsigned long ulMs;
+}
+tArpHold;
+
+static tArpHold g_psArpHold[ARP_HOLD];
+static tBoolean g_bArpIn;
+
+//*****************************************************************************
+// A gratuitous ARP announces our address once the link comes up or an
+// address is configured.
+//*****************************************************************************
+static tBoolean g_bArpAnnounce;
+
+//*****************************************************************************
+// Static ARP entries for the known control hosts, given as a list of
+// { { IP address }, { { MAC address } } } initializers, for example
+//
+//     #define ARP_STATIC_ENTRIES { { 169, 254, 254, 1 },
+//                                  { { 0x00, 0x1a, 0xb6, 0x00, 0x00, 0x01 } } }
+//
+// uIP keeps its ARP table to itself, so the entries are put in it by feeding
+// uip_arp_arpin() an ARP reply from each host, at start up and on every ARP
+// timer tick so that they never age out.
+//*****************************************************************************
+#ifdef ARP_STATIC_ENTRIES
+typedef struct
+{
+    u8_t pucIPAddr[4];
+    struct uip_eth_addr sEthAddr;
+}
+tArpStatic;
+
+static const tArpStatic g_psArpStatic[] = { ARP_STATIC_ENTRIES };
+#endif
+
+//*****************************************************************************
+// The number of packets held for ARP, sent once resolved, and dropped.
+//*****************************************************************************
+unsigned long g_ulArpHeld;
+unsigned long g_ulArpReleased;
+unsigned long g_ulArpDropped;
+
+//*****************************************************************************
+// Boot times in ms from the start of the SysTick.  Control is ready once the
+// C28 has been booted and the main loop is running, whether or not there is
+// a link.  The network is ready once the link is up and an address has been
+// configured.
+//*****************************************************************************
+unsigned long g_ulBootControlMs;
+unsigned long g_ulBootNetworkMs;
+static tBoolean g_bNetworkReady;
+
+//*****************************************************************************
+// The binary UDP command channel on UDP_CMD_PORT, for teleoperation at rates
+// that HTTP over TCP cannot keep up with.  A datagram, in network byte order,
+// is
+//
+//     offset 0: version, UDP_CMD_VERSION
+//     offset 1: number of commands that follow, 1 to UDP_CMD_MAX
+//     offset 2: reserved, 0
+//     offset 4: sequence number, 32 bits
+//     offset 8: the commands, 8 bytes each: the command word (velocity,
+//               omega, ...) in the first byte, three reserved bytes, and
+//               the value as a signed 16.16 fixed-point number.
+//
+// The commands go through EthernetProcessCMD() like those from the web page.
+// A datagram whose sequence number is not newer than the last one accepted
+// is dropped, unless it comes from another host or port, or the last one is
+// more than UDP_CMD_SESSION_MS old, which starts a new session.
+//*****************************************************************************
+#ifndef UDP_CMD_SESSION_MS
+#define UDP_CMD_SESSION_MS      1000
+#endif
+
+#define UDP_CMD_VERSION         1
+#define UDP_CMD_MAX             10
+#define UDP_CMD_HDR_LEN         8
+#define UDP_CMD_LEN             8
+
+static struct uip_udp_conn *g_psUdpCmdConn;
+static uip_ipaddr_t g_sUdpCmdAddr;
+static u16_t g_usUdpCmdPort;
+static unsigned long g_ulUdpCmdSeq;
+static unsigned long g_ulUdpCmdTick;
+static tBoolean g_bUdpCmdSession;
+
+//*****************************************************************************
+// The number of command datagrams accepted, dropped as stale or duplicate,
+// and dropped as malformed.
+//*****************************************************************************
+unsigned long g_ulUdpCmdAccepted;
+unsigned long g_ulUdpCmdStale;
+unsigned long g_ulUdpCmdBad;
+
+//*****************************************************************************
+// Telemetry of the C28 control state.  The C28 publishes a sample of
+// TELEM_FIELDS values (wl, wr, speed, rotate, SpeedRpm_fr and SpeedRpm_pr,
+// as 32-bit floats) from cpu_timer2_isr at 1 kHz into the ring at the start
+// of shared RAM S0, telem_ring in eqep_pos_speed_c28.c: it writes the sample
+// to slot ulCount % TELEM_RING, then increments ulCount.
+//
+// A host subscribes by sending a datagram to TELEM_PORT of
+//
+//     offset 0: version, TELEM_VERSION
+//     offset 1: reserved, 0
+//     offset 2: decimation, 16 bits: every Nth sample is sent, 0 to stop
+//
+// and has to send it again within TELEM_LEASE_MS to keep the stream
+// going.  The samples are then sent to the address and port the datagram
+// came from, TELEM_SAMPLES per datagram, in network byte order:
+//
+//     offset 0:  version, TELEM_VERSION
+//     offset 1:  number of samples
+//     offset 2:  decimation, 16 bits
+//     offset 4:  datagram sequence number, 32 bits
+//     offset 8:  index of the first sample in the C28 stream, 32 bits; the
+//                others follow at steps of the decimation
+//     offset 12: time sent, in ms since boot, 32 bits
+//     offset 16: the samples, TELEM_FIELDS 32-bit floats each
+//
+// Samples the C28 overwrote before they could be sent are counted in
+// telem.lost.
+//*****************************************************************************
+#ifndef TELEM_SAMPLES
+#define TELEM_SAMPLES           10
+#endif
+
+#ifndef TELEM_LEASE_MS
+#define TELEM_LEASE_MS          10000
+#endif
+
+#define TELEM_VERSION           1
+#define TELEM_FIELDS            6
+#define TELEM_RING              64
+#define TELEM_GUARD             8
+#define TELEM_SUB_LEN           4
+#define TELEM_HDR_LEN           16
+
+typedef struct
+{
+    volatile unsigned long ulCount;
+    volatile unsigned long ulReserved;
+    volatile unsigned long pulSample[TELEM_RING][TELEM_FIELDS];
+}
+tTelemRing;
+
+#define TELEM_SHARED            ((tTelemRing *)m3_r_array)
+
+static struct uip_udp_conn *g_psTelemConn;
+static struct uip_udp_conn *g_psTelemTxConn;
+static tBoolean g_bTelemSubscribed;
+static unsigned long g_ulTelemTick;
+static unsigned long g_ulTelemDecimate;
+static unsigned long g_ulTelemNext;
+static unsigned long g_ulTelemFirst;
+static unsigned long g_ulTelemFill;
+static unsigned long g_ulTelemSeq;
+static unsigned long g_ppulTelemStage[TELEM_SAMPLES][TELEM_FIELDS];
+
+//*****************************************************************************
+// The number of telemetry datagrams sent, and of samples lost.
+//*****************************************************************************
+unsigned long g_ulTelemSent;
+unsigned long g_ulTelemLost;
+
+//*****************************************************************************
+// The state of the control, as sent to the WebSocket clients of httpd.c in a
+// state frame after every command frame and every WS_STATE_MS.  The layout,
+// in network byte order, is
+//
+//     offset 0:  version, STATE_VERSION
+//     offset 1:  number of C28 values, TELEM_FIELDS
+//     offset 2:  number of set points, STATE_SETPOINTS
+//     offset 3:  reserved, 0
+//     offset 4:  time, in us, from TimebaseStamp()
+//     offset 8:  index of the C28 sample in its telemetry stream, 32 bits
+//     offset 12: the latest C28 sample, TELEM_FIELDS 32-bit floats
+//     then:      the set points last written to the C28 (velocity, omega,
+//                left, right, grip, magnitude, degree, inverse_x,
+//                inverse_y and inverse_the), 32-bit Q16 fixed point
+//*****************************************************************************
+#ifndef WS_STATE_MS
+#define WS_STATE_MS             50
+#endif
+
+#define STATE_VERSION           2
+#define STATE_SETPOINTS         10
+#define STATE_HDR_LEN           12
+#define STATE_LEN               (STATE_HDR_LEN +                             \
+                                 ((TELEM_FIELDS + STATE_SETPOINTS) * 4))
+
+static unsigned long g_ulWsStateMs;
+
+//*****************************************************************************
+// The number of WebSocket command frames carried out and rejected, and of
+// state frames sent.
+//*****************************************************************************
+unsigned long g_ulWsCmdAccepted;
+unsigned long g_ulWsCmdBad;
+unsigned long g_ulWsStateSent;
+
+//*****************************************************************************
+// Driver counters reported by the statistics endpoint, along with the load
+// counters above and the classifier drop counts.  The rates are taken over
+// the last whole second.
+//*****************************************************************************
+unsigned long g_ulRxBytes;
+unsigned long g_ulRxOverflows;
+unsigned long g_ulRxErrors;
+unsigned long g_ulRxRingFull;
+unsigned long g_ulTxFrames;
+unsigned long g_ulTxBytes;
+unsigned long g_ulTxErrors;
+unsigned long g_ulTxQueueFull;
+unsigned long g_ulTxMoreSent;
+unsigned long g_ulRxFramesPerSec;
+unsigned long g_ulRxBytesPerSec;
+unsigned long g_ulTxFramesPerSec;
+unsigned long g_ulTxBytesPerSec;
+
 //*****************************************************************************
 // The control table used by the uDMA controller.  This table must be aligned
-// to a 1024 byte boundary.  In this application uDMA is only used for USB,
-// so only the first 8 channels are needed.
+// to a 1024 byte boundary.  The scatter-gather transfers on the Ethernet TX
+// channel use its alternate control structure, which lives in the second
+// half of the table, so the table is allocated in full.
 //*****************************************************************************
+#pragma DATA_SECTION(g_sDMAControlTable, "DMARAM")
 #pragma DATA_ALIGN(g_sDMAControlTable, 1024)
-tDMAControlTable g_sDMAControlTable[8];
+tDMAControlTable g_sDMAControlTable[64];
 
 //*****************************************************************************
 // Default TCP/IP Settings for this application.
@@ -212,6 +817,107 @@ tDMAControlTable g_sDMAControlTable[8];
 #define UIP_PERIODIC_TIMER_MS   500
 #define UIP_ARP_TIMER_MS        10000
 
+//*****************************************************************************
+// Fast DHCP start up.  The last lease is kept in g_sDhcpLease, which the
+// linker command file places in the DHCPLEASE section of RAM that is not
+// initialized at start up, so that it survives a reset.  The seconds left
+// on it are counted down while the board runs, and a lease that has run out
+// is dropped.  A lease found at start up is confirmed with an INIT-REBOOT
+// DHCPREQUEST (RFC 2131, 4.3.2), sent straight away and then at doubling
+// intervals from DHCP_REBOOT_MS, DHCP_REBOOT_TRIES times in all.  The
+// address is neither configured nor announced until an ACK confirms it, so
+// connections carried over a link change stall until then.  A NAK drops the
+// lease, and a NAK or no answer at all starts the full exchange of the uIP
+// DHCP client.  For DHCP_FAST_MS after it starts the client's connection is
+// polled every DHCP_POLL_MS instead of with the periodic timer, so that its
+// messages go out as soon as they are due.
+//
+// The time from start up or link up to a confirmed address is reported in
+// dhcp.ms.
+//*****************************************************************************
+unsigned long g_ulDhcpMs;
+unsigned long g_ulDhcpRebootAck;
+unsigned long g_ulDhcpRebootNak;
+unsigned long g_ulDhcpRebootTimeout;
+
+#ifndef USE_STATIC_IP
+#ifndef DHCP_REBOOT_MS
+#define DHCP_REBOOT_MS          250
+#endif
+
+#ifndef DHCP_REBOOT_TRIES
+#define DHCP_REBOOT_TRIES       4
+#endif
+
+#ifndef DHCP_POLL_MS
+#define DHCP_POLL_MS            50
+#endif
+
+#ifndef DHCP_FAST_MS
+#define DHCP_FAST_MS            10000
+#endif
+
+#define DHCP_IDLE               0
+#define DHCP_REBOOTING          1
+#define DHCP_CLIENT             2
+#define DHCP_BOUND              3
+
+#define DHCP_SERVER_PORT        67
+#define DHCP_CLIENT_PORT        68
+#define DHCP_OPTIONS            240
+#define DHCP_REQUEST            3
+#define DHCP_ACK                5
+#define DHCP_NAK                6
+#define DHCP_LEASE_MAGIC        0x44484350
+
+typedef struct
+{
+    unsigned long ulMagic;
+    uip_ipaddr_t sIPAddr;
+    uip_ipaddr_t sNetmask;
+    uip_ipaddr_t sRouter;
+    u8_t pucServerID[4];
+    unsigned long ulLeftS;
+    unsigned long ulCheck;
+}
+tDhcpLease;
+
+#pragma DATA_SECTION(g_sDhcpLease, "DHCPLEASE");
+#pragma NOINIT(g_sDhcpLease);
+tDhcpLease g_sDhcpLease;
+
+static unsigned long g_ulDhcpState;
+static struct uip_udp_conn *g_psDhcpConn;
+static tBoolean g_bDhcpClient;
+static tBoolean g_bDhcpSend;
+static unsigned long g_ulDhcpTries;
+static unsigned long g_ulDhcpTick;
+static unsigned long g_ulDhcpStartUs;
+static unsigned long g_ulDhcpXid;
+static unsigned long g_ulDhcpAgeMs;
+#endif
+
+//*****************************************************************************
+// The most received frames handed to uIP per pass of the main loop.  While
+// frames keep coming the loop stays in polling mode with the RX interrupt
+// masked, services its timers whenever the budget runs out and comes straight
+// back for more.  The budget may be tuned at run time through g_ulRxBudget.
+//*****************************************************************************
+#ifndef RX_BUDGET
+#define RX_BUDGET               8
+#endif
+
+volatile unsigned long g_ulRxBudget = RX_BUDGET;
+
+//*****************************************************************************
+// The number of TCP and UDP connections serviced by the periodic timer.
+//*****************************************************************************
+#if UIP_UDP
+#define NUM_PERIODIC_CONNS      (UIP_CONNS + UIP_UDP_CONNS)
+#else
+#define NUM_PERIODIC_CONNS      UIP_CONNS
+#endif
+
 //*****************************************************************************
 // Defines for commands
 //*****************************************************************************
@@ -242,16 +948,20 @@ extern void httpd_clear_command(void);
 extern void httpd_clear_command(void);
 extern int httpd_get_command(int *command_word);
 extern void httpd_insert_response(int data_length,char *data);
-extern float velocity_cmd;
-extern float omega_cmd;
-extern float left_cmd;
-extern float right_cmd;
-extern float grip_cmd;
-extern float magnitude_cmd;
-extern float degree_cmd;
-extern float inverse_x_cmd;
-extern float inverse_y_cmd;
-extern float inverse_the_cmd;
+extern int httpd_websocket(struct uip_conn *conn);
+extern unsigned long httpd_value_cycles;
+extern unsigned long httpd_conn_accepted;
+extern unsigned long httpd_resent;
+extern long velocity_cmd;
+extern long omega_cmd;
+extern long left_cmd;
+extern long right_cmd;
+extern long grip_cmd;
+extern long magnitude_cmd;
+extern long degree_cmd;
+extern long inverse_x_cmd;
+extern long inverse_y_cmd;
+extern long inverse_the_cmd;
 
 
 int i = 0;
@@ -279,6 +989,9 @@ SysTickIntHandler(void)
     // Increment the system tick count.
     g_ulTickCounter++;
 
+    // Account the tick to the Ethernet servicing mode.
+    g_pulEthModeTicks[g_ulEthMode]++;
+
     // Indicate that a SysTick interrupt has occurred.
     HWREGBITW(&g_ulFlags, FLAG_SYSTICK) = 1;
 }
@@ -296,302 +1009,2832 @@ ShowIPAddress(const uip_ipaddr_t sIPAddr)
 }
 
 //*****************************************************************************
-//! When using the timer module in UIP, this function is required to return
-//! the number of ticks.  Note that the file "clock-arch.h" must be provided
-//! by the application, and define CLOCK_CONF_SECONDS as the number of ticks
-//! per second, and must also define the typedef "clock_time_t".
+// Sleep until an interrupt occurs, unless one has already set a flag, and
+// account the time asleep as idle time.  Interrupts are masked around the
+// check so that none can slip in between it and the WFI; a pending interrupt
+// still ends the WFI and is taken once they are unmasked.  The time is
+// measured on the SysTick, which wraps at most once since its own interrupt
+// ends the sleep.
 //*****************************************************************************
-clock_time_t
-clock_time(void)
+static void
+CpuIdle(void)
 {
-    return((clock_time_t)g_ulTickCounter);
+    unsigned long ulStart, ulEnd;
+
+    IntMasterDisable();
+    if(!g_ulFlags && !(HWREG(NVIC_INT_CTRL) & NVIC_INT_CTRL_PENDSTSET))
+    {
+        ulStart = SysTickValueGet();
+        CPUwfi();
+        ulEnd = SysTickValueGet();
+
+        // The SysTick counts down.
+        if(HWREG(NVIC_INT_CTRL) & NVIC_INT_CTRL_PENDSTSET)
+        {
+            ulStart += SysTickPeriodGet();
+        }
+        g_ulIdleCycles += ulStart - ulEnd;
+    }
+    IntMasterEnable();
 }
 
 //*****************************************************************************
-// The interrupt handler for the Ethernet interrupt.
+// Start the SysTick, and with it the timebase.
 //*****************************************************************************
-void
-EthernetIntHandler(void)
+static void
+TimebaseInit(void)
 {
-    unsigned long ulTemp;
+    unsigned long ulClock;
 
-    // Read and Clear the interrupt.
-    ulTemp = EthernetIntStatus(ETH_BASE, false);
-    EthernetIntClear(ETH_BASE, ulTemp);
+    ulClock = SysCtlClockGet(SYSTEM_CLOCK_SPEED);
+    g_ulTimebaseCyclesPerUs = ulClock / 1000000;
+    g_ulTimebaseReload = (ulClock / SYSTICKHZ) - 1;
 
-    // Check to see if an RX Interrupt has occurred.
-    if(ulTemp & ETH_INT_RX)
-    {
-        // Indicate that a packet has been received.
-        HWREGBITW(&g_ulFlags, FLAG_RXPKT) = 1;
+    SysTickPeriodSet(ulClock / SYSTICKHZ);
+    SysTickEnable();
+    IntRegister(FAULT_SYSTICK, SysTickIntHandler);
+    SysTickIntEnable();
+}
 
-        // Disable Ethernet RX Interrupt.
-        EthernetIntDisable(ETH_BASE, ETH_INT_RX);
-    }
+//*****************************************************************************
+// Read the tick count and the cycles since that tick as one.  The tick count
+// is read again to catch a SysTick interrupt in between.  With interrupts
+// masked, or from a handler that has pre-empted the SysTick handler, the
+// SysTick may have wrapped without the count being incremented yet; the wrap
+// is pending then and is accounted for here, after the loop, since the count
+// itself cannot move until the handler runs.
+//*****************************************************************************
+static void
+TimebaseRead(unsigned long *pulTick, unsigned long *pulCycles)
+{
+    unsigned long ulTick, ulValue;
+    tBoolean bPending;
 
-    // Check to see if waiting on a DMA to complete.
-    if(HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) == 1)
+    do
     {
-        // Verify the channel transfer is done
+        ulTick = g_ulTickCounter;
+        ulValue = SysTickValueGet();
+        bPending = ((HWREG(NVIC_INT_CTRL) & NVIC_INT_CTRL_PENDSTSET) ?
+                    true : false);
+        if(bPending)
+        {
+            ulValue = SysTickValueGet();
+        }
+    }
+    while(ulTick != g_ulTickCounter);
+
+    if(bPending)
+    {
+        ulTick++;
+    }
+
+    *pulTick = ulTick;
+    *pulCycles = g_ulTimebaseReload - ulValue;
+}
+
+//*****************************************************************************
+//! Returns the time since start up in microseconds.  The value does not wrap
+//! in the life of the product.
+//*****************************************************************************
+unsigned long long
+TimebaseGetUs(void)
+{
+    unsigned long ulTick, ulCycles;
+
+    TimebaseRead(&ulTick, &ulCycles);
+
+    return(((unsigned long long)ulTick * SYSTICKUS) +
+           (ulCycles / g_ulTimebaseCyclesPerUs));
+}
+
+//*****************************************************************************
+//! Returns a timestamp in microseconds, for timing events.  It wraps every
+//! 2^32 us (71 minutes), so the difference between two stamps, taken as an
+//! unsigned long, is the time between them for anything shorter than that.
+//! Callable from any context, including interrupt handlers.
+//*****************************************************************************
+unsigned long
+TimebaseStamp(void)
+{
+    unsigned long ulTick, ulCycles;
+
+    TimebaseRead(&ulTick, &ulCycles);
+
+    return((ulTick * SYSTICKUS) + (ulCycles / g_ulTimebaseCyclesPerUs));
+}
+
+//*****************************************************************************
+//! Returns a count of processor clocks, for timing short pieces of code.  It
+//! wraps, so only the difference between two counts means anything.
+//*****************************************************************************
+unsigned long
+TimebaseCycles(void)
+{
+    unsigned long ulTick, ulCycles;
+
+    TimebaseRead(&ulTick, &ulCycles);
+
+    return((ulTick * (g_ulTimebaseReload + 1)) + ulCycles);
+}
+
+//*****************************************************************************
+//! Returns the time since start up in milliseconds.
+//*****************************************************************************
+unsigned long
+TimebaseGetMs(void)
+{
+    unsigned long ulTick, ulCycles;
+
+    TimebaseRead(&ulTick, &ulCycles);
+
+    return((ulTick * SYSTICKMS) +
+           (ulCycles / (g_ulTimebaseCyclesPerUs * 1000)));
+}
+
+//*****************************************************************************
+//! When using the timer module in UIP, this function is required to return
+//! the number of ticks.  Note that the file "clock-arch.h" must be provided
+//! by the application, and define CLOCK_CONF_SECONDS as the number of ticks
+//! per second, and must also define the typedef "clock_time_t".  The ticks
+//! are milliseconds of the timebase, not SysTick interrupts.
+//*****************************************************************************
+clock_time_t
+clock_time(void)
+{
+    return((clock_time_t)TimebaseGetMs());
+}
+
+//*****************************************************************************
+// Take a block from the packet pool.  Returns 0 if the pool is empty.  May be
+// called from the interrupt or the main loop.
+//*****************************************************************************
+static u8_t *
+EthernetPktAlloc(void)
+{
+    u8_t *pucBuf;
+    tBoolean bMasked;
+
+    bMasked = IntMasterDisable();
+    pucBuf = 0;
+    if(g_ulPktFree)
+    {
+        pucBuf = g_ppucPktFree[--g_ulPktFree];
+        if(g_ulPktFree < g_ulPktFreeMin)
+        {
+            g_ulPktFreeMin = g_ulPktFree;
+        }
+    }
+    if(!bMasked)
+    {
+        IntMasterEnable();
+    }
+
+    return(pucBuf);
+}
+
+//*****************************************************************************
+// Give a block back to the packet pool.  If the interrupt has stopped
+// receiving for want of a block, it is run to carry on.  May be called from
+// the interrupt or the main loop.
+//*****************************************************************************
+static void
+EthernetPktFree(u8_t *pucBuf)
+{
+    tBoolean bMasked;
+
+    ASSERT(((unsigned long)pucBuf & 3) == 2);
+
+    bMasked = IntMasterDisable();
+    g_ppucPktFree[g_ulPktFree++] = pucBuf;
+    if(!bMasked)
+    {
+        IntMasterEnable();
+    }
+
+    if(g_bRxStalled)
+    {
+        IntPendSet(INT_ETH);
+    }
+}
+
+//*****************************************************************************
+// Put every block of the packet pool on the free stack.
+//*****************************************************************************
+static void
+EthernetPktInit(void)
+{
+    unsigned long ulIdx;
+
+    for(ulIdx = 0; ulIdx < NUM_PKT_BUFFERS; ulIdx++)
+    {
+        g_ppucPktFree[ulIdx] = PKT_BUFFER(ulIdx);
+    }
+    g_ulPktFree = NUM_PKT_BUFFERS;
+    g_ulPktFreeMin = NUM_PKT_BUFFERS;
+}
+
+//*****************************************************************************
+// Classify a received frame from its headers, which occupy the first
+// ETH_PEEK_WORDS words after WORD 0 of the frame.  Returns the reason the
+// frame is of no interest to uIP, or ETH_DROP_NONE if it should be passed on.
+//*****************************************************************************
+static unsigned long
+EthernetRxClassify(const unsigned char *pucBuf)
+{
+    unsigned short usType, usPort;
+    const unsigned short *pusPorts;
+    unsigned long ulIdx, ulNumPorts;
+
+    usType = (pucBuf[12] << 8) | pucBuf[13];
+
+    // Only ARP requests and replies for our own address are of interest.
+    // Until an address has been configured everything is let through.
+    if(usType == UIP_ETHTYPE_ARP)
+    {
+        if((uip_hostaddr[0] | uip_hostaddr[1]) &&
+           !uip_ipaddr_cmp((unsigned short *)&pucBuf[38], uip_hostaddr))
+        {
+            return(ETH_DROP_ARP);
+        }
+        return(ETH_DROP_NONE);
+    }
+
+    // Besides ARP, only IPv4 is handled.
+    if(usType != UIP_ETHTYPE_IP)
+    {
+        return(ETH_DROP_TYPE);
+    }
+
+    // The datagram must be addressed to us.  The one broadcast let through
+    // is to the DHCP client port, since a DHCP server may answer that way.
+    if((uip_hostaddr[0] | uip_hostaddr[1]) &&
+       !uip_ipaddr_cmp((unsigned short *)&pucBuf[30], uip_hostaddr))
+    {
+        if((pucBuf[30] & pucBuf[31] & pucBuf[32] & pucBuf[33]) != 0xff)
+        {
+            return(ETH_DROP_ADDR);
+        }
+        if((pucBuf[23] != UIP_PROTO_UDP) || (pucBuf[14] != 0x45) ||
+           (((pucBuf[36] << 8) | pucBuf[37]) != 68))
+        {
+            return(ETH_DROP_ADDR);
+        }
+    }
+
+    // Check the protocol, and for TCP and UDP the destination port.  Ports
+    // are only looked at if the IP header carries no options.
+    switch(pucBuf[23])
+    {
+    case UIP_PROTO_ICMP:
+        return(ETH_DROP_NONE);
+
+    case UIP_PROTO_TCP:
+        pusPorts = g_pusFilterTCPPorts;
+        ulNumPorts = sizeof(g_pusFilterTCPPorts) / sizeof(unsigned short);
+        break;
+
+    case UIP_PROTO_UDP:
+        pusPorts = g_pusFilterUDPPorts;
+        ulNumPorts = sizeof(g_pusFilterUDPPorts) / sizeof(unsigned short);
+        break;
+
+    default:
+        return(ETH_DROP_PROTO);
+    }
+
+    if(pucBuf[14] != 0x45)
+    {
+        return(ETH_DROP_NONE);
+    }
+
+    usPort = (pucBuf[36] << 8) | pucBuf[37];
+    for(ulIdx = 0; ulIdx < ulNumPorts; ulIdx++)
+    {
+        if(pusPorts[ulIdx] == usPort)
+        {
+            return(ETH_DROP_NONE);
+        }
+    }
+    return(ETH_DROP_PORT);
+}
+
+//*****************************************************************************
+// Pass the buffer at the head of the receive ring, now holding a complete
+// frame, on to the main loop.  Called from the interrupt only.
+//*****************************************************************************
+static void
+EthernetRxDone(void)
+{
+    g_pucRxState[g_ulRxHead] = PKT_READY;
+    g_ulRxHead = (g_ulRxHead + 1) % NUM_RX_BUFFERS;
+
+    // Indicate that a packet has been received.
+    HWREGBITW(&g_ulFlags, FLAG_RXPKT) = 1;
+}
+
+//*****************************************************************************
+// Start a uDMA transfer of the next frame in the MAC receive FIFO into a
+// block for the slot at the head of the receive ring.  If the FIFO is empty
+// the RX interrupt is re-enabled, and if the ring is full or the pool is
+// empty the frame is left in the FIFO until a slot or a block is freed.
+// When the early classifier is on, the headers are read from the FIFO first
+// and frames of no interest are discarded without being DMAed.  Called from
+// the interrupt only.
+//*****************************************************************************
+static void
+EthernetRxStart(void)
+{
+    unsigned long ulTemp, ulPeek, ulDrop;
+    unsigned long *pulData;
+    unsigned char *pucBuf;
+    long lFrameLen;
+
+    // Only one receive transfer can be in flight at a time.
+    if(HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) == 1)
+    {
+        return;
+    }
+
+    // Work through the frames waiting in the FIFO.
+    while(EthernetPacketAvail(ETH_BASE))
+    {
+        // Leave the frame in the FIFO if there is no slot or no block to put
+        // it in.  Reception is restarted when one is freed.  A block taken
+        // for a frame that was then discarded is kept for the next one.
+        if(g_pucRxState[g_ulRxHead] != PKT_FREE)
+        {
+            if(!g_bRxStalled)
+            {
+                g_bRxStalled = true;
+                g_ulRxRingFull++;
+            }
+            return;
+        }
+        if(!g_ppucRxBuf[g_ulRxHead])
+        {
+            g_ppucRxBuf[g_ulRxHead] = EthernetPktAlloc();
+            if(!g_ppucRxBuf[g_ulRxHead])
+            {
+                if(!g_bRxStalled)
+                {
+                    g_bRxStalled = true;
+                    g_ulPktEmpty++;
+                }
+                return;
+            }
+        }
+        g_bRxStalled = false;
+
+        // Read WORD 0 from the FIFO, get the receive Frame Length and store
+        // the first two bytes of the destination address in the buffer.
+        pucBuf = g_ppucRxBuf[g_ulRxHead];
+        pulData = (unsigned long *)&pucBuf[2];
+        ulTemp = HWREG(ETH_BASE + MAC_O_DATA);
+        lFrameLen = (long)(ulTemp & 0xffff);
+        pucBuf[0] = (unsigned char)((ulTemp >> 16) & 0xff);
+        pucBuf[1] = (unsigned char)((ulTemp >> 24) & 0xff);
+        g_ulRxFrames++;
+        g_ulRxBytes += lFrameLen - 6;
+
+        // The rest of the frame is the frame minus the two bytes already
+        // read, rounded up so that the last partial word is transferred as
+        // well.  A frame that can never fit in a block is discarded.
+        ulTemp = (unsigned long)(lFrameLen - 2 + 3) >> 2;
+        ulDrop = ETH_DROP_NONE;
+        ulPeek = 0;
+        if(ulTemp > (PKT_BUFFER_WORDS - 1))
+        {
+            ulDrop = ETH_DROP_SIZE;
+        }
+
+        // Read the headers and classify the frame.  Runt frames are left
+        // for uIP to deal with.
+        else if(g_bEthFilter && (ulTemp >= ETH_PEEK_WORDS))
+        {
+            for(ulPeek = 0; ulPeek < ETH_PEEK_WORDS; ulPeek++)
+            {
+                pulData[ulPeek] = HWREG(ETH_BASE + MAC_O_DATA);
+            }
+            ulTemp -= ETH_PEEK_WORDS;
+            ulDrop = EthernetRxClassify(pucBuf);
+        }
+
+        // Read out and discard the rest of a dropped frame.
+        if(ulDrop != ETH_DROP_NONE)
+        {
+            g_pulEthDrops[ulDrop]++;
+            while(ulTemp--)
+            {
+                HWREG(ETH_BASE + MAC_O_DATA);
+            }
+            continue;
+        }
+
+        // The length stored excludes the two length bytes and the FCS.
+        g_pusRxLength[g_ulRxHead] = (unsigned short)(lFrameLen - 6);
+
+        // Nothing left to move if the headers were the whole frame.
+        if(ulTemp == 0)
+        {
+            EthernetRxDone();
+            continue;
+        }
+
+        // Hand the buffer to the uDMA for the rest of the frame.
+        g_pucRxState[g_ulRxHead] = PKT_FILLING;
+        HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) = 1;
+
+        uDMAChannelTransferSet(UDMA_CHANNEL_ETH0RX, UDMA_MODE_AUTO,
+                               (void *)(ETH_BASE + MAC_O_DATA),
+                               &pulData[ulPeek], ulTemp);
+        uDMAChannelEnable(UDMA_CHANNEL_ETH0RX);
+
+        // Issue a software request to start the channel running.
+        uDMAChannelRequest(UDMA_CHANNEL_ETH0RX);
+        return;
+    }
+
+    // The FIFO is empty, so go back to waiting on the RX interrupt, unless
+    // the main loop is polling.  It re-arms the interrupt once it has caught
+    // up with the ring.
+    if(HWREGBITW(&g_ulFlags, FLAG_RXPOLL) == 0)
+    {
+        EthernetIntEnable(ETH_BASE, ETH_INT_RX);
+    }
+}
+
+//*****************************************************************************
+// Fill in a scatter-gather task moving ulWords words from pvSrc into the MAC
+// transmit FIFO.
+//*****************************************************************************
+static void
+EthernetTxTaskSet(tDMAControlTable *psTask, const void *pvSrc,
+                  unsigned long ulWords, unsigned long ulMode)
+{
+    psTask->pvSrcEndAddr = (void *)((unsigned long)pvSrc + (ulWords << 2) - 1);
+    psTask->pvDstEndAddr = (void *)(ETH_BASE + MAC_O_DATA);
+    psTask->ulControl = (UDMA_SIZE_32 | UDMA_SRC_INC_32 | UDMA_DST_INC_NONE |
+                         UDMA_ARB_8 | ulMode |
+                         ((ulWords - 1) << UDMA_CHCTL_XFERSIZE_S));
+    psTask->ulSpare = 0;
+}
+
+//*****************************************************************************
+// Start a uDMA transfer of the packet at the tail of the transmit queue into
+// the MAC transmit FIFO.  The FIFO holds a single frame, so if the previous
+// one is still going out the TX interrupt is enabled to try again once it
+// has.  Called from the interrupt only.
+//*****************************************************************************
+static void
+EthernetTxStart(void)
+{
+    tTxDescriptor *psDesc;
+    unsigned long ulTemp;
+    unsigned char *pucBuf;
+    long lBufLen;
+
+    // Only one transmit transfer can be in flight at a time.
+    if(HWREGBITW(&g_ulFlags, FLAG_TXPKT) == 1)
+    {
+        return;
+    }
+
+    // Stop taking TX interrupts once the queue has been drained.
+    if(g_ulTxHead == g_ulTxTail)
+    {
+        EthernetIntDisable(ETH_BASE, ETH_INT_TX);
+        return;
+    }
+
+    // Wait for the MAC to finish sending the previous frame.
+    if(!EthernetSpaceAvail(ETH_BASE))
+    {
+        EthernetIntEnable(ETH_BASE, ETH_INT_TX);
+        return;
+    }
+
+    psDesc = &g_psTxQueue[g_ulTxTail % NUM_TX_DESCRIPTORS];
+    pucBuf = psDesc->pucBuf;
+    lBufLen = psDesc->lBufLen;
+
+    // Indicate that a packet is being sent.
+    HWREGBITW(&g_ulFlags, FLAG_TXPKT) = 1;
+
+    // Build and write WORD 0 (see format above) to the transmit FIFO.
+    ulTemp = (unsigned long)(lBufLen - 14);
+    ulTemp |= (*pucBuf++) << 16;
+    ulTemp |= (*pucBuf++) << 24;
+    HWREG(ETH_BASE + MAC_O_DATA) = ulTemp;
+
+    // A packet with a separate payload goes out as a scatter-gather
+    // transfer of the headers after WORD 0, a whole number of words, followed
+    // by the payload.  The payload is rounded up to a word like the buffer
+    // below.
+    if(psDesc->lPayloadLen)
+    {
+        lBufLen -= psDesc->lPayloadLen;
+        EthernetTxTaskSet(&g_psTxTaskList[0], pucBuf, (lBufLen - 2) >> 2,
+                          (UDMA_MODE_MEM_SCATTER_GATHER |
+                           UDMA_MODE_ALT_SELECT));
+        EthernetTxTaskSet(&g_psTxTaskList[1], psDesc->pucPayload,
+                          (psDesc->lPayloadLen + 3) >> 2, UDMA_MODE_AUTO);
+        uDMAChannelScatterGatherSet(UDMA_CHANNEL_ETH0TX, 2, g_psTxTaskList, 0);
+    }
+    else
+    {
+        // Force an extra word to be transferred if the end of the buffer is
+        // not aligned on a word boundary.  The math is actually
+        // lBufLen - 2 + 3 to insure that the proper number of bytes are
+        // written.
+        lBufLen += 1;
+
+        // Configure the TX DMA channel to transfer the packet buffer.  The
+        // control word is set again as a scatter-gather transfer replaces
+        // it.
+        uDMAChannelControlSet(UDMA_CHANNEL_ETH0TX,
+                              UDMA_SIZE_32 | UDMA_SRC_INC_32 |
+                              UDMA_DST_INC_NONE | UDMA_ARB_8);
+        uDMAChannelTransferSet(UDMA_CHANNEL_ETH0TX, UDMA_MODE_AUTO,
+                               pucBuf, (void *)(ETH_BASE + MAC_O_DATA),
+                               lBufLen>>2);
+    }
+
+    // Enable the Ethernet Transmit DMA channel.
+    uDMAChannelEnable(UDMA_CHANNEL_ETH0TX);
+
+    // Issue a software request to start the channel running.
+    uDMAChannelRequest(UDMA_CHANNEL_ETH0TX);
+}
+
+//*****************************************************************************
+// The interrupt handler for the Ethernet interrupt.
+//*****************************************************************************
+void
+EthernetIntHandler(void)
+{
+    tTxDescriptor *psDesc;
+    unsigned long ulTemp;
+
+    // Read and Clear the interrupt.
+    ulTemp = EthernetIntStatus(ETH_BASE, false);
+    EthernetIntClear(ETH_BASE, ulTemp);
+
+    // Count receive FIFO overflows and receive and transmit errors.
+    if(ulTemp & ETH_INT_RXOF)
+    {
+        g_ulRxOverflows++;
+    }
+    if(ulTemp & ETH_INT_RXER)
+    {
+        g_ulRxErrors++;
+    }
+    if(ulTemp & ETH_INT_TXER)
+    {
+        g_ulTxErrors++;
+    }
+
+    // Leave a PHY interrupt to the main loop, since reading the PHY over the
+    // MDIO takes a while.  It re-enables the source once it has acknowledged
+    // the interrupt in the PHY.
+    if(ulTemp & ETH_INT_PHY)
+    {
+        EthernetIntDisable(ETH_BASE, ETH_INT_PHY);
+        HWREGBITW(&g_ulFlags, FLAG_PHYINT) = 1;
+    }
+
+    // Check to see if an RX Interrupt has occurred.
+    if(ulTemp & ETH_INT_RX)
+    {
+        // Disable Ethernet RX Interrupt.  Frames are now pulled out of the
+        // FIFO back to back until it is empty.
+        EthernetIntDisable(ETH_BASE, ETH_INT_RX);
+    }
+
+    // Check to see if waiting on a DMA to complete.
+    if(HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) == 1)
+    {
+        // Verify the channel transfer is done
         if(uDMAChannelModeGet(UDMA_CHANNEL_ETH0RX) == UDMA_MODE_STOP)
         {
-            // Indicate that a data has been read in.
-            HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) = 0;
+            // Indicate that a data has been read in.
+            HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) = 0;
+            EthernetRxDone();
+        }
+    }
+
+    // Check to see if the Ethernet TX uDMA channel was pending.
+    if(HWREGBITW(&g_ulFlags, FLAG_TXPKT) == 1)
+    {
+        // Verify the channel transfer is done.  The controller disables the
+        // channel at the end of both plain and scatter-gather transfers.
+        if(!uDMAChannelIsEnabled(UDMA_CHANNEL_ETH0TX))
+        {
+            // Trigger the transmission of the data.
+            HWREG(ETH_BASE + MAC_O_TR) = MAC_TR_NEWTX;
+
+            // The frame is in the MAC now, so its block can be reused.
+            psDesc = &g_psTxQueue[g_ulTxTail % NUM_TX_DESCRIPTORS];
+            EthernetPktFree(psDesc->pucBuf);
+            g_ulTxFrames++;
+            g_ulTxBytes += psDesc->lBufLen;
+            g_ulTxTail++;
+
+            // Indicate that a packet has been sent.
+            HWREGBITW(&g_ulFlags, FLAG_TXPKT) = 0;
+            HWREGBITW(&g_ulFlags, FLAG_TXDONE) = 1;
+        }
+    }
+
+    // Start on the next frame in the FIFO and the next queued packet, if any.
+    EthernetRxStart();
+    EthernetTxStart();
+}
+
+//*****************************************************************************
+// Switch between servicing the Ethernet controller from its interrupts and
+// polling it from the main loop.
+//*****************************************************************************
+static void
+EthernetModeSet(unsigned long ulMode)
+{
+    if(ulMode == g_ulEthMode)
+    {
+        return;
+    }
+
+    if(ulMode == ETH_MODE_POLL)
+    {
+        // Mask the interrupts; the main loop calls the handler from now on.
+        IntDisable(INT_ETH);
+#ifndef REV_0_SILICON
+        IntDisable(INT_UDMA);
+#endif
+    }
+    else
+    {
+        // Unmask the interrupts and run the handler once to re-arm the RX
+        // interrupt and pick up anything that arrived since the last poll.
+        IntEnable(INT_ETH);
+#ifndef REV_0_SILICON
+        IntEnable(INT_UDMA);
+#endif
+        IntPendSet(INT_ETH);
+    }
+
+    g_ulEthMode = ulMode;
+    g_ulEthModeSwitches++;
+}
+
+//*****************************************************************************
+// Count the free TCP connections, and if they run short close those that are
+// only waiting out the end of a close.  Called from the main loop once per
+// periodic timer.
+//*****************************************************************************
+static void
+EthernetConnReclaim(void)
+{
+    struct uip_conn *psConn;
+    unsigned long ulFree;
+    u8_t ucState;
+
+    ulFree = 0;
+    for(psConn = &uip_conns[0]; psConn < &uip_conns[UIP_CONNS]; psConn++)
+    {
+        if((psConn->tcpstateflags & UIP_TS_MASK) == UIP_CLOSED)
+        {
+            ulFree++;
+        }
+    }
+
+    if(ulFree < CONN_RESERVE)
+    {
+        for(psConn = &uip_conns[0]; psConn < &uip_conns[UIP_CONNS]; psConn++)
+        {
+            ucState = psConn->tcpstateflags & UIP_TS_MASK;
+            if((ucState == UIP_TIME_WAIT) ||
+               ((ucState == UIP_FIN_WAIT_2) &&
+                (psConn->timer >= CONN_FIN_WAIT_TICKS)))
+            {
+                psConn->tcpstateflags = UIP_CLOSED;
+                g_ulConnReclaimed++;
+                ulFree++;
+            }
+        }
+    }
+
+    g_ulConnFree = ulFree;
+}
+
+//*****************************************************************************
+// Returns true if uIP has a connection to give to a new SYN: a closed one, or
+// one in TIME_WAIT, which it reuses.
+//*****************************************************************************
+static tBoolean
+EthernetConnAvail(void)
+{
+    struct uip_conn *psConn;
+    u8_t ucState;
+
+    for(psConn = &uip_conns[0]; psConn < &uip_conns[UIP_CONNS]; psConn++)
+    {
+        ucState = psConn->tcpstateflags & UIP_TS_MASK;
+        if((ucState == UIP_CLOSED) || (ucState == UIP_TIME_WAIT))
+        {
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+//*****************************************************************************
+// Returns true if the two IP packets are TCP segments of the same connection.
+//*****************************************************************************
+static tBoolean
+EthernetTcpSameConn(const u8_t *pucBuf1, const u8_t *pucBuf2)
+{
+    const uip_tcpip_hdr *psHdr1, *psHdr2;
+
+    psHdr1 = (const uip_tcpip_hdr *)&pucBuf1[UIP_LLH_LEN];
+    psHdr2 = (const uip_tcpip_hdr *)&pucBuf2[UIP_LLH_LEN];
+
+    return((psHdr1->srcport == psHdr2->srcport) &&
+           (psHdr1->destport == psHdr2->destport) &&
+           uip_ipaddr_cmp(psHdr1->srcipaddr, psHdr2->srcipaddr));
+}
+
+//*****************************************************************************
+// Decide what to do with the IP packet in uip_buf.  Everything but a SYN for
+// a new connection to one of our ports, at a time uIP has no connection to
+// give it, is passed to uIP.  Such a SYN is held in the backlog if there is
+// room, dropped if it repeats one already held, and reset otherwise.
+//*****************************************************************************
+static unsigned long
+EthernetSynCheck(void)
+{
+    struct uip_conn *psConn;
+    unsigned long ulIdx;
+
+    if((TCPBUF->proto != UIP_PROTO_TCP) || ((TCPBUF->vhl & 0x0f) != 5) ||
+       ((TCPBUF->flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST |
+                          TCP_FLAG_FIN)) != TCP_FLAG_SYN) ||
+       !uip_ipaddr_cmp(TCPBUF->destipaddr, uip_hostaddr))
+    {
+        return(SYN_PASS);
+    }
+
+    for(ulIdx = 0;
+        ulIdx < (sizeof(g_pusFilterTCPPorts) / sizeof(unsigned short));
+        ulIdx++)
+    {
+        if(HTONS(g_pusFilterTCPPorts[ulIdx]) == TCPBUF->destport)
+        {
+            break;
+        }
+    }
+    if((ulIdx == (sizeof(g_pusFilterTCPPorts) / sizeof(unsigned short))) ||
+       EthernetConnAvail())
+    {
+        return(SYN_PASS);
+    }
+
+    // A repeated SYN for a connection uIP already has is uIP's business.
+    for(psConn = &uip_conns[0]; psConn < &uip_conns[UIP_CONNS]; psConn++)
+    {
+        if(((psConn->tcpstateflags & UIP_TS_MASK) != UIP_CLOSED) &&
+           (psConn->lport == TCPBUF->destport) &&
+           (psConn->rport == TCPBUF->srcport) &&
+           uip_ipaddr_cmp(psConn->ripaddr, TCPBUF->srcipaddr))
+        {
+            return(SYN_PASS);
+        }
+    }
+
+    for(ulIdx = 0; ulIdx < g_ulSynBacklogLen; ulIdx++)
+    {
+        if(EthernetTcpSameConn(g_psSynBacklog[ulIdx].pucBuf, uip_buf))
+        {
+            return(SYN_DROP);
+        }
+    }
+
+    return((g_ulSynBacklogLen < SYN_BACKLOG) ? SYN_HOLD : SYN_RESET);
+}
+
+//*****************************************************************************
+// Turn the TCP segment in uip_buf into a RST answering it, as uIP does for
+// segments to ports nobody listens on.
+//*****************************************************************************
+static void
+EthernetTcpReset(void)
+{
+    unsigned long ulAck;
+    u16_t usTemp;
+
+    // Acknowledge the segment, including the SYN or FIN flag, and send
+    // sequence number zero.
+    ulAck = ((TCPBUF->seqno[0] << 24) | (TCPBUF->seqno[1] << 16) |
+             (TCPBUF->seqno[2] << 8) | TCPBUF->seqno[3]);
+    ulAck += (((TCPBUF->len[0] << 8) | TCPBUF->len[1]) - UIP_IPH_LEN -
+              ((TCPBUF->tcpoffset >> 4) << 2));
+    if(TCPBUF->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))
+    {
+        ulAck++;
+    }
+    TCPBUF->ackno[0] = (u8_t)(ulAck >> 24);
+    TCPBUF->ackno[1] = (u8_t)(ulAck >> 16);
+    TCPBUF->ackno[2] = (u8_t)(ulAck >> 8);
+    TCPBUF->ackno[3] = (u8_t)ulAck;
+    memset(TCPBUF->seqno, 0, sizeof(TCPBUF->seqno));
+
+    // Send it back where it came from.
+    usTemp = TCPBUF->srcport;
+    TCPBUF->srcport = TCPBUF->destport;
+    TCPBUF->destport = usTemp;
+    uip_ipaddr_copy(TCPBUF->destipaddr, TCPBUF->srcipaddr);
+    uip_ipaddr_copy(TCPBUF->srcipaddr, uip_hostaddr);
+    memcpy(BUF->dest.addr, BUF->src.addr, 6);
+    memcpy(BUF->src.addr, uip_ethaddr.addr, 6);
+
+    // A bare TCP header without options or data.
+    TCPBUF->flags = TCP_FLAG_RST | TCP_FLAG_ACK;
+    TCPBUF->tcpoffset = 5 << 4;
+    TCPBUF->wnd[0] = TCPBUF->wnd[1] = 0;
+    TCPBUF->urgp[0] = TCPBUF->urgp[1] = 0;
+    TCPBUF->len[0] = 0;
+    TCPBUF->len[1] = UIP_IPTCPH_LEN;
+    TCPBUF->ipoffset[0] = TCPBUF->ipoffset[1] = 0;
+    TCPBUF->ttl = UIP_TTL;
+    uip_len = UIP_LLH_LEN + UIP_IPTCPH_LEN;
+
+    TCPBUF->tcpchksum = 0;
+    TCPBUF->tcpchksum = ~(uip_tcpchksum());
+    TCPBUF->ipchksum = 0;
+    TCPBUF->ipchksum = ~(uip_ipchksum());
+
+    g_ulSynReset++;
+}
+
+//*****************************************************************************
+// Returns non-zero if fewer than CONN_RESERVE TCP connections were free at
+// the last periodic timer.
+//*****************************************************************************
+int
+EthernetConnLow(void)
+{
+    return(g_ulConnFree < CONN_RESERVE);
+}
+
+//*****************************************************************************
+// Note the time the network became ready, the first time the link is up with
+// an address configured.
+//*****************************************************************************
+static void
+EthernetNetworkReadyCheck(void)
+{
+    if(!g_bNetworkReady && g_bLinkUp && (uip_hostaddr[0] | uip_hostaddr[1]))
+    {
+        g_bNetworkReady = true;
+        g_ulBootNetworkMs = TimebaseGetMs();
+    }
+}
+
+//*****************************************************************************
+// Configure the address, netmask and default router, whether from a DHCP
+// lease or from the cached one.
+//*****************************************************************************
+static void
+EthernetIPConfigure(const u16_t *pusIPAddr, const u16_t *pusNetmask,
+                    const u16_t *pusRouter)
+{
+    uip_sethostaddr(pusIPAddr);
+    uip_setnetmask(pusNetmask);
+    uip_setdraddr(pusRouter);
+    ShowIPAddress(pusIPAddr);
+    g_bArpAnnounce = true;
+    EthernetNetworkReadyCheck();
+}
+
+#ifndef USE_STATIC_IP
+//*****************************************************************************
+// The check word of the cached lease, over everything before it.
+//*****************************************************************************
+static unsigned long
+EthernetDhcpLeaseCheck(void)
+{
+    const unsigned long *pulWord;
+    unsigned long ulIdx, ulCheck;
+
+    pulWord = (const unsigned long *)&g_sDhcpLease;
+    ulCheck = 0;
+    for(ulIdx = 0; ulIdx < ((sizeof(tDhcpLease) / 4) - 1); ulIdx++)
+    {
+        ulCheck = ((ulCheck << 1) | (ulCheck >> 31)) ^ pulWord[ulIdx];
+    }
+
+    return(~ulCheck);
+}
+
+//*****************************************************************************
+// Returns true if there is a cached lease with time left on it.
+//*****************************************************************************
+static tBoolean
+EthernetDhcpLeaseValid(void)
+{
+    return((g_sDhcpLease.ulMagic == DHCP_LEASE_MAGIC) &&
+           (g_sDhcpLease.ulCheck == EthernetDhcpLeaseCheck()) &&
+           (g_sDhcpLease.ulLeftS != 0));
+}
+
+//*****************************************************************************
+// Keep a lease of ulLeaseS seconds for the next start up.
+//*****************************************************************************
+static void
+EthernetDhcpLeaseStore(const u16_t *pusIPAddr, const u16_t *pusNetmask,
+                       const u16_t *pusRouter, const u8_t *pucServerID,
+                       unsigned long ulLeaseS)
+{
+    g_sDhcpLease.ulMagic = DHCP_LEASE_MAGIC;
+    uip_ipaddr_copy(g_sDhcpLease.sIPAddr, pusIPAddr);
+    uip_ipaddr_copy(g_sDhcpLease.sNetmask, pusNetmask);
+    uip_ipaddr_copy(g_sDhcpLease.sRouter, pusRouter);
+    memcpy(g_sDhcpLease.pucServerID, pucServerID, 4);
+    g_sDhcpLease.ulLeftS = ulLeaseS;
+    g_sDhcpLease.ulCheck = EthernetDhcpLeaseCheck();
+}
+
+//*****************************************************************************
+// Count down the time left on the cached lease, and drop the lease when it
+// runs out.  Called from the main loop only.
+//*****************************************************************************
+static void
+EthernetDhcpLeaseAge(void)
+{
+    unsigned long ulSeconds;
+
+    ulSeconds = (TimebaseGetMs() - g_ulDhcpAgeMs) / 1000;
+    if(!ulSeconds)
+    {
+        return;
+    }
+    g_ulDhcpAgeMs += ulSeconds * 1000;
+
+    if(!EthernetDhcpLeaseValid())
+    {
+        return;
+    }
+    if(g_sDhcpLease.ulLeftS <= ulSeconds)
+    {
+        g_sDhcpLease.ulMagic = 0;
+        return;
+    }
+    g_sDhcpLease.ulLeftS -= ulSeconds;
+    g_sDhcpLease.ulCheck = EthernetDhcpLeaseCheck();
+}
+
+//*****************************************************************************
+// The address has been confirmed by a DHCP server.
+//*****************************************************************************
+static void
+EthernetDhcpBound(void)
+{
+    if(g_ulDhcpState != DHCP_BOUND)
+    {
+        g_ulDhcpMs = (TimebaseStamp() - g_ulDhcpStartUs) / 1000;
+        g_ulDhcpState = DHCP_BOUND;
+    }
+}
+
+//*****************************************************************************
+// Stop the INIT-REBOOT exchange.
+//*****************************************************************************
+static void
+EthernetDhcpRebootStop(void)
+{
+    if(g_psDhcpConn)
+    {
+        uip_udp_remove(g_psDhcpConn);
+        g_psDhcpConn = 0;
+    }
+    g_bDhcpSend = false;
+}
+
+//*****************************************************************************
+// Hand over to the uIP DHCP client, and have it ask for an address.
+//*****************************************************************************
+static void
+EthernetDhcpClientStart(void)
+{
+    if(!g_bDhcpClient)
+    {
+        dhcpc_init(&uip_ethaddr, sizeof(uip_ethaddr));
+        g_bDhcpClient = true;
+    }
+    dhcpc_request();
+
+    g_ulDhcpState = DHCP_CLIENT;
+    g_ulDhcpTick = g_ulTickCounter;
+}
+
+//*****************************************************************************
+// Get an address, at start up and whenever the link comes up: with a cached
+// lease, by confirming it, otherwise through the uIP client.
+//*****************************************************************************
+static void
+EthernetDhcpStart(void)
+{
+    uip_ipaddr_t sAddr;
+
+    g_ulDhcpStartUs = TimebaseStamp();
+
+    // Until a server answers there is no address to use or announce.
+    uip_ipaddr(sAddr, 0, 0, 0, 0);
+    uip_sethostaddr(sAddr);
+    g_bArpAnnounce = false;
+
+    if(!EthernetDhcpLeaseValid())
+    {
+        EthernetDhcpClientStart();
+        return;
+    }
+
+    if(!g_psDhcpConn)
+    {
+        uip_ipaddr(sAddr, 255, 255, 255, 255);
+        g_psDhcpConn = uip_udp_new(&sAddr, HTONS(DHCP_SERVER_PORT));
+        if(!g_psDhcpConn)
+        {
+            EthernetDhcpClientStart();
+            return;
+        }
+        uip_udp_bind(g_psDhcpConn, HTONS(DHCP_CLIENT_PORT));
+    }
+
+    g_ulDhcpState = DHCP_REBOOTING;
+    g_ulDhcpTries = 0;
+    g_ulDhcpTick = g_ulTickCounter;
+    g_ulDhcpXid = (g_ulTickCounter ^ (uip_ethaddr.addr[4] << 24) ^
+                   (uip_ethaddr.addr[5] << 16) ^ g_ulRxFrames);
+}
+#endif
+
+//*****************************************************************************
+// Read the link state from the PHY and act on a change.  While the link is
+// down the main loop stops running the uIP timers, so connections neither
+// time out nor retransmit into the void; they carry on where they left off
+// once it is back.  Also acknowledges and re-enables the PHY interrupt.
+// Called from the main loop only.
+//*****************************************************************************
+static void
+EthernetLinkCheck(void)
+{
+    tBoolean bLinkUp;
+
+    // Reading the interrupt register acknowledges the interrupt in the PHY.
+    EthernetPHYRead(ETH_BASE, ETH_PHY_INT_REG);
+    bLinkUp = ((EthernetPHYRead(ETH_BASE, PHY_MR1) & PHY_MR1_LINK) ?
+               true : false);
+
+    // The interrupt mask is also changed by the interrupt handler.
+    IntMasterDisable();
+    EthernetIntEnable(ETH_BASE, ETH_INT_PHY);
+    IntMasterEnable();
+
+    if(bLinkUp == g_bLinkUp)
+    {
+        return;
+    }
+    g_bLinkUp = bLinkUp;
+    g_ulLinkChanges++;
+    g_bArpAnnounce = bLinkUp;
+
+#ifndef USE_STATIC_IP
+    // The cable may have been moved to another network, so ask for an
+    // address again.
+    if(bLinkUp)
+    {
+        EthernetDhcpStart();
+    }
+#endif
+
+    EthernetNetworkReadyCheck();
+}
+
+//*****************************************************************************
+// The names of the counters reported by the statistics endpoint, in the
+// order EthernetStatsGet() reports them.
+//*****************************************************************************
+static const char * const g_ppcStatNames[] =
+{
+    "eth.rx.frames", "eth.rx.bytes", "eth.rx.fps", "eth.rx.bps",
+    "eth.rx.overflow", "eth.rx.error", "eth.rx.ringfull",
+    "eth.rx.drop.size", "eth.rx.drop.type", "eth.rx.drop.arp",
+    "eth.rx.drop.addr", "eth.rx.drop.proto", "eth.rx.drop.port",
+    "eth.tx.frames", "eth.tx.bytes", "eth.tx.fps", "eth.tx.bps",
+    "eth.tx.error", "eth.tx.queuefull", "eth.tx.more",
+    "pkt.free", "pkt.free.min", "pkt.empty",
+    "eth.mode", "eth.mode.int.ms", "eth.mode.poll.ms", "eth.mode.switches",
+    "eth.link", "eth.link.changes", "boot.control.ms", "boot.network.ms",
+    "cpu.load", "cpu.idle.cps", "tcp.conn.free", "tcp.conn.reclaim",
+    "tcp.conn.accept", "tcp.conn.aps",
+    "tcp.syn.backlog", "tcp.syn.served", "tcp.syn.reset",
+    "udp.cmd.accepted", "udp.cmd.stale", "udp.cmd.bad",
+    "telem.sent", "telem.lost", "arp.held", "arp.released", "arp.dropped",
+    "dhcp.ms", "dhcp.reboot.ack", "dhcp.reboot.nak", "dhcp.reboot.timeout",
+    "ws.cmd.accepted", "ws.cmd.bad", "ws.state.sent", "http.value.cycles",
+    "http.resend",
+    "ip.recv", "ip.sent", "ip.drop", "ip.vhlerr", "ip.hblenerr",
+    "ip.lblenerr", "ip.fragerr", "ip.chkerr", "ip.protoerr",
+    "icmp.recv", "icmp.sent", "icmp.drop", "icmp.typeerr",
+    "tcp.recv", "tcp.sent", "tcp.drop", "tcp.chkerr", "tcp.ackerr",
+    "tcp.rst", "tcp.rexmit", "tcp.syndrop", "tcp.synrst",
+    "udp.recv", "udp.sent", "udp.drop",
+};
+
+#define NUM_STATS               (sizeof(g_ppcStatNames) /                    \
+                                 sizeof(g_ppcStatNames[0]))
+
+//*****************************************************************************
+// The statistics pages are sized for at most HTTPD_STATS counters (see
+// httpd.h).  This fails to compile if there are more.
+//*****************************************************************************
+typedef char tStatsFit[(NUM_STATS <= HTTPD_STATS) ? 1 : -1];
+
+//*****************************************************************************
+// Take a snapshot of the driver and uIP counters.
+//*****************************************************************************
+static void
+EthernetStatsGet(unsigned long *pulStats)
+{
+    unsigned long ulIdx;
+
+    *pulStats++ = g_ulRxFrames;
+    *pulStats++ = g_ulRxBytes;
+    *pulStats++ = g_ulRxFramesPerSec;
+    *pulStats++ = g_ulRxBytesPerSec;
+    *pulStats++ = g_ulRxOverflows;
+    *pulStats++ = g_ulRxErrors;
+    *pulStats++ = g_ulRxRingFull;
+    for(ulIdx = 0; ulIdx < NUM_ETH_DROPS; ulIdx++)
+    {
+        *pulStats++ = g_pulEthDrops[ulIdx];
+    }
+    *pulStats++ = g_ulTxFrames;
+    *pulStats++ = g_ulTxBytes;
+    *pulStats++ = g_ulTxFramesPerSec;
+    *pulStats++ = g_ulTxBytesPerSec;
+    *pulStats++ = g_ulTxErrors;
+    *pulStats++ = g_ulTxQueueFull;
+    *pulStats++ = g_ulTxMoreSent;
+    *pulStats++ = g_ulPktFree;
+    *pulStats++ = g_ulPktFreeMin;
+    *pulStats++ = g_ulPktEmpty;
+    *pulStats++ = g_ulEthMode;
+    *pulStats++ = g_pulEthModeTicks[ETH_MODE_INT] * SYSTICKMS;
+    *pulStats++ = g_pulEthModeTicks[ETH_MODE_POLL] * SYSTICKMS;
+    *pulStats++ = g_ulEthModeSwitches;
+    *pulStats++ = g_bLinkUp;
+    *pulStats++ = g_ulLinkChanges;
+    *pulStats++ = g_ulBootControlMs;
+    *pulStats++ = g_ulBootNetworkMs;
+    *pulStats++ = g_ulCpuLoad;
+    *pulStats++ = g_ulIdleCyclesPerSec;
+    *pulStats++ = g_ulConnFree;
+    *pulStats++ = g_ulConnReclaimed;
+    *pulStats++ = httpd_conn_accepted;
+    *pulStats++ = g_ulConnAcceptPerSec;
+    *pulStats++ = g_ulSynBacklogged;
+    *pulStats++ = g_ulSynServed;
+    *pulStats++ = g_ulSynReset;
+    *pulStats++ = g_ulUdpCmdAccepted;
+    *pulStats++ = g_ulUdpCmdStale;
+    *pulStats++ = g_ulUdpCmdBad;
+    *pulStats++ = g_ulTelemSent;
+    *pulStats++ = g_ulTelemLost;
+    *pulStats++ = g_ulArpHeld;
+    *pulStats++ = g_ulArpReleased;
+    *pulStats++ = g_ulArpDropped;
+    *pulStats++ = g_ulDhcpMs;
+    *pulStats++ = g_ulDhcpRebootAck;
+    *pulStats++ = g_ulDhcpRebootNak;
+    *pulStats++ = g_ulDhcpRebootTimeout;
+    *pulStats++ = g_ulWsCmdAccepted;
+    *pulStats++ = g_ulWsCmdBad;
+    *pulStats++ = g_ulWsStateSent;
+    *pulStats++ = httpd_value_cycles;
+    *pulStats++ = httpd_resent;
+    *pulStats++ = uip_stat.ip.recv;
+    *pulStats++ = uip_stat.ip.sent;
+    *pulStats++ = uip_stat.ip.drop;
+    *pulStats++ = uip_stat.ip.vhlerr;
+    *pulStats++ = uip_stat.ip.hblenerr;
+    *pulStats++ = uip_stat.ip.lblenerr;
+    *pulStats++ = uip_stat.ip.fragerr;
+    *pulStats++ = uip_stat.ip.chkerr;
+    *pulStats++ = uip_stat.ip.protoerr;
+    *pulStats++ = uip_stat.icmp.recv;
+    *pulStats++ = uip_stat.icmp.sent;
+    *pulStats++ = uip_stat.icmp.drop;
+    *pulStats++ = uip_stat.icmp.typeerr;
+    *pulStats++ = uip_stat.tcp.recv;
+    *pulStats++ = uip_stat.tcp.sent;
+    *pulStats++ = uip_stat.tcp.drop;
+    *pulStats++ = uip_stat.tcp.chkerr;
+    *pulStats++ = uip_stat.tcp.ackerr;
+    *pulStats++ = uip_stat.tcp.rst;
+    *pulStats++ = uip_stat.tcp.rexmit;
+    *pulStats++ = uip_stat.tcp.syndrop;
+    *pulStats++ = uip_stat.tcp.synrst;
+    *pulStats++ = uip_stat.udp.recv;
+    *pulStats++ = uip_stat.udp.sent;
+    *pulStats++ = uip_stat.udp.drop;
+}
+
+//*****************************************************************************
+// The snapshot the two formats below are made from.  It is kept off the
+// stack, which is small and which httpd_appcall() is already deep in when
+// they are called; they are only called from the main loop.
+//*****************************************************************************
+static unsigned long g_pulStatsSnap[NUM_STATS + 1];
+
+//*****************************************************************************
+// Format the counters as text, one "name value" line per counter.  Returns
+// the number of characters written, or 0 if they do not all fit.
+//*****************************************************************************
+long
+EthernetStatsText(char *pcBuf, long lBufLen)
+{
+    unsigned long ulIdx;
+    long lLen;
+
+    EthernetStatsGet(g_pulStatsSnap);
+
+    for(ulIdx = 0, lLen = 0; ulIdx < NUM_STATS; ulIdx++)
+    {
+        lLen += usnprintf(&pcBuf[lLen], lBufLen - lLen, "%s %u\n",
+                          g_ppcStatNames[ulIdx], g_pulStatsSnap[ulIdx]);
+        if(lLen >= lBufLen)
+        {
+            return(0);
+        }
+    }
+
+    return(lLen);
+}
+
+//*****************************************************************************
+// Format the counters in binary form: the number of counters followed by
+// the counters themselves, all as 32-bit little endian words in the order of
+// g_ppcStatNames.  Returns the number of bytes written, or 0 if the buffer is
+// too small.
+//*****************************************************************************
+long
+EthernetStatsBinary(unsigned char *pucBuf, long lBufLen)
+{
+    long lLen;
+
+    lLen = sizeof(g_pulStatsSnap);
+    if(lBufLen < lLen)
+    {
+        return(0);
+    }
+
+    g_pulStatsSnap[0] = NUM_STATS;
+    EthernetStatsGet(&g_pulStatsSnap[1]);
+    memcpy(pucBuf, g_pulStatsSnap, lLen);
+
+    return(lLen);
+}
+
+//*****************************************************************************
+// Callback for when DHCP client has been configured.
+//*****************************************************************************
+void
+dhcpc_configured(const struct dhcpc_state *s)
+{
+    EthernetIPConfigure(s->ipaddr, s->netmask, s->default_router);
+#ifndef USE_STATIC_IP
+    EthernetDhcpLeaseStore(s->ipaddr, s->netmask, s->default_router,
+                           s->serverid,
+                           ((unsigned long)HTONS(s->lease_time[0]) << 16) |
+                           HTONS(s->lease_time[1]));
+    EthernetDhcpBound();
+#endif
+}
+
+//*****************************************************************************
+// The Internet checksum.  uIP is built with UIP_ARCH_CHKSUM (see uip-conf.h)
+// so that these replace its own versions, which only know about uip_buf: the
+// TCP checksum of a segment sent with EthernetSendNoCopy() has to cover the
+// payload where it lives.  The sums are kept in host byte order, and are
+// added up by EthernetChksum() in enet_chksum.c.
+//*****************************************************************************
+u16_t
+uip_chksum(u16_t *pusData, u16_t usLen)
+{
+    return(htons(EthernetChksum(0, (u8_t *)pusData, usLen)));
+}
+
+u16_t
+uip_ipchksum(void)
+{
+    u16_t usSum;
+
+    usSum = EthernetChksum(0, &uip_buf[UIP_LLH_LEN], UIP_IPH_LEN);
+    return((usSum == 0) ? 0xffff : htons(usSum));
+}
+
+//*****************************************************************************
+// The TCP or UDP checksum of the packet at pucPkt, in the form uIP returns
+// it.  The payload of a zero-copy TCP segment is taken from pucPayload.
+//*****************************************************************************
+static u16_t
+EthernetUpperChksum(const u8_t *pucPkt, u8_t ucProto, const u8_t *pucPayload)
+{
+    const uip_tcpip_hdr *psHdr;
+    u16_t usLen, usHdrLen, usSum;
+    const u8_t *pucData;
+
+    psHdr = (const uip_tcpip_hdr *)&pucPkt[UIP_LLH_LEN];
+    usLen = ((psHdr->len[0] << 8) + psHdr->len[1]) - UIP_IPH_LEN;
+    pucData = &pucPkt[UIP_LLH_LEN + UIP_IPH_LEN];
+
+    // The pseudo header: protocol, length and the two addresses.  The first
+    // addition cannot carry.
+    usSum = usLen + ucProto;
+    usSum = EthernetChksum(usSum, (const u8_t *)&psHdr->srcipaddr[0],
+                           2 * sizeof(uip_ipaddr_t));
+
+    // The TCP header is in the packet but the payload of a zero-copy segment
+    // is not.  The header is an even number of bytes, so the payload sum
+    // lines up with it.
+    if(pucPayload && (ucProto == UIP_PROTO_TCP))
+    {
+        usHdrLen = (psHdr->tcpoffset >> 4) << 2;
+        if(usLen > usHdrLen)
+        {
+            usSum = EthernetChksum(usSum, pucData, usHdrLen);
+            usSum = EthernetChksum(usSum, pucPayload, usLen - usHdrLen);
+            return((usSum == 0) ? 0xffff : htons(usSum));
+        }
+    }
+
+    usSum = EthernetChksum(usSum, pucData, usLen);
+    return((usSum == 0) ? 0xffff : htons(usSum));
+}
+
+u16_t
+uip_tcpchksum(void)
+{
+    return(EthernetUpperChksum(uip_buf, UIP_PROTO_TCP, g_pucTxPayload));
+}
+
+#if UIP_UDP_CHECKSUMS
+u16_t
+uip_udpchksum(void)
+{
+    return(EthernetUpperChksum(uip_buf, UIP_PROTO_UDP, 0));
+}
+#endif
+
+//*****************************************************************************
+// Send data from the application without copying it into uip_buf, in place
+// of uip_send().  The data must stay as it is until it has been acknowledged,
+// since a retransmission sends it again, and it must be readable by the uDMA,
+// which rules out flash.  Data that is not word aligned is copied as
+// uip_send() would.
+//*****************************************************************************
+void
+EthernetSendNoCopy(const void *pvData, int iLen)
+{
+    if(((unsigned long)pvData & 3) != 0)
+    {
+        uip_send(pvData, iLen);
+        return;
+    }
+
+    g_pucTxPayload = pvData;
+    uip_slen = iLen;
+}
+
+//*****************************************************************************
+// Queue a packet for transmission using DMA.  The buffer must be aligned on an
+// odd half-word, since the two packet length bytes are written in front of
+// the packet and the rest of the buffer must be word aligned.  lBufLen covers
+// the whole packet; if pucPayload is given, the last lPayloadLen bytes of it
+// are taken from there instead of from the buffer.  The payload must be word
+// aligned and what goes before it in the buffer must end on a word boundary.
+// The buffer must be a block of the packet pool; it belongs to the transmit
+// queue until the interrupt gives it back to the pool.  Returns 0 if the
+// queue is full, in which case the block stays with the caller.
+//*****************************************************************************
+static long
+EthernetPacketPutDMA(unsigned long ulBase, unsigned char *pucBuf, long lBufLen,
+                     const unsigned char *pucPayload, long lPayloadLen)
+{
+    tTxDescriptor *psDesc;
+
+    // Check the arguments.
+    ASSERT(ulBase == ETH_BASE);
+    ASSERT(((unsigned long)pucBuf & 3) == 2);
+    ASSERT(!pucPayload || (((unsigned long)pucPayload & 3) == 0));
+    ASSERT(!pucPayload || (((lBufLen - lPayloadLen - 2) & 3) == 0));
+
+    // Apply backpressure if the queue is full.
+    if(!TX_QUEUE_SPACE())
+    {
+        return(0);
+    }
+
+    // Fill in the descriptor at the head of the queue.
+    psDesc = &g_psTxQueue[g_ulTxHead % NUM_TX_DESCRIPTORS];
+    psDesc->pucBuf = pucBuf;
+    psDesc->lBufLen = lBufLen;
+    psDesc->pucPayload = pucPayload;
+    psDesc->lPayloadLen = pucPayload ? lPayloadLen : 0;
+    g_ulTxHead++;
+
+    // Have the interrupt start the transfer if the transmitter is idle.
+    if(HWREGBITW(&g_ulFlags, FLAG_TXPKT) == 0)
+    {
+        IntPendSet(INT_ETH);
+    }
+
+    return(lBufLen);
+}
+
+//*****************************************************************************
+// Set the IP length of the TCP segment at pucPkt from the frame length lLen,
+// and work out its checksums again.
+//*****************************************************************************
+static void
+EthernetTcpHdrSet(unsigned char *pucPkt, long lLen,
+                  const unsigned char *pucPayload)
+{
+    uip_tcpip_hdr *psHdr;
+    u16_t usSum;
+
+    psHdr = (uip_tcpip_hdr *)&pucPkt[UIP_LLH_LEN];
+    lLen -= UIP_LLH_LEN;
+    psHdr->len[0] = lLen >> 8;
+    psHdr->len[1] = lLen & 0xff;
+
+    psHdr->ipchksum = 0;
+    usSum = EthernetChksum(0, (u8_t *)psHdr, UIP_IPH_LEN);
+    psHdr->ipchksum = ~((usSum == 0) ? 0xffff : htons(usSum));
+
+    psHdr->tcpchksum = 0;
+    psHdr->tcpchksum = ~EthernetUpperChksum(pucPkt, UIP_PROTO_TCP, pucPayload);
+}
+
+//*****************************************************************************
+// Queue the segments EthernetSendMore() took, behind the TCP segment uIP has
+// built in uip_buf and that has just been queued, or drop them if bSend is
+// false.  Each gets uIP's headers with its own sequence number, length and
+// checksums, and an IP identification following on from uIP's.  They are
+// dropped too if uIP's segment is not one of the connection they were taken
+// for, which cannot happen while the web server calls EthernetSendMore()
+// only after handing uIP a segment of its own.
+//*****************************************************************************
+static void
+EthernetSendMoreOut(tBoolean bSend)
+{
+    uip_tcpip_hdr *psHdr;
+    tTxMore *psMore;
+    unsigned long ulIdx;
+    u16_t usIPID;
+    long lHdrLen;
+
+    lHdrLen = UIP_LLH_LEN + UIP_IPTCPH_LEN;
+    if((BUF->type != htons(UIP_ETHTYPE_IP)) ||
+       (TCPBUF->proto != UIP_PROTO_TCP) || (TCPBUF->tcpoffset != 0x50) ||
+       !g_psTxMoreConn || (TCPBUF->srcport != g_psTxMoreConn->lport) ||
+       (TCPBUF->destport != g_psTxMoreConn->rport))
+    {
+        bSend = false;
+    }
+
+    usIPID = (TCPBUF->ipid[0] << 8) | TCPBUF->ipid[1];
+    for(ulIdx = 0; ulIdx < g_ulTxMore; ulIdx++)
+    {
+        psMore = &g_psTxMore[ulIdx];
+        if(bSend)
+        {
+            memcpy(psMore->pucBuf, uip_buf, lHdrLen);
+            psHdr = (uip_tcpip_hdr *)&psMore->pucBuf[UIP_LLH_LEN];
+            usIPID++;
+            psHdr->ipid[0] = usIPID >> 8;
+            psHdr->ipid[1] = usIPID & 0xff;
+            psHdr->seqno[0] = psMore->ulSeq >> 24;
+            psHdr->seqno[1] = (psMore->ulSeq >> 16) & 0xff;
+            psHdr->seqno[2] = (psMore->ulSeq >> 8) & 0xff;
+            psHdr->seqno[3] = psMore->ulSeq & 0xff;
+            psHdr->flags = TCP_FLAG_ACK | TCP_FLAG_PSH;
+            EthernetTcpHdrSet(psMore->pucBuf, lHdrLen + psMore->lLen,
+                              psMore->pucPayload);
+            if(EthernetPacketPutDMA(ETH_BASE, psMore->pucBuf,
+                                    lHdrLen + psMore->lLen,
+                                    psMore->pucPayload, psMore->lLen))
+            {
+                g_ulTxMoreSent++;
+                continue;
+            }
+        }
+        EthernetPktFree(psMore->pucBuf);
+    }
+
+    // uIP numbers its next packet on from the last of these.
+    if(bSend && g_ulTxMore)
+    {
+        uip_setipid(usIPID);
+    }
+    g_ulTxMore = 0;
+}
+
+//*****************************************************************************
+// Send iLen bytes at pvData, which start at sequence number ulSeq, as one
+// more segment of the connection the application is being called for, to go
+// out behind the one uIP builds in reply.  This is how the web server keeps
+// several segments in flight, which uIP cannot; the web server keeps track
+// of them itself.  The data is chained on from where it lives, as with
+// EthernetSendNoCopy(), unless iCopy is set or it is not word aligned, in
+// which case it is copied.  Returns 0, and the segment is not sent, if there
+// is no room in the transmit queue or no block for it; a block is always
+// left for the receiver.
+//*****************************************************************************
+int
+EthernetSendMore(const void *pvData, int iLen, unsigned long ulSeq, int iCopy)
+{
+    unsigned char *pucBuf;
+    tTxMore *psMore;
+
+    // Segments taken for another connection can no longer go out.
+    if(g_psTxMoreConn != uip_conn)
+    {
+        EthernetSendMoreOut(false);
+        g_psTxMoreConn = uip_conn;
+    }
+
+    if((g_ulTxMore == (NUM_TX_DESCRIPTORS - 1)) ||
+       (((g_ulTxHead - g_ulTxTail) + g_ulTxMore + 2) > NUM_TX_DESCRIPTORS) ||
+       (g_ulPktFree < 2) ||
+       (iLen > (UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPTCPH_LEN)))
+    {
+        return(0);
+    }
+    pucBuf = EthernetPktAlloc();
+    if(!pucBuf)
+    {
+        return(0);
+    }
+
+    psMore = &g_psTxMore[g_ulTxMore++];
+    psMore->pucBuf = pucBuf;
+    psMore->pucPayload = pvData;
+    psMore->lLen = iLen;
+    psMore->ulSeq = ulSeq;
+    if(iCopy || (((unsigned long)pvData & 3) != 0))
+    {
+        memcpy(&pucBuf[UIP_LLH_LEN + UIP_IPTCPH_LEN], pvData, iLen);
+        psMore->pucPayload = 0;
+    }
+
+    return(1);
+}
+
+//*****************************************************************************
+// Before uIP sees the TCP segment in uip_buf, note the peer's window for the
+// web server, and turn an ACK for part of what the web server has in flight
+// into one uIP takes.  uIP only takes an ACK for exactly the segment it
+// believes outstanding, so its sequence number is put back to the oldest
+// byte in flight and its outstanding length made what the ACK covers.  uIP
+// then moves its sequence number on and calls the web server with
+// uip_acked().
+//*****************************************************************************
+static void
+EthernetTcpAckCheck(void)
+{
+    struct httpd_state *psState;
+    struct uip_conn *psConn;
+    unsigned long ulAck;
+
+    if((BUF->type != htons(UIP_ETHTYPE_IP)) || (TCPBUF->vhl != 0x45) ||
+       (TCPBUF->proto != UIP_PROTO_TCP) || (TCPBUF->destport != HTONS(80)))
+    {
+        return;
+    }
+
+    for(psConn = uip_conns; psConn < &uip_conns[UIP_CONNS]; psConn++)
+    {
+        if(((psConn->tcpstateflags & UIP_TS_MASK) != UIP_CLOSED) &&
+           (psConn->lport == TCPBUF->destport) &&
+           (psConn->rport == TCPBUF->srcport) &&
+           uip_ipaddr_cmp(psConn->ripaddr, TCPBUF->srcipaddr))
+        {
+            break;
+        }
+    }
+    if(psConn == &uip_conns[UIP_CONNS])
+    {
+        return;
+    }
+
+    psState = (struct httpd_state *)&psConn->appstate;
+    psState->wnd = (TCPBUF->wnd[0] << 8) | TCPBUF->wnd[1];
+
+    if(((psConn->tcpstateflags & UIP_TS_MASK) != UIP_ESTABLISHED) ||
+       !(TCPBUF->flags & TCP_FLAG_ACK) ||
+       (psState->snd_una == psState->snd_nxt))
+    {
+        return;
+    }
+
+    ulAck = (((unsigned long)TCPBUF->ackno[0] << 24) |
+             ((unsigned long)TCPBUF->ackno[1] << 16) |
+             ((unsigned long)TCPBUF->ackno[2] << 8) |
+             (unsigned long)TCPBUF->ackno[3]);
+    if((ulAck - psState->snd_una - 1) <
+       (psState->snd_nxt - psState->snd_una))
+    {
+        psConn->snd_nxt[0] = psState->snd_una >> 24;
+        psConn->snd_nxt[1] = (psState->snd_una >> 16) & 0xff;
+        psConn->snd_nxt[2] = (psState->snd_una >> 8) & 0xff;
+        psConn->snd_nxt[3] = psState->snd_una & 0xff;
+        psConn->len = ulAck - psState->snd_una;
+    }
+}
+
+//*****************************************************************************
+// Queue the IP packet uIP has built in uip_buf, after uip_arp_out().  The
+// payload of a segment sent with EthernetSendNoCopy() is chained on from
+// where it lives, unless uip_arp_out() has replaced the segment with an ARP
+// request or the headers do not end on a word boundary, in which case it is
+// copied in after all.  Returns 0 if the queue is full.
+//*****************************************************************************
+static long
+EthernetPacketPutUIP(void)
+{
+    const unsigned char *pucPayload;
+    long lHdrLen, lPayloadLen;
+
+    pucPayload = g_pucTxPayload;
+    g_pucTxPayload = 0;
+
+    if((BUF->type != htons(UIP_ETHTYPE_IP)) ||
+       (TCPBUF->proto != UIP_PROTO_TCP))
+    {
+        return(EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len, 0, 0));
+    }
+
+    lHdrLen = UIP_LLH_LEN + UIP_IPH_LEN + ((TCPBUF->tcpoffset >> 4) << 2);
+    lPayloadLen = uip_len - lHdrLen;
+    if(pucPayload && (lPayloadLen > 0) && (((lHdrLen - 2) & 3) != 0))
+    {
+        memcpy(&uip_buf[lHdrLen], pucPayload, lPayloadLen);
+        pucPayload = 0;
+    }
+    if(lPayloadLen <= 0)
+    {
+        pucPayload = 0;
+    }
+
+    return(EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len, pucPayload,
+                                lPayloadLen));
+}
+
+//*****************************************************************************
+// Reply to a status request with the value last written for the selected
+// motor, to three decimal places.
+//*****************************************************************************
+static char g_pcCmdResponse[16];
+
+static void
+EthernetCmdValueResponse(long lValue)
+{
+    unsigned long ulValue, ulMilli;
+    int iLen;
+
+    ulValue = (lValue < 0) ? -(unsigned long)lValue : lValue;
+    ulMilli = (((ulValue & 0xffff) * 1000) + 0x8000) >> 16;
+    ulValue = (ulValue >> 16) + (ulMilli / 1000);
+    iLen = usnprintf(g_pcCmdResponse, sizeof(g_pcCmdResponse), "%s%u.%03u",
+                     ((lValue < 0) && (ulValue || (ulMilli % 1000))) ?
+                     "-" : "", ulValue, ulMilli % 1000);
+    httpd_insert_response(iLen, g_pcCmdResponse);
+}
+
+//*****************************************************************************
+// Build an ARP packet in pucBuf.
+//*****************************************************************************
+static void
+EthernetArpBuild(u8_t *pucBuf, unsigned short usOpcode,
+                 const struct uip_eth_addr *psSrcEth, const void *pvSrcIP,
+                 const struct uip_eth_addr *psDstEth, const void *pvDstIP)
+{
+    static const u8_t pucArpHdr[8] = { 0x00, 0x01, 0x08, 0x00, 6, 4, 0, 0 };
+
+    if(usOpcode == ARP_OP_REQUEST)
+    {
+        memset(&pucBuf[0], 0xff, 6);
+        memset(&pucBuf[32], 0x00, 6);
+    }
+    else
+    {
+        memcpy(&pucBuf[0], psDstEth, 6);
+        memcpy(&pucBuf[32], psDstEth, 6);
+    }
+    memcpy(&pucBuf[6], psSrcEth, 6);
+    pucBuf[12] = UIP_ETHTYPE_ARP >> 8;
+    pucBuf[13] = UIP_ETHTYPE_ARP & 0xff;
+    memcpy(&pucBuf[14], pucArpHdr, 8);
+    pucBuf[21] = usOpcode;
+    memcpy(&pucBuf[22], psSrcEth, 6);
+    memcpy(&pucBuf[ARP_SIPADDR], pvSrcIP, 4);
+    memcpy(&pucBuf[ARP_DIPADDR], pvDstIP, 4);
+}
+
+//*****************************************************************************
+// Put the static ARP entries in uIP's ARP table.
+//*****************************************************************************
+static void
+EthernetArpStaticLoad(void)
+{
+#ifdef ARP_STATIC_ENTRIES
+    unsigned long ulIdx;
+
+    uip_buf = EthernetPktAlloc();
+    if(!uip_buf)
+    {
+        g_ulPktEmpty++;
+        return;
+    }
+
+    for(ulIdx = 0; ulIdx < (sizeof(g_psArpStatic) / sizeof(g_psArpStatic[0]));
+        ulIdx++)
+    {
+        EthernetArpBuild(uip_buf, ARP_OP_REPLY, &g_psArpStatic[ulIdx].sEthAddr,
+                         g_psArpStatic[ulIdx].pucIPAddr, &uip_ethaddr,
+                         uip_hostaddr);
+        uip_len = ARP_PKT_LEN;
+        uip_arp_arpin();
+    }
+    uip_len = 0;
+
+    EthernetPktFree(uip_buf);
+#endif
+}
+
+//*****************************************************************************
+// Hold the packet in pucBuf until its next hop has been resolved.  A newer
+// packet for the same next hop takes the place of the one held, and when
+// the queue is full the oldest packet is dropped.
+//*****************************************************************************
+static void
+EthernetArpHold(u8_t *pucBuf, unsigned short usLen,
+                const unsigned char *pucPayload, const u8_t *pucNextHop)
+{
+    tArpHold *psHold, *psOldest;
+    unsigned long ulIdx;
+
+    psHold = 0;
+    psOldest = &g_psArpHold[0];
+    for(ulIdx = 0; ulIdx < ARP_HOLD; ulIdx++)
+    {
+        if(!g_psArpHold[ulIdx].pucBuf)
+        {
+            if(!psHold)
+            {
+                psHold = &g_psArpHold[ulIdx];
+            }
+        }
+        else if(!memcmp(g_psArpHold[ulIdx].sNextHop, pucNextHop, 4))
+        {
+            psHold = &g_psArpHold[ulIdx];
+            break;
+        }
+        else if((long)(g_psArpHold[ulIdx].ulMs - psOldest->ulMs) < 0)
+        {
+            psOldest = &g_psArpHold[ulIdx];
+        }
+    }
+    if(!psHold)
+    {
+        psHold = psOldest;
+    }
+    if(psHold->pucBuf)
+    {
+        EthernetPktFree(psHold->pucBuf);
+        g_ulArpDropped++;
+    }
+
+    psHold->pucBuf = pucBuf;
+    psHold->usLen = usLen;
+    psHold->pucPayload = pucPayload;
+    memcpy(psHold->sNextHop, pucNextHop, 4);
+    psHold->ulMs = TimebaseGetMs();
+    g_ulArpHeld++;
+}
+
+//*****************************************************************************
+// Resolve the next hop of the IP packet uIP has built in uip_buf, and queue
+// it.  If uip_arp_out() turns it into an ARP request, the request is sent
+// from another block and the packet is held.  Returns true if the block in
+// uip_buf has been taken, by the transmit queue or to be held.
+//*****************************************************************************
+static tBoolean
+EthernetPacketOut(void)
+{
+    u8_t pucSave[ARP_PKT_LEN];
+    const unsigned char *pucPayload;
+    unsigned short usLen;
+    tBoolean bQueued;
+    u8_t *pucArp;
+
+    memcpy(pucSave, uip_buf, ARP_PKT_LEN);
+    usLen = uip_len;
+    pucPayload = g_pucTxPayload;
+
+    uip_arp_out();
+    if(BUF->type != htons(UIP_ETHTYPE_ARP))
+    {
+        bQueued = (EthernetPacketPutUIP() != 0);
+        EthernetSendMoreOut(bQueued);
+        return(bQueued);
+    }
+
+    // The segments the web server sent behind the packet go with it.  They
+    // count as lost and are sent again.
+    EthernetSendMoreOut(false);
+
+    // Without a block for the request, send it in place of the packet as
+    // uIP would have.
+    pucArp = EthernetPktAlloc();
+    if(!pucArp)
+    {
+        g_ulPktEmpty++;
+        return(EthernetPacketPutUIP() != 0);
+    }
+    g_pucTxPayload = 0;
+
+    memcpy(pucArp, uip_buf, ARP_PKT_LEN);
+    if(!EthernetPacketPutDMA(ETH_BASE, pucArp, ARP_PKT_LEN, 0, 0))
+    {
+        EthernetPktFree(pucArp);
+        return(false);
+    }
+
+    memcpy(uip_buf, pucSave, ARP_PKT_LEN);
+    EthernetArpHold(uip_buf, usLen, pucPayload, &pucArp[ARP_DIPADDR]);
+
+    return(true);
+}
+
+//*****************************************************************************
+// Send the gratuitous ARP once there is a link and an address, and move the
+// held packets along: once an ARP packet has come in, send those whose next
+// hop it resolved, and drop those that have waited too long.  Called from
+// the main loop only.
+//*****************************************************************************
+static void
+EthernetArpService(void)
+{
+    u8_t pucSave[ARP_PKT_LEN];
+    tArpHold *psHold;
+    unsigned long ulIdx;
+    tBoolean bArpIn;
+
+    if(g_bArpAnnounce && g_bLinkUp && (uip_hostaddr[0] | uip_hostaddr[1]) &&
+       TX_QUEUE_SPACE())
+    {
+        uip_buf = EthernetPktAlloc();
+        if(uip_buf)
+        {
+            g_bArpAnnounce = false;
+            EthernetArpBuild(uip_buf, ARP_OP_REQUEST, &uip_ethaddr,
+                             uip_hostaddr, 0, uip_hostaddr);
+            if(!EthernetPacketPutDMA(ETH_BASE, uip_buf, ARP_PKT_LEN, 0, 0))
+            {
+                EthernetPktFree(uip_buf);
+            }
+        }
+    }
+
+    bArpIn = g_bArpIn;
+    g_bArpIn = false;
+    for(ulIdx = 0; ulIdx < ARP_HOLD; ulIdx++)
+    {
+        psHold = &g_psArpHold[ulIdx];
+        if(!psHold->pucBuf)
+        {
+            continue;
+        }
+
+        if((TimebaseGetMs() - psHold->ulMs) >= ARP_HOLD_MS)
+        {
+            EthernetPktFree(psHold->pucBuf);
+            psHold->pucBuf = 0;
+            g_ulArpDropped++;
+            continue;
+        }
+
+        if(!bArpIn)
+        {
+            continue;
+        }
+        if(!TX_QUEUE_SPACE())
+        {
+            g_bArpIn = true;
+            continue;
+        }
+
+        // Try the next hop again.  If it is still unknown put the packet
+        // back as it was, and forget the ARP request uIP built.
+        uip_buf = psHold->pucBuf;
+        uip_len = psHold->usLen;
+        g_pucTxPayload = psHold->pucPayload;
+        memcpy(pucSave, uip_buf, ARP_PKT_LEN);
+        uip_arp_out();
+        if(BUF->type == htons(UIP_ETHTYPE_ARP))
+        {
+            memcpy(uip_buf, pucSave, ARP_PKT_LEN);
+            g_pucTxPayload = 0;
+            continue;
+        }
+
+        psHold->pucBuf = 0;
+        if(EthernetPacketPutUIP())
+        {
+            g_ulArpReleased++;
+        }
+        else
+        {
+            EthernetPktFree(uip_buf);
+            g_ulArpDropped++;
+        }
+    }
+    uip_len = 0;
+}
+
+//*****************************************************************************
+// respond to commands sent by the user (client)
+//
+// Called by the web server while it handles the request, so that the reply
+// can carry the result.
+//*****************************************************************************
+void EthernetProcessCMD(int command)
+{
+    x = command;
+    switch(command)
+    {
+    case velocity:
+        Shared_Ram_dataWrite_m3(velocity, velocity_cmd);
+        break;
+
+    case omega:
+        Shared_Ram_dataWrite_m3(omega, omega_cmd);
+        break;
+
+    case left:
+        Shared_Ram_dataWrite_m3(left, left_cmd);
+        break;
+
+    case right:
+        Shared_Ram_dataWrite_m3(right, right_cmd);
+        break;
+
+    case grip:
+        Shared_Ram_dataWrite_m3(grip, grip_cmd);
+        break;
+
+    case magnitude:
+        Shared_Ram_dataWrite_m3(magnitude, magnitude_cmd);
+        break;
+
+    case degree:
+        Shared_Ram_dataWrite_m3(degree, degree_cmd);
+        break;
+
+    case inverse_x:
+        Shared_Ram_dataWrite_m3(inverse_x, inverse_x_cmd);
+        break;
+
+    case inverse_y:
+        Shared_Ram_dataWrite_m3(inverse_y, inverse_y_cmd);
+        break;
+
+    case inverse_the:
+        Shared_Ram_dataWrite_m3(inverse_the, inverse_the_cmd);
+        break;
+
+    case get_veloctiy:
+    case get_omega:
+    case get_left:
+    case get_right:
+        EthernetCmdValueResponse(SHARED_SETPOINT(command - get_veloctiy));
+        break;
+
+    default:
+        break;
+    }
+}
+
+//*****************************************************************************
+// Open the UDP command channel, for datagrams from any host and port.
+//*****************************************************************************
+static void
+EthernetUdpCmdInit(void)
+{
+    g_psUdpCmdConn = uip_udp_new(0, 0);
+    if(g_psUdpCmdConn)
+    {
+        uip_udp_bind(g_psUdpCmdConn, HTONS(UDP_CMD_PORT));
+    }
+
+    g_psTelemConn = uip_udp_new(0, 0);
+    if(g_psTelemConn)
+    {
+        uip_udp_bind(g_psTelemConn, HTONS(TELEM_PORT));
+    }
+}
+
+//*****************************************************************************
+// The value each command word that can be set writes, from velocity on.
+//*****************************************************************************
+static long * const g_pplCmdValue[] =
+{
+    &velocity_cmd, &omega_cmd, &left_cmd, &right_cmd, 0, 0,
+    &grip_cmd, 0, &magnitude_cmd, &degree_cmd, &inverse_x_cmd,
+    &inverse_y_cmd, &inverse_the_cmd
+};
+
+//*****************************************************************************
+// Returns true if every one of a list of commands, in the layout of the UDP
+// command channel, is one that can be set.
+//*****************************************************************************
+static tBoolean
+EthernetCmdCheck(const u8_t *pucCmd, unsigned long ulCount)
+{
+    unsigned long ulIdx, ulCmd;
+
+    for(ulIdx = 0; ulIdx < ulCount; ulIdx++)
+    {
+        // A command below velocity wraps round to a large index, which the
+        // bound rejects.
+        ulCmd = (unsigned long)pucCmd[ulIdx * UDP_CMD_LEN] -
+                (unsigned long)velocity;
+        if((ulCmd >= (sizeof(g_pplCmdValue) / sizeof(g_pplCmdValue[0]))) ||
+           !g_pplCmdValue[ulCmd])
+        {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+//*****************************************************************************
+// Carry out a list of commands that EthernetCmdCheck() has passed, in order.
+//*****************************************************************************
+static void
+EthernetCmdApply(const u8_t *pucCmd, unsigned long ulCount)
+{
+    unsigned long ulIdx;
+    long lValue;
+    int iCmd;
+
+    Shared_Ram_updateBegin_m3();
+    for(ulIdx = 0; ulIdx < ulCount; ulIdx++, pucCmd += UDP_CMD_LEN)
+    {
+        iCmd = pucCmd[0];
+        lValue = (long)(((unsigned long)pucCmd[4] << 24) |
+                        ((unsigned long)pucCmd[5] << 16) |
+                        ((unsigned long)pucCmd[6] << 8) |
+                        (unsigned long)pucCmd[7]);
+        *g_pplCmdValue[iCmd - velocity] = lValue;
+        EthernetProcessCMD(iCmd);
+    }
+    Shared_Ram_updateEnd_m3();
+}
+
+//*****************************************************************************
+// Carry out a WebSocket command frame, a list of commands in the layout of
+// the UDP command channel.  Returns 0, with nothing done, if the frame is
+// malformed.
+//*****************************************************************************
+int
+EthernetCmdRun(const unsigned char *pucCmd, int iLen)
+{
+    unsigned long ulCount;
+
+    ulCount = iLen / UDP_CMD_LEN;
+    if((iLen == 0) || (iLen % UDP_CMD_LEN) || (ulCount > UDP_CMD_MAX) ||
+       !EthernetCmdCheck(pucCmd, ulCount))
+    {
+        g_ulWsCmdBad++;
+        return(0);
+    }
+
+    EthernetCmdApply(pucCmd, ulCount);
+    g_ulWsCmdAccepted++;
+
+    return(1);
+}
+
+//*****************************************************************************
+// Handle a datagram on the UDP command channel.
+//*****************************************************************************
+static void
+EthernetUdpCmdInput(void)
+{
+    const u8_t *pucData;
+    const uip_udpip_hdr *psHdr;
+    unsigned long ulSeq, ulCount;
+
+    pucData = (const u8_t *)uip_appdata;
+    psHdr = (const uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN];
+
+    // Check the layout, and that every command is one that can be set.
+    ulCount = pucData[1];
+    if((uip_datalen() < UDP_CMD_HDR_LEN) ||
+       (pucData[0] != UDP_CMD_VERSION) || (ulCount == 0) ||
+       (ulCount > UDP_CMD_MAX) ||
+       (uip_datalen() < (UDP_CMD_HDR_LEN + (ulCount * UDP_CMD_LEN))) ||
+       !EthernetCmdCheck(&pucData[UDP_CMD_HDR_LEN], ulCount))
+    {
+        g_ulUdpCmdBad++;
+        return;
+    }
+
+    // Drop stale and duplicate datagrams, unless a new session starts.
+    ulSeq = (((unsigned long)pucData[4] << 24) |
+             ((unsigned long)pucData[5] << 16) |
+             ((unsigned long)pucData[6] << 8) | (unsigned long)pucData[7]);
+    if(g_bUdpCmdSession &&
+       uip_ipaddr_cmp(psHdr->srcipaddr, g_sUdpCmdAddr) &&
+       (psHdr->srcport == g_usUdpCmdPort) &&
+       (((g_ulTickCounter - g_ulUdpCmdTick) * SYSTICKMS) <
+        UDP_CMD_SESSION_MS) &&
+       ((long)(ulSeq - g_ulUdpCmdSeq) <= 0))
+    {
+        g_ulUdpCmdStale++;
+        return;
+    }
+    uip_ipaddr_copy(g_sUdpCmdAddr, psHdr->srcipaddr);
+    g_usUdpCmdPort = psHdr->srcport;
+    g_ulUdpCmdSeq = ulSeq;
+    g_ulUdpCmdTick = g_ulTickCounter;
+    g_bUdpCmdSession = true;
+    g_ulUdpCmdAccepted++;
+
+    // Carry out the commands in order.
+    EthernetCmdApply(&pucData[UDP_CMD_HDR_LEN], ulCount);
+}
+
+//*****************************************************************************
+// Handle a telemetry subscription.  The stream goes out from its own
+// connection, whose remote end is the subscriber; the one listening on
+// TELEM_PORT keeps taking subscriptions from anywhere.
+//*****************************************************************************
+static void
+EthernetTelemetrySubscribe(void)
+{
+    const u8_t *pucData;
+    uip_udpip_hdr *psHdr;
+    unsigned long ulDecimate;
+
+    pucData = (const u8_t *)uip_appdata;
+    psHdr = (uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN];
+
+    if((uip_datalen() < TELEM_SUB_LEN) || (pucData[0] != TELEM_VERSION))
+    {
+        return;
+    }
+
+    ulDecimate = (pucData[2] << 8) | pucData[3];
+    if(ulDecimate == 0)
+    {
+        g_bTelemSubscribed = false;
+        return;
+    }
+
+    if(!g_psTelemTxConn)
+    {
+        g_psTelemTxConn = uip_udp_new((uip_ipaddr_t *)psHdr->srcipaddr,
+                                      psHdr->srcport);
+        if(!g_psTelemTxConn)
+        {
+            return;
+        }
+        uip_udp_bind(g_psTelemTxConn, HTONS(TELEM_PORT));
+    }
+    else
+    {
+        uip_ipaddr_copy(g_psTelemTxConn->ripaddr, psHdr->srcipaddr);
+        g_psTelemTxConn->rport = psHdr->srcport;
+    }
+
+    // A new subscription, or a new rate, starts from the latest sample.
+    if(!g_bTelemSubscribed || (ulDecimate != g_ulTelemDecimate))
+    {
+        g_ulTelemDecimate = ulDecimate;
+        g_ulTelemNext = TELEM_SHARED->ulCount;
+        g_ulTelemFill = 0;
+    }
+    g_bTelemSubscribed = true;
+    g_ulTelemTick = g_ulTickCounter;
+}
+
+//*****************************************************************************
+// Copy the samples due for sending out of the ring, until a datagram's worth
+// has been staged.  Samples the C28 is about to overwrite are skipped, along
+// with the part of the datagram already staged, since the samples in a
+// datagram have to be evenly spaced.
+//*****************************************************************************
+static void
+EthernetTelemetryCollect(void)
+{
+    unsigned long ulCount, ulSlot, ulField, ulSkip;
+
+    ulCount = TELEM_SHARED->ulCount;
+    while((g_ulTelemFill < TELEM_SAMPLES) &&
+          ((long)(ulCount - g_ulTelemNext) > 0))
+    {
+        if((ulCount - g_ulTelemNext) > (TELEM_RING - TELEM_GUARD))
+        {
+            ulSkip = (((ulCount - g_ulTelemNext) -
+                       (TELEM_RING - TELEM_GUARD)) +
+                      g_ulTelemDecimate - 1) / g_ulTelemDecimate;
+            g_ulTelemLost += ulSkip + g_ulTelemFill;
+            g_ulTelemNext += ulSkip * g_ulTelemDecimate;
+            g_ulTelemFill = 0;
+            continue;
+        }
+
+        if(g_ulTelemFill == 0)
+        {
+            g_ulTelemFirst = g_ulTelemNext;
+        }
+        ulSlot = g_ulTelemNext % TELEM_RING;
+        for(ulField = 0; ulField < TELEM_FIELDS; ulField++)
+        {
+            g_ppulTelemStage[g_ulTelemFill][ulField] =
+                TELEM_SHARED->pulSample[ulSlot][ulField];
+        }
+        g_ulTelemFill++;
+        g_ulTelemNext += g_ulTelemDecimate;
+    }
+}
+
+//*****************************************************************************
+// Store a 32-bit value in network byte order.
+//*****************************************************************************
+static void
+EthernetPut32(u8_t *pucData, unsigned long ulValue)
+{
+    pucData[0] = ulValue >> 24;
+    pucData[1] = (ulValue >> 16) & 0xff;
+    pucData[2] = (ulValue >> 8) & 0xff;
+    pucData[3] = ulValue & 0xff;
+}
+
+//*****************************************************************************
+// Build the telemetry datagram, when uIP polls the stream's connection and a
+// datagram's worth of samples has been staged.
+//*****************************************************************************
+static void
+EthernetTelemetrySend(void)
+{
+    u8_t *pucData;
+    unsigned long ulSample, ulField;
+
+    if(!g_bTelemSubscribed || (g_ulTelemFill < TELEM_SAMPLES))
+    {
+        return;
+    }
+
+    pucData = (u8_t *)uip_appdata;
+    pucData[0] = TELEM_VERSION;
+    pucData[1] = TELEM_SAMPLES;
+    pucData[2] = g_ulTelemDecimate >> 8;
+    pucData[3] = g_ulTelemDecimate & 0xff;
+    EthernetPut32(&pucData[4], g_ulTelemSeq);
+    EthernetPut32(&pucData[8], g_ulTelemFirst);
+    EthernetPut32(&pucData[12], TimebaseGetMs());
+    pucData += TELEM_HDR_LEN;
+    for(ulSample = 0; ulSample < TELEM_SAMPLES; ulSample++)
+    {
+        for(ulField = 0; ulField < TELEM_FIELDS; ulField++)
+        {
+            EthernetPut32(pucData, g_ppulTelemStage[ulSample][ulField]);
+            pucData += 4;
+        }
+    }
+    uip_udp_send(TELEM_HDR_LEN + (TELEM_SAMPLES * TELEM_FIELDS * 4));
+
+    g_ulTelemSeq++;
+    g_ulTelemSent++;
+    g_ulTelemFill = 0;
+}
+
+//*****************************************************************************
+// Build a state frame for a WebSocket client of httpd.c.  Returns its
+// length, or 0 if it does not fit in lBufLen bytes.
+//*****************************************************************************
+long
+EthernetStateGet(unsigned char *pucBuf, long lBufLen)
+{
+    unsigned long ulCount, ulSlot, ulIdx;
+
+    if(lBufLen < STATE_LEN)
+    {
+        return(0);
+    }
+
+    // The C28 writes a sample before it counts it, so the last one counted
+    // is complete.
+    ulCount = TELEM_SHARED->ulCount - 1;
+    ulSlot = ulCount % TELEM_RING;
+
+    pucBuf[0] = STATE_VERSION;
+    pucBuf[1] = TELEM_FIELDS;
+    pucBuf[2] = STATE_SETPOINTS;
+    pucBuf[3] = 0;
+    EthernetPut32(&pucBuf[4], TimebaseStamp());
+    EthernetPut32(&pucBuf[8], ulCount);
+    pucBuf += STATE_HDR_LEN;
+    for(ulIdx = 0; ulIdx < TELEM_FIELDS; ulIdx++)
+    {
+        EthernetPut32(pucBuf, TELEM_SHARED->pulSample[ulSlot][ulIdx]);
+        pucBuf += 4;
+    }
+    for(ulIdx = 0; ulIdx < STATE_SETPOINTS; ulIdx++)
+    {
+        EthernetPut32(pucBuf, SHARED_SETPOINT(ulIdx));
+        pucBuf += 4;
+    }
+
+    g_ulWsStateSent++;
+
+    return(STATE_LEN);
+}
+
+#ifndef USE_STATIC_IP
+//*****************************************************************************
+// Build the INIT-REBOOT DHCPREQUEST for the cached address.
+//*****************************************************************************
+static void
+EthernetDhcpSend(void)
+{
+    static const u8_t pucCookie[4] = { 99, 130, 83, 99 };
+    u8_t *pucMsg, *pucOpt;
+
+    pucMsg = (u8_t *)uip_appdata;
+    memset(pucMsg, 0, DHCP_OPTIONS);
+    pucMsg[0] = 1;
+    pucMsg[1] = 1;
+    pucMsg[2] = sizeof(uip_ethaddr);
+    EthernetPut32(&pucMsg[4], g_ulDhcpXid);
+
+    // Ask for the answer to be broadcast, since there is no address yet.
+    pucMsg[10] = 0x80;
+    memcpy(&pucMsg[28], &uip_ethaddr, sizeof(uip_ethaddr));
+    memcpy(&pucMsg[236], pucCookie, 4);
+
+    pucOpt = &pucMsg[DHCP_OPTIONS];
+    *pucOpt++ = 53;
+    *pucOpt++ = 1;
+    *pucOpt++ = DHCP_REQUEST;
+    *pucOpt++ = 50;
+    *pucOpt++ = 4;
+    memcpy(pucOpt, g_sDhcpLease.sIPAddr, 4);
+    pucOpt += 4;
+    *pucOpt++ = 55;
+    *pucOpt++ = 2;
+    *pucOpt++ = 1;
+    *pucOpt++ = 3;
+    *pucOpt++ = 255;
+
+    uip_udp_send(pucOpt - pucMsg);
+}
+
+//*****************************************************************************
+// Handle the answer to the INIT-REBOOT request.
+//*****************************************************************************
+static void
+EthernetDhcpInput(void)
+{
+    const u8_t *pucMsg, *pucOpt, *pucEnd;
+    const u8_t *pucNetmask, *pucRouter, *pucServerID;
+    u16_t pusAddr[2], pusNetmask[2], pusRouter[2];
+    unsigned long ulLeaseS;
+    u8_t ucType;
+
+    pucMsg = (const u8_t *)uip_appdata;
+    pucEnd = pucMsg + uip_datalen();
+    if((uip_datalen() < DHCP_OPTIONS) || (pucMsg[0] != 2) ||
+       (((pucMsg[4] << 24) | (pucMsg[5] << 16) | (pucMsg[6] << 8) |
+         pucMsg[7]) != g_ulDhcpXid) ||
+       memcmp(&pucMsg[28], &uip_ethaddr, sizeof(uip_ethaddr)))
+    {
+        return;
+    }
+
+    ucType = 0;
+    pucNetmask = (const u8_t *)g_sDhcpLease.sNetmask;
+    pucRouter = (const u8_t *)g_sDhcpLease.sRouter;
+    pucServerID = g_sDhcpLease.pucServerID;
+    ulLeaseS = g_sDhcpLease.ulLeftS;
+    pucOpt = &pucMsg[DHCP_OPTIONS];
+    while((pucOpt < pucEnd) && (pucOpt[0] != 255))
+    {
+        if(pucOpt[0] == 0)
+        {
+            pucOpt++;
+            continue;
+        }
+        if(((pucOpt + 2) > pucEnd) || ((pucOpt + 2 + pucOpt[1]) > pucEnd))
+        {
+            break;
+        }
+        switch(pucOpt[0])
+        {
+        case 53:
+            if(pucOpt[1] >= 1)
+            {
+                ucType = pucOpt[2];
+            }
+            break;
+
+        // The address options are copied 4 bytes at a time below, so only
+        // take those that are at least that long.
+        case 1:
+            if(pucOpt[1] >= 4)
+            {
+                pucNetmask = &pucOpt[2];
+            }
+            break;
+
+        case 3:
+            if(pucOpt[1] >= 4)
+            {
+                pucRouter = &pucOpt[2];
+            }
+            break;
+
+        case 51:
+            if(pucOpt[1] == 4)
+            {
+                ulLeaseS = (((unsigned long)pucOpt[2] << 24) |
+                            ((unsigned long)pucOpt[3] << 16) |
+                            ((unsigned long)pucOpt[4] << 8) |
+                            (unsigned long)pucOpt[5]);
+            }
+            break;
+
+        case 54:
+            if(pucOpt[1] >= 4)
+            {
+                pucServerID = &pucOpt[2];
+            }
+            break;
+        }
+        pucOpt += 2 + pucOpt[1];
+    }
+
+    if(ucType == DHCP_ACK)
+    {
+        g_ulDhcpRebootAck++;
+        EthernetDhcpRebootStop();
+        memcpy(pusAddr, &pucMsg[16], 4);
+        memcpy(pusNetmask, pucNetmask, 4);
+        memcpy(pusRouter, pucRouter, 4);
+        EthernetIPConfigure(pusAddr, pusNetmask, pusRouter);
+        EthernetDhcpLeaseStore(pusAddr, pusNetmask, pusRouter, pucServerID,
+                               ulLeaseS);
+        EthernetDhcpBound();
+    }
+    else if(ucType == DHCP_NAK)
+    {
+        // The address is no good on this network.  Drop it and the cached
+        // lease, and start from scratch.
+        g_ulDhcpRebootNak++;
+        EthernetDhcpRebootStop();
+        g_sDhcpLease.ulMagic = 0;
+        EthernetDhcpClientStart();
+    }
+}
+#endif
+
+//*****************************************************************************
+// The uIP UDP application: the command channel, telemetry, and the DHCP
+// client on the other connections.
+//*****************************************************************************
+void
+EthernetUdpAppcall(void)
+{
+#ifndef USE_STATIC_IP
+    // While the cached lease is being confirmed, the answer is ours on
+    // whichever connection it arrives.
+    if((g_ulDhcpState == DHCP_REBOOTING) &&
+       (uip_udp_conn->lport == HTONS(DHCP_CLIENT_PORT)) && uip_newdata())
+    {
+        EthernetDhcpInput();
+        return;
+    }
+
+    if(uip_udp_conn == g_psDhcpConn)
+    {
+        if(uip_poll() && g_bDhcpSend)
+        {
+            g_bDhcpSend = false;
+            EthernetDhcpSend();
+        }
+        return;
+    }
+#endif
+
+    if(uip_udp_conn == g_psUdpCmdConn)
+    {
+        if(uip_newdata())
+        {
+            EthernetUdpCmdInput();
         }
+        return;
     }
 
-    // Check to see if the Ethernet TX uDMA channel was pending.
-    if(HWREGBITW(&g_ulFlags, FLAG_TXPKT) == 1)
+    if(uip_udp_conn == g_psTelemConn)
     {
-        // Verify the channel transfer is done
-        if(uDMAChannelModeGet(UDMA_CHANNEL_ETH0TX) == UDMA_MODE_STOP)
+        if(uip_newdata())
         {
-            // Trigger the transmission of the data.
-            HWREG(ETH_BASE + MAC_O_TR) = MAC_TR_NEWTX;
+            EthernetTelemetrySubscribe();
+        }
+        return;
+    }
 
-            // Indicate that a packet has been sent.
-            HWREGBITW(&g_ulFlags, FLAG_TXPKT) = 0;
+    if(uip_udp_conn == g_psTelemTxConn)
+    {
+        if(uip_poll())
+        {
+            EthernetTelemetrySend();
         }
+        return;
     }
+
+    dhcpc_appcall();
 }
 
 //*****************************************************************************
-// Callback for when DHCP client has been configured.
+// Hand the IP packet in uip_buf to uIP, carry out any command it brought and
+// queue the reply, if there is one.  Returns true if a reply was queued in
+// the block.
 //*****************************************************************************
-void
-dhcpc_configured(const struct dhcpc_state *s)
+static tBoolean
+EthernetIPInput(void)
 {
-    uip_sethostaddr(&s->ipaddr);
-    uip_setnetmask(&s->netmask);
-    uip_setdraddr(&s->default_router);
-    ShowIPAddress(s->ipaddr);
+    tBoolean bQueued;
+
+    g_pucTxPayload = 0;
+
+    uip_arp_ipin();
+    EthernetTcpAckCheck();
+    uip_input(); //uip_process (calls uip_appcall())
+
+    // If the above function invocation resulted in data that should be sent
+    // out on the network, the global variable uip_len is set to a value > 0.
+    bQueued = false;
+    if(uip_len > 0)
+    {
+        bQueued = EthernetPacketOut();
+        uip_len = 0;
+    }
+
+    return(bQueued);
 }
 
 //*****************************************************************************
-// Read a packet using DMA instead of directly reading the FIFO if the
-// alignment will allow it.
+// Poll a UDP connection and send the datagram the application builds, if
+// it builds one.  With bAnonymous the datagram goes out from 0.0.0.0.
 //*****************************************************************************
-long
-EthernetPacketGetDMA(unsigned long ulBase, unsigned char *pucBuf, long lBufLen)
+static void
+EthernetUdpPoll(struct uip_udp_conn *psConn, tBoolean bAnonymous)
 {
-    unsigned long ulTemp;
-    unsigned char pucData[4];
-    unsigned char *pucBuffer;
-    long lTempLen, lFrameLen;
-    long lRemainder;
-    int iIdx;
-
-    // Check the arguments.
-    ASSERT(ulBase == ETH_BASE);
-    ASSERT(pucBuf != 0);
-    ASSERT(lBufLen > 0);
+    uip_udpip_hdr *psHdr;
+    tBoolean bQueued;
 
-    // If the buffer is not aligned on an odd half-word then it cannot use DMA.
-    // This is because the two packet length bytes are written in front of the
-    // packet, and the packet data must have two bytes that can be pulled off
-    // to become a word and leave the remainder of the buffer word aligned.
-    if(((unsigned long)pucBuf & 3) != 2)
+    if(!TX_QUEUE_SPACE())
     {
-        // If there is not proper alignment the packet must be sent without
-        // using DMA.
-        return(EthernetPacketGetNonBlocking(ulBase, pucBuf, lBufLen));
+        return;
     }
+    uip_buf = EthernetPktAlloc();
+    if(!uip_buf)
+    {
+        g_ulPktEmpty++;
+        return;
+    }
+    g_pucTxPayload = 0;
 
-    // Read WORD 0 from the FIFO, set the receive Frame Length and store the
-    // first two bytes of the destination address in the receive buffer.
-    ulTemp = HWREG(ulBase + MAC_O_DATA);
-    lFrameLen = (long)(ulTemp & 0xffff);
-    pucBuf[0] = (unsigned char)((ulTemp >> 16) & 0xff);
-    pucBuf[1] = (unsigned char)((ulTemp >> 24) & 0xff);
-
-    // The maximum DMA size is the frame size - the two bytes already read and
-    // truncated to the nearest word size.
-    lTempLen = (lFrameLen - 2) & 0xfffffffc;
-    lRemainder = (lFrameLen - 2) & 3;
+    uip_udp_periodic_conn(psConn);
 
-    // Don't allow writing beyond the end of the buffer.
-    if(lBufLen < lTempLen)
+    bQueued = false;
+    if(uip_len > 0)
     {
-        lRemainder = lTempLen - lBufLen;
-        lTempLen =  lBufLen;
+        if(bAnonymous)
+        {
+            psHdr = (uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN];
+            psHdr->srcipaddr[0] = 0;
+            psHdr->srcipaddr[1] = 0;
+            psHdr->ipchksum = 0;
+            psHdr->ipchksum = ~(uip_ipchksum());
+        }
+        bQueued = EthernetPacketOut();
+        uip_len = 0;
     }
-    else if(lBufLen >= (lFrameLen - 2 + 3))
+    if(!bQueued)
     {
-        // If there is room, just DMA the last word as well so that the
-        // special copy after DMA is not required.
-        lRemainder = 0;
-        lTempLen = lFrameLen - 2 + 3;
+        EthernetPktFree(uip_buf);
     }
+}
+
+//*****************************************************************************
+// Move the telemetry stream along: stage the new samples and send a datagram
+// once there are enough of them.  Called from the main loop only.
+//*****************************************************************************
+static void
+EthernetTelemetryService(void)
+{
 
-    // Mark the receive as pending.
-    HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) = 1;
+    if(!g_bTelemSubscribed)
+    {
+        return;
+    }
+    if(((g_ulTickCounter - g_ulTelemTick) * SYSTICKMS) >= TELEM_LEASE_MS)
+    {
+        g_bTelemSubscribed = false;
+        return;
+    }
 
-    // Set up the DMA to transfer the Ethernet header when a
-    // packet is received
-    uDMAChannelTransferSet(UDMA_CHANNEL_ETH0RX, UDMA_MODE_AUTO,
-                           (void *)(ETH_BASE + MAC_O_DATA),
-                           &pucBuf[2], lTempLen>>2);
-    uDMAChannelEnable(UDMA_CHANNEL_ETH0RX);
+    EthernetTelemetryCollect();
+    if(g_ulTelemFill == TELEM_SAMPLES)
+    {
+        EthernetUdpPoll(g_psTelemTxConn, false);
+    }
+}
 
-    // Issue a software request to start the channel running.
-    uDMAChannelRequest(UDMA_CHANNEL_ETH0RX);
+//*****************************************************************************
+// Push a state frame to every WebSocket client each WS_STATE_MS.  uIP only
+// asks a connection for data when it has none in flight, so a client that
+// is slow to acknowledge gets fewer frames.  Called from the main loop only.
+//*****************************************************************************
+static void
+EthernetWsService(void)
+{
+    struct uip_conn *psConn;
+    tBoolean bQueued;
 
-    // Wait for the previous transmission to be complete.
-    while(HWREGBITW(&g_ulFlags, FLAG_RXPKTPEND) == 1)
+    if((TimebaseGetMs() - g_ulWsStateMs) < WS_STATE_MS)
     {
+        return;
     }
+    g_ulWsStateMs = TimebaseGetMs();
 
-    // See if there are extra bytes to read into the buffer.
-    if(lRemainder)
+    for(psConn = &uip_conns[0]; psConn < &uip_conns[UIP_CONNS]; psConn++)
     {
-        // If the remainder is more than 3 bytes then the buffer was never big
-        // enough and data must be tossed.
-        if(lRemainder > 3)
+        if(((psConn->tcpstateflags & UIP_TS_MASK) != UIP_ESTABLISHED) ||
+           (psConn->lport != HTONS(80)) || !httpd_websocket(psConn))
         {
-            // Read any remaining WORDS (that did not fit into the buffer).
-            while(lRemainder > 0)
-            {
-                ulTemp = HWREG(ulBase + MAC_O_DATA);
-                lRemainder -= 4;
-            }
+            continue;
+        }
+        if(!TX_QUEUE_SPACE())
+        {
+            return;
         }
 
-        // Read the last word from the FIFO.
-        *((unsigned long *)&pucData[0]) = HWREG(ulBase + MAC_O_DATA);
+        uip_buf = EthernetPktAlloc();
+        if(!uip_buf)
+        {
+            g_ulPktEmpty++;
+            return;
+        }
+        g_pucTxPayload = 0;
 
-        // The current buffer position is lTempLen plus the two bytes read
-        // from the first word.
-        pucBuffer = &pucBuf[lTempLen + 2];
+        uip_poll_conn(psConn);
 
-        // Read off each individual byte and save it.
-        for(iIdx = 0; iIdx < lRemainder; iIdx++)
+        bQueued = false;
+        if(uip_len > 0)
         {
-            pucBuffer[iIdx] = pucData[iIdx];
+            bQueued = EthernetPacketOut();
+            uip_len = 0;
+        }
+        if(!bQueued)
+        {
+            EthernetPktFree(uip_buf);
         }
     }
-
-    // If frame was larger than the buffer, return the "negative" frame length.
-    lFrameLen -= 6;
-    if(lFrameLen > lBufLen)
-    {
-        return(-lFrameLen);
-    }
-
-    // Return the Frame Length
-    return(lFrameLen);
 }
 
+#ifndef USE_STATIC_IP
 //*****************************************************************************
-// Transmit a packet using DMA instead of directly writing the FIFO if the
-// alignment will allow it.
+// Move DHCP along: send the INIT-REBOOT request when it is due, and give up
+// on it after the last try, or poll the uIP client.  Called from the main
+// loop only.
 //*****************************************************************************
-static long
-EthernetPacketPutDMA(unsigned long ulBase, unsigned char *pucBuf,long lBufLen)
+static void
+EthernetDhcpService(void)
 {
-    unsigned long ulTemp;
+    unsigned long ulIdx;
 
-    // If the buffer is not aligned on an odd half-word then it cannot use DMA.
-    // This is because the two packet length bytes are written in front of the
-    // packet, and the packet data must have two bytes that can be pulled off
-    // to become a word and leave the remainder of the buffer word aligned.
-    if(((unsigned long)pucBuf & 3) != 2)
+    if((g_ulDhcpState != DHCP_REBOOTING) && (g_ulDhcpState != DHCP_CLIENT))
     {
-        // If there is not proper alignment the packet must be sent without
-        // using DMA.
-        return(EthernetPacketPut(ulBase, pucBuf, lBufLen));
+        return;
+    }
+    if((long)(g_ulTickCounter - g_ulDhcpTick) < 0)
+    {
+        return;
     }
 
-    // Indicate that a packet is being sent.
-    HWREGBITW(&g_ulFlags, FLAG_TXPKT) = 1;
-
-    // Build and write WORD 0 (see format above) to the transmit FIFO.
-    ulTemp = (unsigned long)(lBufLen - 14);
-    ulTemp |= (*pucBuf++) << 16;
-    ulTemp |= (*pucBuf++) << 24;
-    HWREG(ulBase + MAC_O_DATA) = ulTemp;
-
-    // Force an extra word to be transferred if the end of the buffer is not
-    // aligned on a word boundary.  The math is actually lBufLen - 2 + 3 to
-    // insure that the proper number of bytes are written.
-    lBufLen += 1;
-
-    // Configure the TX DMA channel to transfer the packet buffer.
-    uDMAChannelTransferSet(UDMA_CHANNEL_ETH0TX, UDMA_MODE_AUTO,
-                           pucBuf, (void *)(ETH_BASE + MAC_O_DATA),
-                           lBufLen>>2);
-
-    // Enable the Ethernet Transmit DMA channel.
-    uDMAChannelEnable(UDMA_CHANNEL_ETH0TX);
+    if(g_ulDhcpState == DHCP_REBOOTING)
+    {
+        if(g_ulDhcpTries == DHCP_REBOOT_TRIES)
+        {
+            g_ulDhcpRebootTimeout++;
+            EthernetDhcpRebootStop();
+            EthernetDhcpClientStart();
+            return;
+        }
 
-    // Issue a software request to start the channel running.
-    uDMAChannelRequest(UDMA_CHANNEL_ETH0TX);
+        // The request goes out from 0.0.0.0, as the address is not ours
+        // until the server says so.
+        g_bDhcpSend = true;
+        EthernetUdpPoll(g_psDhcpConn, true);
+        if(g_bDhcpSend)
+        {
+            g_bDhcpSend = false;
+            return;
+        }
+        g_ulDhcpTick = g_ulTickCounter +
+                       ((DHCP_REBOOT_MS << g_ulDhcpTries) / SYSTICKMS);
+        g_ulDhcpTries++;
+        return;
+    }
 
-    // Wait for the previous transmission to be complete.
-    while((HWREGBITW(&g_ulFlags, FLAG_TXPKT) == 1) &&
-          EthernetSpaceAvail(ETH_BASE))
+    if((TimebaseStamp() - g_ulDhcpStartUs) >= (DHCP_FAST_MS * 1000))
     {
+        g_ulDhcpState = DHCP_IDLE;
+        return;
+    }
+    g_ulDhcpTick = g_ulTickCounter + (DHCP_POLL_MS / SYSTICKMS);
+    for(ulIdx = 0; ulIdx < UIP_UDP_CONNS; ulIdx++)
+    {
+        if(uip_udp_conns[ulIdx].lport == HTONS(DHCP_CLIENT_PORT))
+        {
+            EthernetUdpPoll(&uip_udp_conns[ulIdx], false);
+        }
     }
-
-    // Take back off the byte that we added above.
-    return(lBufLen - 1);
-
 }
+#endif
 
 //*****************************************************************************
-// respond to commands sent by the user (client)
-//
+// Serve the SYN backlog: hand the oldest SYN to uIP once it has a connection
+// for it, or reset it once it has waited too long.  Called from the main
+// loop only.
 //*****************************************************************************
-void EthernetProcessCMD(int command)
+static void
+EthernetSynBacklogService(void)
 {
-	//snprintf(buffer,sizeof(buffer),"%f", m3_r_w_array[1]);
-    switch(command)
-    {
-    case velocity:
-        Shared_Ram_dataWrite_m3(velocity, velocity_cmd);
-        break;
-
-    case omega:
-        Shared_Ram_dataWrite_m3(omega, omega_cmd);
-        break;
-
-    case left:
-        Shared_Ram_dataWrite_m3(left, left_cmd);
-        break;
-
-    case right:
-        Shared_Ram_dataWrite_m3(right, right_cmd);
-        break;
-
-    case grip:
-        Shared_Ram_dataWrite_m3(grip, grip_cmd);
-        break;
-
-    case magnitude:
-        Shared_Ram_dataWrite_m3(magnitude, magnitude_cmd);
-        break;
-
-    case degree:
-        Shared_Ram_dataWrite_m3(degree, degree_cmd);
-        break;
-
-    case inverse_x:
-        Shared_Ram_dataWrite_m3(inverse_x, inverse_x_cmd);
-        break;
+    tBoolean bQueued;
 
-    case inverse_y:
-        Shared_Ram_dataWrite_m3(inverse_y, inverse_y_cmd);
-        break;
+    while(g_ulSynBacklogLen && TX_QUEUE_SPACE())
+    {
+        uip_buf = g_psSynBacklog[0].pucBuf;
+        uip_len = g_psSynBacklog[0].usLen;
 
-    case inverse_the:
-        Shared_Ram_dataWrite_m3(inverse_the, inverse_the_cmd);
-        break;
+        if(EthernetConnAvail())
+        {
+            g_ulSynServed++;
+            bQueued = EthernetIPInput();
+        }
+        else if(((g_ulTickCounter - g_psSynBacklog[0].ulTick) * SYSTICKMS) >=
+                SYN_BACKLOG_MS)
+        {
+            EthernetTcpReset();
+            bQueued = EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len, 0, 0);
+            uip_len = 0;
+        }
+        else
+        {
+            return;
+        }
 
-    default:
-        break;
+        if(!bQueued)
+        {
+            EthernetPktFree(uip_buf);
+        }
+        g_ulSynBacklogLen--;
+        memmove(&g_psSynBacklog[0], &g_psSynBacklog[1],
+                g_ulSynBacklogLen * sizeof(tSynBacklog));
     }
 }
 
-
 //*****************************************************************************
 // This example demonstrates the use of the Ethernet Controller with the uIP
 // TCP/IP stack.
@@ -601,10 +3844,12 @@ main(void)
 {
     uip_ipaddr_t ipaddr;
     static struct uip_eth_addr sTempAddr;
-    long lPeriodicTimer, lARPTimer;
+    long lPeriodicTimer, lARPTimer, lLoadTimer, lRateTimer, lLinkTimer;
+    unsigned long ulTimeMs, ulElapsedMs;
+    unsigned long ulLoadFrames, pulRateBase[5];
     unsigned long ulUser0, ulUser1;
-    unsigned long ulTemp;
-    int command_word;
+    unsigned long ulTemp, ulPeriodicConn, ulBudget, ulCount;
+    tBoolean bQueued;
 
     // Disable Protection
     HWREG(SYSCTL_MWRALLOW) =  0xA5A5A5A5;
@@ -638,6 +3883,11 @@ main(void)
     FlashInit();
 #endif
 
+    // Configure SysTick for a periodic interrupt.  It is started first so
+    // that the boot times cover the rest of the initialization.
+    TimebaseInit();
+    IntMasterEnable();
+
     PinoutSet();
 
     // Enable clock supply for the following peripherals
@@ -670,9 +3920,9 @@ main(void)
         // Delay
         for (i=0;i<20;i++){};
 
-    // Adjust the pointer to be aligned on an odd half word address so that
-    // DMA can be used.
-    uip_buf = (u8_t *)(((unsigned long)ucUIPBuffer + 3) & 0xfffffffe);
+    // Set up the packet pool.  uIP is pointed at a block from it whenever it
+    // is given a packet to process or a chance to send one.
+    EthernetPktInit();
 
     // Enable the uDMA controller and set up the control table base.
     SysCtlPeripheralEnable(SYSCTL_PERIPH_UDMA);
@@ -708,12 +3958,6 @@ main(void)
     SysCtlPeripheralEnable(SYSCTL_PERIPH_ETH);
     SysCtlPeripheralReset(SYSCTL_PERIPH_ETH);
 
-    // Configure SysTick for a periodic interrupt.
-    SysTickPeriodSet(SysCtlClockGet(SYSTEM_CLOCK_SPEED) / SYSTICKHZ);
-    SysTickEnable();
-    IntRegister(FAULT_SYSTICK, SysTickIntHandler);
-    SysTickIntEnable();
-
     // Configure the DMA channel for Ethernet receive.
     uDMAChannelAttributeDisable(UDMA_CHANNEL_ETH0RX, UDMA_ATTR_ALL);
     uDMAChannelControlSet(UDMA_CHANNEL_ETH0RX,
@@ -738,10 +3982,9 @@ main(void)
     EthernetConfigSet(ETH_BASE, (ETH_CFG_TX_DPLXEN | ETH_CFG_TX_CRCEN |
                                  ETH_CFG_TX_PADEN));
 
-    // Wait for the link to become active.
-    while((EthernetPHYRead(ETH_BASE, PHY_MR1) & 0x0004) == 0)
-    {
-    }
+    // Have the PHY interrupt on link state changes.  The link itself is not
+    // waited for; the main loop starts the network once it comes up.
+    EthernetPHYWrite(ETH_BASE, ETH_PHY_INT_REG, ETH_PHY_INT_ENABLE);
 
     // Enable the Ethernet Controller.
     EthernetEnable(ETH_BASE);
@@ -753,11 +3996,10 @@ main(void)
     IntRegister(INT_UDMA, EthernetIntHandler);
     IntEnable(INT_UDMA);
 #endif
-    // Enable the Ethernet RX Packet interrupt source.
-    EthernetIntEnable(ETH_BASE, ETH_INT_RX);
-
-    // Enable all processor interrupts.
-    IntMasterEnable();
+    // Enable the Ethernet RX Packet interrupt source, the PHY interrupt for
+    // link changes, and the error sources for the statistics.
+    EthernetIntEnable(ETH_BASE, (ETH_INT_RX | ETH_INT_PHY | ETH_INT_RXOF |
+                                 ETH_INT_RXER | ETH_INT_TXER));
 
     // Initialize the uIP TCP/IP stack.
     uip_init();
@@ -792,74 +4034,170 @@ main(void)
 
     // Initialize the TCP/IP Application (e.g. web server).
     httpd_init();
+    EthernetUdpCmdInit();
+    EthernetArpStaticLoad();
 
 #ifndef USE_STATIC_IP
 
-    // Initialize the DHCP Client Application.
-    dhcpc_init(&sTempAddr.addr[0], 6);
-    dhcpc_request();
+    // Get an address, from the cached lease if there is one, or through the
+    // DHCP Client Application.
+    EthernetDhcpStart();
 #endif
 
     // Main Application Loop.
     lPeriodicTimer = 0;
     lARPTimer = 0;
+    lLoadTimer = 0;
+    lRateTimer = 0;
+    lLinkTimer = 0;
+    ulTimeMs = TimebaseGetMs();
+    ulLoadFrames = g_ulRxFrames;
+    memset(pulRateBase, 0, sizeof(pulRateBase));
+    ulPeriodicConn = NUM_PERIODIC_CONNS;
     httpd_clear_command();
+
+    // Control is up.  Pick up the link state as it is now; from here on it
+    // is tracked through the PHY interrupt.
+    g_ulBootControlMs = TimebaseGetMs();
+    EthernetLinkCheck();
+
     while(true)
     {
 
-        // Wait for an event to occur.  This can be either a System Tick event,
-        // or an RX Packet event.
-        while(!g_ulFlags)
+        // Wait for an event to occur.  This can be a System Tick event, an RX
+        // Packet event or a TX Packet completing.  In polling mode the
+        // Ethernet controller is serviced while waiting, otherwise the core
+        // sleeps until an interrupt.
+        do
         {
+            if(g_ulEthMode == ETH_MODE_POLL)
+            {
+                EthernetIntHandler();
+            }
+            else
+            {
+                CpuIdle();
+            }
         }
+        while(!g_ulFlags);
 
-        // If SysTick, Clear the SysTick interrupt flag and increment the
-        // timers.
+        // If SysTick, Clear the SysTick interrupt flag and advance the
+        // timers by the time that has passed, which is more than SYSTICKMS
+        // if the last pass through the loop took longer than a tick.
         if(HWREGBITW(&g_ulFlags, FLAG_SYSTICK) == 1)
         {
             HWREGBITW(&g_ulFlags, FLAG_SYSTICK) = 0;
-            lPeriodicTimer += SYSTICKMS;
-            lARPTimer += SYSTICKMS;
+            ulElapsedMs = TimebaseGetMs() - ulTimeMs;
+            ulTimeMs += ulElapsedMs;
+            lPeriodicTimer += ulElapsedMs;
+            lARPTimer += ulElapsedMs;
+            lLoadTimer += ulElapsedMs;
+            lRateTimer += ulElapsedMs;
+            lLinkTimer += ulElapsedMs;
+        }
+
+        // Follow the link state on a PHY interrupt, and every so often in
+        // case the PHY interrupt is not wired.
+        if((HWREGBITW(&g_ulFlags, FLAG_PHYINT) == 1) ||
+           (lLinkTimer >= ETH_LINK_POLL_MS))
+        {
+            HWREGBITW(&g_ulFlags, FLAG_PHYINT) = 0;
+            lLinkTimer = 0;
+            EthernetLinkCheck();
         }
 
-        // Check for an RX Packet and read it.
-        if(HWREGBITW(&g_ulFlags, FLAG_RXPKT))
+        // Update the per second rates and the CPU load for the statistics.
+        if(lRateTimer >= 1000)
         {
-            // Get the packet and set uip_len for uIP stack usage.
-            uip_len = (unsigned short)EthernetPacketGetDMA(ETH_BASE, uip_buf,
-                                                           sizeof(ucUIPBuffer));
+            // ulTemp is the number of cycles in 1% of the last second.
+            ulTemp = SysCtlClockGet(SYSTEM_CLOCK_SPEED) / 100000;
+            ulTemp *= lRateTimer;
+            g_ulIdleCyclesPerSec = g_ulIdleCycles;
+            g_ulIdleCycles = 0;
+            ulTemp = g_ulIdleCyclesPerSec / ulTemp;
+            g_ulCpuLoad = (ulTemp < 100) ? (100 - ulTemp) : 0;
+            lRateTimer = 0;
+            g_ulRxFramesPerSec = g_ulRxFrames - pulRateBase[0];
+            g_ulRxBytesPerSec = g_ulRxBytes - pulRateBase[1];
+            g_ulTxFramesPerSec = g_ulTxFrames - pulRateBase[2];
+            g_ulTxBytesPerSec = g_ulTxBytes - pulRateBase[3];
+            pulRateBase[0] = g_ulRxFrames;
+            pulRateBase[1] = g_ulRxBytes;
+            pulRateBase[2] = g_ulTxFrames;
+            pulRateBase[3] = g_ulTxBytes;
+            g_ulConnAcceptPerSec = httpd_conn_accepted - pulRateBase[4];
+            pulRateBase[4] = httpd_conn_accepted;
+        }
+
+        // Check the receive load at the end of every window and switch to
+        // polling when it is high, back to interrupts when it has dropped.
+        if(lLoadTimer >= ETH_LOAD_WINDOW_MS)
+        {
+            ulTemp = g_ulRxFrames - ulLoadFrames;
+            ulLoadFrames += ulTemp;
+            ulTemp = (ulTemp * 1000) / lLoadTimer;
+            lLoadTimer = 0;
 
-            // Clear the RX Packet event and re-enable RX Packet interrupts.
-            if(HWREGBITW(&g_ulFlags, FLAG_RXPKT) == 1)
+            if(ulTemp >= ETH_POLL_ENTER_FPS)
             {
-                HWREGBITW(&g_ulFlags, FLAG_RXPKT) = 0;
-                EthernetIntEnable(ETH_BASE, ETH_INT_RX);
+                EthernetModeSet(ETH_MODE_POLL);
             }
-
-            // Process incoming IP packets here.
-            if(BUF->type == htons(UIP_ETHTYPE_IP))
+            else if(ulTemp <= ETH_POLL_EXIT_FPS)
             {
+                EthernetModeSet(ETH_MODE_INT);
+            }
+        }
 
-                uip_arp_ipin();
-                uip_input(); //uip_process (calls uip_appcall())
-
-                if(httpd_get_command(&command_word))
-                {
-                    httpd_clear_command();
-                    printf("%d",command_word);
-                    x = command_word;
-                    EthernetProcessCMD(command_word);
-
-                }
+        // Hand every frame the interrupt has placed in the receive ring to
+        // uIP.  The frame is processed in place and any reply is built in the
+        // same buffer, so a frame is only taken on when the transmit queue has
+        // room for the reply.  Otherwise it waits in the ring until a queued
+        // packet has gone out.
+        HWREGBITW(&g_ulFlags, FLAG_RXPKT) = 0;
+        HWREGBITW(&g_ulFlags, FLAG_TXDONE) = 0;
+        if(g_pucRxState[g_ulRxTail] == PKT_READY)
+        {
+            HWREGBITW(&g_ulFlags, FLAG_RXPOLL) = 1;
+        }
+        ulBudget = g_ulRxBudget ? g_ulRxBudget : 1;
+        for(ulCount = 0;
+            (ulCount < ulBudget) && (g_pucRxState[g_ulRxTail] == PKT_READY) &&
+            TX_QUEUE_SPACE();
+            ulCount++)
+        {
+            uip_buf = g_ppucRxBuf[g_ulRxTail];
+            uip_len = g_pusRxLength[g_ulRxTail];
+            bQueued = false;
 
-                // If the above function invocation resulted in data that
-                // should be sent out on the network, the global variable
-                // uip_len is set to a value > 0.
-                if(uip_len > 0)
+            // Process incoming IP packets here.  A SYN uIP has no connection
+            // for is held back or reset instead.
+            if(BUF->type == htons(UIP_ETHTYPE_IP))
+            {
+                switch(EthernetSynCheck())
                 {
-                    uip_arp_out();
-                    EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len);
+                case SYN_PASS:
+                    bQueued = EthernetIPInput();
+                    break;
+
+                case SYN_HOLD:
+                    g_psSynBacklog[g_ulSynBacklogLen].pucBuf = uip_buf;
+                    g_psSynBacklog[g_ulSynBacklogLen].usLen = uip_len;
+                    g_psSynBacklog[g_ulSynBacklogLen].ulTick =
+                        g_ulTickCounter;
+                    g_ulSynBacklogLen++;
+                    g_ulSynBacklogged++;
+                    bQueued = true;
+                    break;
+
+                case SYN_RESET:
+                    EthernetTcpReset();
+                    bQueued = EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len,
+                                                   0, 0);
                     uip_len = 0;
+                    break;
+
+                default:
+                    break;
                 }
             }
 
@@ -867,103 +4205,209 @@ main(void)
             else if(BUF->type == htons(UIP_ETHTYPE_ARP))
             {
                 uip_arp_arpin();
+                g_bArpIn = true;
 
                 // If the above function invocation resulted in data that
                 // should be sent out on the network, the global variable
                 // uip_len is set to a value > 0.
                 if(uip_len > 0)
                 {
-                    EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len);
+                    bQueued = EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len,
+                                                   0, 0);
                     uip_len = 0;
                 }
             }
+
+            // Unless a reply went out in it or it was held in the SYN
+            // backlog, give the block back to the pool, and the slot back to
+            // the interrupt.
+            if(!bQueued)
+            {
+                EthernetPktFree(uip_buf);
+            }
+            g_ppucRxBuf[g_ulRxTail] = 0;
+            g_pucRxState[g_ulRxTail] = PKT_FREE;
+            g_ulRxTail = (g_ulRxTail + 1) % NUM_RX_BUFFERS;
+        }
+        if((ulCount < ulBudget) && (g_pucRxState[g_ulRxTail] == PKT_READY))
+        {
+            g_ulTxQueueFull++;
+        }
+
+        // At the end of a polling pass, stay in polling mode and come back
+        // without waiting if there is more in the ring, and have the
+        // interrupt pull whatever has arrived in the FIFO into the buffers
+        // just freed.  Otherwise fall back to interrupt mode and have the
+        // interrupt re-arm the RX interrupt.
+        if(HWREGBITW(&g_ulFlags, FLAG_RXPOLL) == 1)
+        {
+            if(g_pucRxState[g_ulRxTail] == PKT_READY)
+            {
+                HWREGBITW(&g_ulFlags, FLAG_RXPKT) = 1;
+                if(ulCount)
+                {
+                    IntPendSet(INT_ETH);
+                }
+            }
+            else
+            {
+                HWREGBITW(&g_ulFlags, FLAG_RXPOLL) = 0;
+                IntPendSet(INT_ETH);
+            }
         }
 
-        // Process TCP/IP Periodic Timer here.
+        // Process TCP/IP Periodic Timer here.  Each connection is serviced
+        // with a block from the pool and a queue entry; if those run out part
+        // way through, the remaining connections are picked up once a
+        // transmission completes.  The timers are held while the link is
+        // down.
+        if(!g_bLinkUp)
+        {
+            ulPeriodicConn = NUM_PERIODIC_CONNS;
+            lPeriodicTimer = 0;
+            lARPTimer = 0;
+        }
         if(lPeriodicTimer > UIP_PERIODIC_TIMER_MS)
         {
             lPeriodicTimer = 0;
-            for(ulTemp = 0; ulTemp < UIP_CONNS; ulTemp++)
+            ulPeriodicConn = 0;
+            EthernetConnReclaim();
+        }
+        while((ulPeriodicConn < NUM_PERIODIC_CONNS) && TX_QUEUE_SPACE())
+        {
+            uip_buf = EthernetPktAlloc();
+            if(!uip_buf)
             {
-                uip_periodic(ulTemp);
-
-                // If the above function invocation resulted in data that
-                // should be sent out on the network, the global variable
-                // uip_len is set to a value > 0.
-                if(uip_len > 0)
-                {
-                    uip_arp_out();
-                    EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len);
-                    uip_len = 0;
-                }
+                g_ulPktEmpty++;
+                break;
             }
+            g_pucTxPayload = 0;
 
+            if(ulPeriodicConn < UIP_CONNS)
+            {
+                uip_periodic(ulPeriodicConn);
+            }
 #if UIP_UDP
-            for(ulTemp = 0; ulTemp < UIP_UDP_CONNS; ulTemp++)
+            else
             {
-                uip_udp_periodic(ulTemp);
+                uip_udp_periodic(ulPeriodicConn - UIP_CONNS);
+            }
+#endif
+            ulPeriodicConn++;
 
-                // If the above function invocation resulted in data that
-                // should be sent out on the network, the global variable
-                // uip_len is set to a value > 0.
-                if(uip_len > 0)
-                {
-                    uip_arp_out();
-                    EthernetPacketPutDMA(ETH_BASE, uip_buf, uip_len);
-                    uip_len = 0;
-                }
+            // If the above function invocation resulted in data that
+            // should be sent out on the network, the global variable
+            // uip_len is set to a value > 0.
+            bQueued = false;
+            if(uip_len > 0)
+            {
+                bQueued = EthernetPacketOut();
+                uip_len = 0;
+            }
+            if(!bQueued)
+            {
+                EthernetPktFree(uip_buf);
             }
+        }
+
+        // Serve the SYN backlog now that connections may have been freed.
+        EthernetSynBacklogService();
+
+        // Send what was held for ARP once its next hop is known.
+        EthernetArpService();
+
+        // Send the telemetry the C28 has published since the last pass and
+        // the state to the WebSocket clients, and move DHCP along.
+        if(g_bLinkUp)
+        {
+            EthernetTelemetryService();
+            EthernetWsService();
+#ifndef USE_STATIC_IP
+            EthernetDhcpService();
 #endif
         }
 
+#ifndef USE_STATIC_IP
+        // The cached lease runs out whether or not there is a link.
+        EthernetDhcpLeaseAge();
+#endif
+
         // Process ARP Timer here.
         if(lARPTimer > UIP_ARP_TIMER_MS)
         {
             lARPTimer = 0;
             uip_arp_timer();
+            EthernetArpStaticLoad();
         }
     }
 }
 
-void Shared_Ram_dataWrite_m3(int motor,float value)
+//*****************************************************************************
+//
+// Open and close a change to the set points.  Every set point written in
+// between reaches the C28 together.  Calls nest, so a single write inside a
+// multi-command update does not end it early.
+//
+//*****************************************************************************
+void
+Shared_Ram_updateBegin_m3(void)
+{
+    if(g_ulSharedDepth++ == 0)
+    {
+        SHARED_SEQ_WORD = SHARED_SEQ_WORD + 1;
+    }
+}
+
+void
+Shared_Ram_updateEnd_m3(void)
+{
+    if(g_ulSharedDepth && (--g_ulSharedDepth == 0))
+    {
+        SHARED_SEQ_WORD = SHARED_SEQ_WORD + 1;
+    }
+}
+
+void Shared_Ram_dataWrite_m3(int motor,long value)
 {
+    Shared_Ram_updateBegin_m3();
     switch(motor)
     {
     case velocity:
-        m3_r_w_array[0] = value;
-        y = value;
+        SHARED_SETPOINT(0) = value;
+        y = value / 65536;
         break;
     case omega:
-        m3_r_w_array[1] = value;
+        SHARED_SETPOINT(1) = value;
         break;
     case left:
-        m3_r_w_array[2] = value;
+        SHARED_SETPOINT(2) = value;
         break;
     case right:
-        m3_r_w_array[3] = value;
+        SHARED_SETPOINT(3) = value;
         break;
     case grip:
-        m3_r_w_array[4] = value;
+        SHARED_SETPOINT(4) = value;
         break;
     case magnitude:
-        m3_r_w_array[5] = value;
+        SHARED_SETPOINT(5) = value;
         break;
     case degree:
-        m3_r_w_array[6] = value;
+        SHARED_SETPOINT(6) = value;
         break;
     case inverse_x:
-        m3_r_w_array[7] = value;
+        SHARED_SETPOINT(7) = value;
         break;
     case inverse_y:
-        m3_r_w_array[8] = value;
+        SHARED_SETPOINT(8) = value;
         break;
     case inverse_the:
-        m3_r_w_array[9] = value;
+        SHARED_SETPOINT(9) = value;
         break;
 
 
 
     }
+    Shared_Ram_updateEnd_m3();
 }
 
 void Shared_Ram_dataRead_m3(void)
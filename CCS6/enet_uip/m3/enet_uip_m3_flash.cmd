@@ -0,0 +1,115 @@
+//###########################################################################
+// FILE:   enet_uip_m3_flash.cmd
+// TITLE:  Linker command file for enet_uip, M3 running from flash
+//###########################################################################
+//
+// The memory map is that of F28M35x_generic_wshared_M3_FLASH.cmd.  The
+// placement differs, because the generic file puts all of .bss, .data and
+// the stack in C2, and this application needs more than that:
+//
+//     C0          .vtable, ramfuncs, .sysmem and the stack
+//     C1, C2      .bss, and in C1 the DHCPLEASE section, which holds the
+//                 cached DHCP lease and is not initialized at start up so
+//                 that the lease survives a reset
+//     C3          .data, which holds the short HTTP pages.  The Ethernet TX
+//                 uDMA reads them in place, and the M3 uDMA cannot reach
+//                 flash, C0 or C1.
+//     S3 and S4   DMARAM: the uDMA control table, the TX scatter-gather task
+//                 list, the packet pool and the home page.  S3 and S4 are
+//                 contiguous and stay with the M3, so they are taken as one
+//                 block for the pool, which is larger than either of them.
+//     S0 to S2    RAM shared with the C28, as in the generic file
+//
+// Estimated use with the default build (UIP_CONF_CONN_PROFILE 8,
+// NUM_PKT_BUFFERS 6, 2 KB stack):
+//
+//     C0          2.8 KB of 8 KB
+//     C1, C2      7.1 KB of 13.75 KB, 11.6 KB with the 32 connection
+//                 profile
+//     C3          1.1 KB of 8 KB
+//     S3 and S4   14.0 KB of 16 KB
+//
+//###########################################################################
+
+--retain=g_pfnVectors
+
+MEMORY
+{
+    CSM_ECSL_Z1      : origin = 0x00200000, length = 0x0024
+    CSM_RSVD_Z1      : origin = 0x00200024, length = 0x000C
+    RESETISR (RX)    : origin = 0x00200030, length = 0x0008
+    INTVECS (RX)     : origin = 0x00200200, length = 0x01B0
+    FLASH1 (RX)      : origin = 0x00200400, length = 0x1FC00
+    FLASH2 (RX)      : origin = 0x00260000, length = 0x1FF00
+    CSM_RSVD_Z2      : origin = 0x0027FF00, length = 0x00DC
+    CSM_ECSL_Z2      : origin = 0x0027FFDC, length = 0x0024
+
+    C0 (RWX)         : origin = 0x20000000, length = 0x2000
+    C1 (RWX)         : origin = 0x20002000, length = 0x2000
+    BOOT_RSVD (RX)   : origin = 0x20004000, length = 0x0900
+    C2 (RWX)         : origin = 0x20004900, length = 0x1700
+    C3 (RWX)         : origin = 0x20006000, length = 0x2000
+    S0 (RWX)         : origin = 0x20008000, length = 0x2000
+    S1 (RWX)         : origin = 0x2000A000, length = 0x2000
+    S2 (RWX)         : origin = 0x2000C000, length = 0x2000
+    S3_S4 (RWX)      : origin = 0x2000E000, length = 0x4000
+    S5 (RWX)         : origin = 0x20012000, length = 0x2000
+    S6 (RWX)         : origin = 0x20014000, length = 0x2000
+    S7 (RWX)         : origin = 0x20016000, length = 0x2000
+    CTOMRAM (RX)     : origin = 0x2007F000, length = 0x0800
+    MTOCRAM (RWX)    : origin = 0x2007F800, length = 0x0800
+}
+
+SECTIONS
+{
+    .intvecs    : > INTVECS
+    .resetisr   : > RESETISR
+    .text       : >> FLASH1 | FLASH2,
+                  crc_table(AppCrc, algorithm = CRC32_PRIME)
+    .const      : >> FLASH1 | FLASH2,
+                  crc_table(AppCrc, algorithm = CRC32_PRIME)
+    .cinit      : > FLASH1 | FLASH2,
+                  crc_table(AppCrc, algorithm = CRC32_PRIME)
+    .pinit      : >> FLASH1 | FLASH2
+    .init_array : >> FLASH1 | FLASH2
+    .TI.crctab  : > FLASH2
+
+    .vtable     : > C0
+    .sysmem     : > C0
+    .stack      : > C0
+    .bss        : >> C1 | C2
+    DHCPLEASE   : > C1, type = NOINIT
+    .data       : > C3
+    DMARAM      : > S3_S4
+
+    ramfuncs    : LOAD = FLASH1,
+                  RUN = C0,
+                  LOAD_START(RamfuncsLoadStart),
+                  LOAD_END(RamfuncsLoadEnd),
+                  LOAD_SIZE(RamfuncsLoadSize),
+                  RUN_START(RamfuncsRunStart),
+                  RUN_END(RamfuncsRunEnd),
+                  RUN_SIZE(RamfuncsRunSize),
+                  crc_table(AppCrc, algorithm = CRC32_PRIME)
+
+    SHARERAMS0  : > S0
+    SHARERAMS1  : > S1
+    SHARERAMS2  : > S2
+    SHARERAMS5  : > S5
+    SHARERAMS6  : > S6
+    SHARERAMS7  : > S7
+
+    GROUP : > MTOCRAM
+    {
+        PUTBUFFER
+        PUTWRITEIDX
+        GETREADIDX
+    }
+
+    GROUP : > CTOMRAM, type = DSECT
+    {
+        GETBUFFER
+        GETWRITEIDX
+        PUTREADIDX
+    }
+}
@@ -13,7 +13,9 @@
 
 #include "uip.h"
 #include "httpd.h"
-#include <stdlib.h>
+#include "httpd_q16.h"
+#include <ctype.h>
+#include <string.h>
 //*****************************************************************************
 // Macro for easy access to buffer data
 //*****************************************************************************
@@ -27,6 +29,119 @@
 #define HTTP_TEXT       2
 #define HTTP_FUNC       3
 #define HTTP_END        4
+#define HTTP_WEBSOCKET  5
+
+//*****************************************************************************
+// Connections are kept open between requests (HTTP/1.1 keep-alive).  One that
+// has been idle for HTTP_IDLE_POLLS polls by the uIP periodic timer is
+// aborted, or after HTTP_IDLE_POLLS_LOW while the connection table is running
+// short.
+//*****************************************************************************
+#define HTTP_IDLE_POLLS         10
+#define HTTP_IDLE_POLLS_LOW     2
+
+//*****************************************************************************
+// The request parser.  A request is taken a byte at a time, so it may come in
+// any number of segments, and nothing but the request line, the query and a
+// few headers is kept.  The query of "/cmd" may set several parameters at
+// once, as in "/cmd?v=0.2&w=0.1&g=1"; they are written to shared RAM as one
+// update, so the C28 sees all of them or none.  The old form, "/cmd?=C0"
+// followed by a digit and a value, and "/cmd?=C1", are still taken.
+//*****************************************************************************
+#define REQ_METHOD              0
+#define REQ_PATH                1
+#define REQ_KEY                 2
+#define REQ_VALUE               3
+#define REQ_VERSION             4
+#define REQ_NAME                5
+#define REQ_HVALUE              6
+#define REQ_DONE                7
+
+#define REQ_BAD                 0x01
+#define REQ_HTTP10              0x02
+#define REQ_CLOSE               0x04
+#define REQ_KEEPALIVE           0x08
+#define REQ_UPGRADE             0x10
+#define REQ_WS_KEY              0x20
+#define REQ_OVERFLOW            0x40
+
+#define PATH_OTHER              0
+#define PATH_ROOT               1
+#define PATH_CMD                2
+#define PATH_WS                 3
+#define PATH_STATS              4
+#define PATH_STATS_BIN          5
+
+#define HDR_OTHER               0
+#define HDR_CONNECTION          1
+#define HDR_UPGRADE             2
+#define HDR_WS_KEY              3
+
+#define PARAM_NONE              0xff
+#define PARAM_LEGACY            0xfe
+
+//*****************************************************************************
+// The parameters a "/cmd" query may set, by their short and long names, in
+// the order of their set points in shared RAM.
+//*****************************************************************************
+static const char * const param_name[HTTPD_PARAMS][2] =
+{
+    { "v", "velocity" }, { "w", "omega" }, { "l", "left" },
+    { "r", "right" }, { "g", "grip" }, { "m", "magnitude" },
+    { "d", "degree" }, { "x", "inverse_x" }, { "y", "inverse_y" },
+    { "t", "inverse_the" }
+};
+
+//*****************************************************************************
+// WebSocket (RFC 6455) on "/ws", for driving from the browser: one
+// connection per operator, up to HTTPD_WS_CONNS of them, carries command
+// frames in and state frames out.
+//
+// A command frame is a binary message of one or more commands in the layout
+// of the UDP command channel, 8 bytes each: the command word (velocity,
+// omega, ...) in the first byte, three reserved bytes, and the value as a
+// signed 16.16 fixed-point number, in network byte order.  Every command
+// frame is answered with a state frame, and state frames are also pushed
+// every WS_STATE_MS (see enet_uip.c); their layout is given with
+// EthernetStateGet().  Pings are answered, and a close is echoed before the
+// connection is closed.
+//
+// uIP keeps only one segment outstanding per connection, so each connection
+// has a slot holding the frame in flight for retransmission, along with the
+// last ping to answer.  A message has to arrive whole, in one segment and one
+// frame; anything else ends the connection.
+//*****************************************************************************
+#ifndef HTTPD_WS_CONNS
+#define HTTPD_WS_CONNS          2
+#endif
+
+#define WS_OP_TEXT              0x1
+#define WS_OP_BINARY            0x2
+#define WS_OP_CLOSE             0x8
+#define WS_OP_PING              0x9
+#define WS_OP_PONG              0xA
+#define WS_FIN                  0x80
+#define WS_MASK                 0x80
+#define WS_CONTROL_MAX          125
+#define WS_KEY_LEN              24
+#define WS_ACCEPT_LEN           28
+
+#define WS_SEND_STATE           0x01
+#define WS_SEND_PONG            0x02
+#define WS_SEND_CLOSE           0x04
+#define WS_CLOSING              0x08
+
+struct httpd_ws_slot
+{
+    struct uip_conn *conn;
+    u8_t tx[144];
+    u8_t ping[WS_CONTROL_MAX];
+    u8_t ping_len;
+};
+
+static struct httpd_ws_slot ws_slot[HTTPD_WS_CONNS];
+
+static const char ws_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 //*****************************************************************************
 // Global for keeping up with web server state.
@@ -57,29 +172,74 @@ int index;
 #define get_left            6
 #define get_right           7
 
-static int static_web_page_fully_sent = 0;
 static int command;
 static int selected;
 
-float velocity_cmd;
-float omega_cmd;
-float left_cmd;
-float right_cmd;
-float grip_cmd;
-float magnitude_cmd;
-float degree_cmd;
-float inverse_x_cmd;
-float inverse_y_cmd;
-float inverse_the_cmd;
-char url_data[6];
+//*****************************************************************************
+// The set points, in Q16 fixed point as they go to the C28.
+//*****************************************************************************
+long velocity_cmd;
+long omega_cmd;
+long left_cmd;
+long right_cmd;
+long grip_cmd;
+long magnitude_cmd;
+long degree_cmd;
+long inverse_x_cmd;
+long inverse_y_cmd;
+long inverse_the_cmd;
+
+static const int param_command[HTTPD_PARAMS] =
+{
+    velocity, omega, left, right, grip, magnitude, degree, inverse_x,
+    inverse_y, inverse_the
+};
+
+static long * const param_value[HTTPD_PARAMS] =
+{
+    &velocity_cmd, &omega_cmd, &left_cmd, &right_cmd, &grip_cmd,
+    &magnitude_cmd, &degree_cmd, &inverse_x_cmd, &inverse_y_cmd,
+    &inverse_the_cmd
+};
+
+//*****************************************************************************
+// The processor clocks taken to turn the last query value into Q16, reported
+// as http.value.cycles.
+//*****************************************************************************
+unsigned long httpd_value_cycles;
+
+//*****************************************************************************
+// The connections the web server has accepted, reported as tcp.conn.accept.
+//*****************************************************************************
+unsigned long httpd_conn_accepted;
+
+//*****************************************************************************
+// The segments sent again, reported as http.resend.
+//*****************************************************************************
+unsigned long httpd_resent;
+
+//*****************************************************************************
+// Every response carries a Content-Length so that the connection can be kept
+// open for the next request.  The header is written with the field left
+// blank and httpd_set_content_length() fills it in.
+//*****************************************************************************
+#define HTTP_CONTENT_LENGTH     "Content-Length:       \r\n"
+
 //*****************************************************************************
 // Default Web Page - allocated in three segments to allow easy update of a
 // counter that is incremented each time the page is sent.
+//
+// The pages are sent with EthernetSendNoCopy(), which has the uDMA move them
+// straight into the MAC.  The uDMA cannot read flash, so they are kept in
+// RAM rather than declared const, and word aligned.
 //*****************************************************************************
-static const char page_not_found[] =
-    "HTTP/1.0 404 OK\r\n"
+#pragma DATA_ALIGN(page_not_found, 4)
+static char page_not_found[] =
+    "HTTP/1.1 404 Not Found\r\n"
     "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
-    "Content-type: text/html\r\n\r\n"
+    "Content-type: text/html\r\n"
+    HTTP_CONTENT_LENGTH
+    "\r\n"
     "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN"
     "http://www.w3.org/TR/html4/loose.dtd\">"
     "<html>"
@@ -94,11 +254,19 @@ static const char page_not_found[] =
 //*****************************************************************************
 // Default Web Page - allocated in three segments to allow easy update of a
 // counter that is incremented each time the page is sent.
+//
+// The three pieces stay in flash, and httpd_init() lays them out one after
+// the other in default_page_buf, where the uDMA can read them.  The page is
+// then a single block, word aligned, and every segment of it but the last is
+// a multiple of 4 bytes long, so that each one starts word aligned and goes
+// out through EthernetSendNoCopy() without being copied.
 //*****************************************************************************
 static const char default_page_buf1of3[] =
-    "HTTP/1.0 200 OK\r\n"
+    "HTTP/1.1 200 OK\r\n"
     "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
-    "Content-type: text/html\r\n\r\n"
+    "Content-type: text/html\r\n"
+    HTTP_CONTENT_LENGTH
+    "\r\n"
     "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN"
     "http://www.w3.org/TR/html4/loose.dtd\">"
     "<html>"
@@ -108,6 +276,76 @@ static const char default_page_buf1of3[] =
     "<script language=\"JavaScript\">"
     "var Rx = false;"
     "var http = false;"
+    "var ws = null;"
+    "var sel = 0;"
+    "var keys = {};"
+    "var driving = false;"
+    "var words = [0xAD, 0xA1, 0xA2, 0xA3, 0xA4, 0xA7, 0xA9, 0xAA, 0xAB, 0xAC];"
+    "function Open()"
+    "{"
+    "if(!window.WebSocket)"
+    "{"
+    "return;"
+    "}"
+    "ws = new WebSocket(\"ws://\" + location.host + \"/ws\");"
+    "ws.binaryType = \"arraybuffer\";"
+    "ws.onmessage = State;"
+    "ws.onclose = function() { ws = null; setTimeout(Open, 1000); };"
+    "}"
+    "function Send(c)"
+    "{"
+    "var d = new DataView(new ArrayBuffer(c.length * 8));"
+    "for(var i = 0; i < c.length; i++)"
+    "{"
+    "d.setUint8(i * 8, c[i][0]);"
+    "d.setInt32(i * 8 + 4, Math.round(c[i][1] * 65536) | 0);"
+    "}"
+    "ws.send(d.buffer);"
+    "}"
+    "function State(e)"
+    "{"
+    "var d = new DataView(e.data);"
+    "var n = d.getUint8(1);"
+    "var t = \"\";"
+    "for(var i = 0; i < n; i++)"
+    "{"
+    "t += d.getFloat32(12 + i * 4).toFixed(3) + \" \";"
+    "}"
+    "document.getElementById(\"S\").innerHTML = t;"
+    "if(Rx)"
+    "{"
+    "document.getElementById(\"I2\").value ="
+    " (d.getInt32(12 + (n + sel) * 4) / 65536).toFixed(3);"
+    "}"
+    "}"
+    "function Drive()"
+    "{"
+    "var v = (keys[38] ? 1 : 0) - (keys[40] ? 1 : 0);"
+    "var w = (keys[37] ? 1 : 0) - (keys[39] ? 1 : 0);"
+    "if(!ws || (ws.readyState != 1))"
+    "{"
+    "return;"
+    "}"
+    "if(v || w || driving)"
+    "{"
+    "Send([[0xA1, v * parseFloat(document.getElementById(\"V\").value)],"
+    " [0xA2, w * parseFloat(document.getElementById(\"W\").value)]]);"
+    "}"
+    "driving = (v || w);"
+    "}"
+    "function Key(e, down)"
+    "{"
+    "if((e.keyCode >= 37) && (e.keyCode <= 40) &&"
+    " (e.target.tagName != \"INPUT\"))"
+    "{"
+    "keys[e.keyCode] = down;"
+    "e.preventDefault();"
+    "}"
+    "}"
+    "document.onkeydown = function(e) { Key(e, true); };"
+    "document.onkeyup = function(e) { Key(e, false); };"
+    "window.onload = Open;"
+    "setInterval(Drive, 50);"
     "function Rcv()"
     "{"
     "if(http.readyState == 4)"
@@ -134,6 +372,16 @@ static const char default_page_buf1of3[] =
     "Rx = true;"
     "}"
     "var v1 = document.getElementById(\"I1\");"
+    "if(ws && (ws.readyState == 1))"
+    "{"
+    "if(input == 'C0')"
+    "{"
+    "var n = parseInt(v1.value.charAt(0));"
+    "sel = (n + 9) % 10;"
+    "Send([[words[n], parseFloat(v1.value.substr(1))]]);"
+    "}"
+    "return;"
+    "}"
     "if(window.XMLHttpRequest)"
     "{"
     "http = new XMLHttpRequest();"
@@ -172,12 +420,92 @@ static const char default_page_buf2of3[] =
     "<td><input id=\"B2\" value=\"GetStatus\" onclick=\"cmd('C1');\" type=\"button\"><input maxlength=\"10\" size=\"10\" id=\"I2\" type=\"text\"></td>"
     "</tr>"
     "</table>"
+    "<p>Drive with the arrow keys: speed <input size=\"4\" id=\"V\" "
+    "value=\"0.5\" type=\"text\"> turn rate <input size=\"4\" id=\"W\" "
+    "value=\"0.5\" type=\"text\">"
+    "<p>Control state: <span id=\"S\"></span>"
     "<br/><br/><br/><br/>";
 static const char default_page_buf3of3[] =
     "Copyright &copy; 2009-2011 Texas Instruments Incorporated. All rights reserved."
     "</center>"
     "</body>"
     "</html>";
+
+//*****************************************************************************
+// The static responses, as the list of segments each is sent in.
+//*****************************************************************************
+struct httpd_segment
+{
+    const char *data;
+    u16_t len;
+};
+
+#define DEFAULT_PAGE_LEN        (sizeof(default_page_buf1of3) - 1 +          \
+                                 sizeof(default_page_buf2of3) - 1 +          \
+                                 sizeof(default_page_buf3of3) - 1)
+
+#pragma DATA_SECTION(default_page_buf, "DMARAM")
+#pragma DATA_ALIGN(default_page_buf, 4)
+static char default_page_buf[DEFAULT_PAGE_LEN + 1];
+
+static const struct httpd_segment default_page[] =
+{
+    { default_page_buf, DEFAULT_PAGE_LEN },
+    { 0, 0 }
+};
+
+static const struct httpd_segment not_found_page[] =
+{
+    { page_not_found, sizeof(page_not_found) - 1 },
+    { 0, 0 }
+};
+
+//*****************************************************************************
+// Statistics pages.  The counters keep changing, so the response is
+// formatted into stats_buf when the request arrives.
+//*****************************************************************************
+static const char stats_header_text[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
+    "Content-type: text/plain\r\n"
+    HTTP_CONTENT_LENGTH
+    "\r\n";
+static const char stats_header_binary[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
+    "Content-type: application/octet-stream\r\n"
+    HTTP_CONTENT_LENGTH
+    "\r\n";
+static const char stats_too_long[] =
+    "HTTP/1.1 500 Internal Server Error\r\n"
+    "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+// Room for the longer header and, in the text form, a line per counter of
+// its name, a space, up to 10 digits and a newline.
+static char stats_buf[sizeof(stats_header_binary) +
+                      (HTTPD_STATS * (HTTPD_STATS_NAME_LEN + 12))];
+
+//*****************************************************************************
+// Reply to a command.  The body is the response inserted with
+// httpd_insert_response(), or a single space when there is none.
+//*****************************************************************************
+static const char ws_busy[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static const char cmd_header[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: UIP/1.0 (http://www.sics.se/~adam/uip/)\r\n"
+    "Content-type: text/plain\r\n"
+    "Cache-Control: no-cache\r\n"
+    HTTP_CONTENT_LENGTH
+    "\r\n";
+static char cmd_buf[sizeof(cmd_header) + 64];
+
 char empty_char[] = " ";
 typedef struct
 {
@@ -186,6 +514,45 @@ typedef struct
 }response;
 response response_to_client;
 
+//*****************************************************************************
+// functions added in enet_uip.c
+//*****************************************************************************
+extern long EthernetStatsText(char *pcBuf, long lBufLen);
+extern long EthernetStatsBinary(unsigned char *pucBuf, long lBufLen);
+extern void EthernetSendNoCopy(const void *pvData, int iLen);
+extern int EthernetSendMore(const void *pvData, int iLen, unsigned long ulSeq,
+                            int iCopy);
+extern int EthernetConnLow(void);
+extern void EthernetProcessCMD(int command);
+extern int EthernetCmdRun(const unsigned char *pucCmd, int iLen);
+extern long EthernetStateGet(unsigned char *pucBuf, long lBufLen);
+extern void Shared_Ram_updateBegin_m3(void);
+extern void Shared_Ram_updateEnd_m3(void);
+
+//*****************************************************************************
+// Fill in the blank Content-Length field of a response header.  length is
+// the size of the whole response, header included.
+//*****************************************************************************
+static void
+httpd_set_content_length(char *response, int length)
+{
+    char *field;
+    char *body;
+
+    field = strstr(response, "Content-Length:");
+    body = strstr(field, "\r\n\r\n") + 4;
+    length -= body - response;
+
+    // Right align the digits in the blanks, ending at the field's "\r\n".
+    field = strstr(field, "\r\n");
+    do
+    {
+        *--field = '0' + (length % 10);
+        length /= 10;
+    }
+    while(length);
+}
+
 //*****************************************************************************
 // Initialize the web server.
 // Starts to listen for incoming connection requests on TCP port 80.
@@ -193,110 +560,59 @@ response response_to_client;
 void
 httpd_init(void)
 {
+    char *page;
+
+    // Lay the pieces of the default page out in RAM.
+    page = default_page_buf;
+    memcpy(page, default_page_buf1of3, sizeof(default_page_buf1of3) - 1);
+    page += sizeof(default_page_buf1of3) - 1;
+    memcpy(page, default_page_buf2of3, sizeof(default_page_buf2of3) - 1);
+    page += sizeof(default_page_buf2of3) - 1;
+    memcpy(page, default_page_buf3of3, sizeof(default_page_buf3of3));
+
+    // The static pages never change, so their lengths are set once.
+    httpd_set_content_length(default_page_buf, DEFAULT_PAGE_LEN);
+    httpd_set_content_length(page_not_found, sizeof(page_not_found) - 1);
+
     // Listen to port 80.
     uip_listen(HTONS(80));
 }
 
 //*****************************************************************************
-// Parse command, 'C0' to toggle LED, 'C1' to get status of the LED
-//****************************************************************************
+// Parse the old command word, 'C0' followed by the digit of a set point and
+// its value to set it, or 'C1' to get the value last set.
+//*****************************************************************************
 void
-httpd_parse_command_word(void)
-{
-    // Toggle command
-    if( (BUF_APPDATA[10] == 'C') && (BUF_APPDATA[11] == '0'))
-    {
-    	double temp ;
-    	url_data[0]=BUF_APPDATA[13];
-    	url_data[1]=BUF_APPDATA[14];
-    	url_data[2]=BUF_APPDATA[15];
-    	url_data[3]=BUF_APPDATA[16];
-    	url_data[4]=BUF_APPDATA[17];
-    	url_data[5]=BUF_APPDATA[18];
-
-        switch(BUF_APPDATA[12])
-        {
-        case '1':
-            command = velocity;
-            temp = atof(url_data);
-            velocity_cmd = (float)temp;
-            selected = 0;
-            break;
-
-        case '2':
-            command = omega;
-            temp = atof(url_data);
-            omega_cmd = (float)temp;
-            selected = 1;
-            break;
-
-        case '3':
-            command = left;
-            temp = atof(url_data);
-            left_cmd = (float)temp;
-            selected = 2;
-            break;
-
-        case '4':
-            command = right;
-            temp = atof(url_data);
-            right_cmd = (float)temp;
-            selected = 3;
-            break;
-
-        case '5':
-            command = grip;
-            temp = atof(url_data);
-            grip_cmd = (float)temp;
-            selected = 4;
-            break;
-
-        case '6':
-            command = magnitude;
-            temp = atof(url_data);
-            magnitude_cmd = (float)temp;
-            selected = 5;
-            break;
-
-        case '7':
-            command = degree;
-            temp = atof(url_data);
-            degree_cmd = (float)temp;
-            selected = 6;
-            break;
-
-        case '8':
-            command = inverse_x;
-            temp = atof(url_data);
-            inverse_x_cmd = (float)temp;
-            selected = 7;
-            break;
-
-        case '9':
-            command = inverse_y;
-            temp = atof(url_data);
-            inverse_y_cmd = (float)temp;
-            selected = 8;
-            break;
+httpd_parse_command_word(const char *word)
+{
+    struct httpd_request *request;
+    int param;
 
-        case '0':
-            command = inverse_the;
-            temp = atof(url_data);
-            inverse_the_cmd = (float)temp;
-            selected = 9;
-            break;
+    request = &hs->request;
 
-        default:
+    // Set command
+    if((word[0] == 'C') && (word[1] == '0'))
+    {
+        param = word[2] - '1';
+        if(word[2] == '0')
+        {
+            param = HTTPD_PARAMS - 1;
+        }
+        if((param < 0) || (param >= HTTPD_PARAMS) ||
+           !httpd_q16(&word[3], &request->value[param]))
+        {
             command = INVALID_INPUT;
             selected = 10;
-
-            break;
+            return;
         }
 
+        request->set |= 1 << param;
+        selected = param;
+        command = NO_CMD;
     }
 
     // Get status command
-    else if((BUF_APPDATA[10] == 'C')&& (BUF_APPDATA[11] == '1'))
+    else if((word[0] == 'C') && (word[1] == '1'))
     {
         switch(selected)
         {
@@ -320,7 +636,6 @@ httpd_parse_command_word(void)
             command = INVALID_INPUT;
             break;
         }
-
     }
 
     // Invalid command
@@ -328,7 +643,6 @@ httpd_parse_command_word(void)
     {
         command = INVALID_CMD;
     }
-
 }
 
 //*****************************************************************************
@@ -370,116 +684,1271 @@ httpd_insert_response(int data_length,char *data)
 }
 
 //*****************************************************************************
-// HTTP Application Callback Function
+// Send len bytes of the response at data, which start at sequence number
+// seq, as the segment uIP builds in reply to this call.  Static pages go out
+// straight from their buffers, the responses formatted into shared buffers
+// are copied.
 //*****************************************************************************
-void
-httpd_appcall(void)
+static void
+httpd_send_uip(const char *data, u16_t len, unsigned long seq)
 {
-    switch(uip_conn->lport)
+    // uIP sends from its own idea of the next sequence number, and only as
+    // much as it has been told is outstanding.
+    uip_conn->snd_nxt[0] = seq >> 24;
+    uip_conn->snd_nxt[1] = (seq >> 16) & 0xff;
+    uip_conn->snd_nxt[2] = (seq >> 8) & 0xff;
+    uip_conn->snd_nxt[3] = seq & 0xff;
+    uip_conn->len = len;
+
+    if(hs->state == HTTP_FILE)
     {
-    // This is the web server:
-    case HTONS(80):
+        EthernetSendNoCopy(data, len);
+    }
+    else
     {
+        uip_send((void *)data, len);
+    }
+}
 
-        // Pick out the application state from the uip_conn structure.
-        hs = (struct httpd_state *)&(uip_conn->appstate);
+//*****************************************************************************
+// Send the oldest segment in flight again.
+//*****************************************************************************
+static void
+httpd_resend(void)
+{
+    httpd_send_uip(hs->flight[0].data, hs->flight[0].len, hs->snd_una);
+    hs->flight[0].ms = (u16_t)TimebaseGetMs();
+    httpd_resent++;
+}
 
-        // We use the uip_ test functions to deduce why we were
-        // called. If uip_connected() is non-zero, we were called
-        // because a remote host has connected to us. If
-        // uip_newdata() is non-zero, we were called because the
-        // remote host has sent us new data, and if uip_acked() is
-        // non-zero, the remote host has acknowledged the data we
-        // previously sent to it. */
-        if(uip_connected())
+//*****************************************************************************
+// Send as much more of the response as the peer's window and the record of
+// segments in flight allow.  The first segment goes out through uIP and the
+// rest through EthernetSendMore(), which puts them behind it.  Each segment
+// but the last of a piece is cut to a multiple of 4 bytes, so that the next
+// one still starts word aligned.  A segment that was in flight when uIP last
+// timed the connection out, and is now the oldest, is sent again first.
+//*****************************************************************************
+static void
+httpd_send_window(void)
+{
+    struct httpd_flight *flight;
+    u16_t now;
+    u16_t mss;
+    u16_t room;
+    u16_t len;
+    int first;
+
+    now = (u16_t)TimebaseGetMs();
+    first = 1;
+
+    if(hs->resend && hs->segs &&
+       ((short)(hs->flight[0].ms - hs->resend_ms) < 0))
+    {
+        httpd_resend();
+        first = 0;
+    }
+
+    // With nothing in flight one segment goes out whatever the window, as
+    // uIP would send it.  uIP cuts what it sends to uip_mss(), the peer's MSS
+    // or its window if that is smaller, so that is as much as it is given.
+    mss = uip_initialmss();
+    len = hs->snd_nxt - hs->snd_una;
+    room = (hs->wnd > len) ? (hs->wnd - len) : 0;
+    if(!len && (room < uip_mss()))
+    {
+        room = uip_mss();
+    }
+
+    while(hs->len && (hs->segs < HTTPD_FLIGHT))
+    {
+        len = (hs->len < mss) ? hs->len : mss;
+        len = (len < room) ? len : room;
+        if(len < hs->len)
         {
-            // Since we have just been connected with the remote host, we
-            // reset the state for this connection. The ->count variable
-            // contains the amount of data that is yet to be sent to the
-            // remote host, and the ->state is set to HTTP_NOGET to signal
-            // that we haven't received any HTTP GET request for this
-            // connection yet.
-            hs->state = HTTP_NOGET;
-            hs->count = 0;
-            return;
+            len &= ~3;
         }
-        else if(uip_poll())
+        if(!len)
         {
-            // If we are polled ten times, we abort the connection. This is
-            // because we don't want connections lingering indefinitely in
-            // the system.
-            if(hs->count++ >= 10)
-            {
-                uip_abort();
-            }
-            return;
+            break;
         }
-        else if(uip_newdata() && hs->state == HTTP_NOGET)
+
+        if(first)
+        {
+            httpd_send_uip(hs->data, len, hs->snd_nxt);
+            first = 0;
+        }
+        else if(!EthernetSendMore(hs->data, len, hs->snd_nxt,
+                                  hs->state != HTTP_FILE))
         {
+            break;
+        }
 
-            if(BUF_APPDATA[0] != 'G' || BUF_APPDATA[1] != 'E' ||
-               BUF_APPDATA[2] != 'T' || BUF_APPDATA[3] != ' ')
-            {
-                uip_abort();
-                return;
-            }
+        flight = &hs->flight[hs->segs++];
+        flight->data = hs->data;
+        flight->len = len;
+        flight->ms = now;
+        hs->snd_nxt += len;
+        room -= len;
 
-            // Check to see what we should send.
-            if((BUF_APPDATA[4] == '/') && (BUF_APPDATA[5] == ' '))
-            {
-                static_web_page_fully_sent = 0;
-                uip_send(default_page_buf1of3,sizeof(default_page_buf1of3) - 1);
-            }
-            else if((BUF_APPDATA[4] == '/') && (BUF_APPDATA[5] == 'c')&&
-                    (BUF_APPDATA[6] == 'm')&&(BUF_APPDATA[7] == 'd'))
-            {
-                httpd_parse_command_word();
+        // Move on, into the next piece of a page if this one is done.
+        hs->data += len;
+        hs->len -= len;
+        if(!hs->len && (hs->state == HTTP_FILE) && hs->segment[1].data)
+        {
+            hs->segment++;
+            hs->data = hs->segment->data;
+            hs->len = hs->segment->len;
+        }
+    }
 
-                // send an empty character. when this function exits the values
-                // will be updated. The response will be
-                // sent to client when client acks the empty character
-                uip_send(empty_char,sizeof(empty_char)-1);
-            }
-            else
-            {
-                uip_send(page_not_found,sizeof(page_not_found) - 1);
-                hs->count = 3;
-            }
+    // When uIP has nothing to send it has to go on timing what is in
+    // flight, from the oldest byte.
+    if(first && hs->segs)
+    {
+        uip_conn->len = hs->snd_nxt - hs->snd_una;
+    }
+}
+
+//*****************************************************************************
+// Start sending a response: a static page, or a response formatted into a
+// buffer.
+//*****************************************************************************
+static void
+httpd_send_start(void)
+{
+    hs->snd_una = (((unsigned long)uip_conn->snd_nxt[0] << 24) |
+                   ((unsigned long)uip_conn->snd_nxt[1] << 16) |
+                   ((unsigned long)uip_conn->snd_nxt[2] << 8) |
+                   (unsigned long)uip_conn->snd_nxt[3]);
+    hs->snd_nxt = hs->snd_una;
+    hs->segs = 0;
+    hs->resend = 0;
+    httpd_send_window();
+}
+
+static void
+httpd_send_page(const struct httpd_segment *page)
+{
+    hs->state = HTTP_FILE;
+    hs->segment = page;
+    hs->data = page->data;
+    hs->len = page->len;
+    httpd_send_start();
+}
+
+static void
+httpd_send_text(const char *data, int length)
+{
+    hs->state = HTTP_TEXT;
+    hs->data = data;
+    hs->len = length;
+    httpd_send_start();
+}
+
+//*****************************************************************************
+// uIP timed the connection out: send the oldest segment in flight again, and
+// mark the time, so that the others in flight then are sent again in turn as
+// the ACKs come in.
+//*****************************************************************************
+static void
+httpd_rexmit(void)
+{
+    if(!hs->segs)
+    {
+        return;
+    }
+    hs->resend = 1;
+    hs->resend_ms = (u16_t)TimebaseGetMs();
+    httpd_resend();
+}
+
+//*****************************************************************************
+// The remote host acknowledged some of what was sent, carry on with the
+// response.  Once it has all gone out and been acknowledged the connection
+// waits for the next request, unless the client asked for it to be closed.
+//*****************************************************************************
+static void
+httpd_acked(void)
+{
+    unsigned long una;
+    u16_t acked;
+    u8_t i;
+
+    // uIP has moved its sequence number on to what the ACK covers.  Retire
+    // the segments that are through, and the start of one that is not.
+    una = (((unsigned long)uip_conn->snd_nxt[0] << 24) |
+           ((unsigned long)uip_conn->snd_nxt[1] << 16) |
+           ((unsigned long)uip_conn->snd_nxt[2] << 8) |
+           (unsigned long)uip_conn->snd_nxt[3]);
+    while(hs->segs && (una != hs->snd_una))
+    {
+        acked = una - hs->snd_una;
+        if(acked < hs->flight[0].len)
+        {
+            hs->flight[0].data += acked;
+            hs->flight[0].len -= acked;
+            hs->snd_una = una;
+            break;
         }
-        else if(uip_acked())
+        hs->snd_una += hs->flight[0].len;
+        hs->segs--;
+        for(i = 0; i < hs->segs; i++)
         {
+            hs->flight[i] = hs->flight[i + 1];
+        }
+    }
+    if(!hs->segs)
+    {
+        hs->resend = 0;
+    }
 
-            hs->count++;
-            if(static_web_page_fully_sent == 0)
-            {
-                if(hs->count == 1)
-                {
-                    uip_send(default_page_buf2of3,
-                             sizeof(default_page_buf2of3) - 1);
-                }
-                else if(hs->count == 2)
-                {
-                    uip_send(default_page_buf3of3,
-                             sizeof(default_page_buf3of3) - 1);
-                    static_web_page_fully_sent = 1;
-                }
-                else
-                {
-                    uip_close();
-                }
-            }
-            else
-            {
-                if(hs->count == 1)
-                {
-                    uip_send(response_to_client.response_data,
-                             response_to_client.length);
-                }
-                else
-                {
-                    uip_close();
-                }
+    if(hs->len || hs->segs)
+    {
+        httpd_send_window();
+        return;
+    }
+
+    hs->state = HTTP_NOGET;
+    hs->count = 0;
+    if(hs->close)
+    {
+        uip_close();
+    }
+    else if(hs->ws)
+    {
+        // The handshake is through, the connection is a WebSocket now.
+        hs->state = HTTP_WEBSOCKET;
+        hs->sent = 0;
+    }
+}
 
+//*****************************************************************************
+// Send the reply to a command, complete in one segment.  The response is
+// used up, so a command that inserts none gets the single space.
+//*****************************************************************************
+static void
+httpd_send_cmd_response(void)
+{
+    const char *data;
+    int length;
+    int header;
+
+    data = empty_char;
+    length = sizeof(empty_char) - 1;
+    if(response_to_client.response_data &&
+       (response_to_client.length > 0) &&
+       (response_to_client.length <= (sizeof(cmd_buf) - sizeof(cmd_header))))
+    {
+        data = response_to_client.response_data;
+        length = response_to_client.length;
+    }
+
+    header = sizeof(cmd_header) - 1;
+    memcpy(cmd_buf, cmd_header, sizeof(cmd_header));
+    memcpy(&cmd_buf[header], data, length);
+    httpd_set_content_length(cmd_buf, header + length);
+    response_to_client.length = 0;
+
+    httpd_send_text(cmd_buf, header + length);
+}
+
+//*****************************************************************************
+// Send the network statistics, as text or in binary form
+//*****************************************************************************
+static void
+httpd_send_stats(int binary)
+{
+    const char *header;
+    int length;
+    int body;
+
+    header = binary ? stats_header_binary : stats_header_text;
+    length = strlen(header);
+    memcpy(stats_buf, header, length + 1);
+
+    if(binary)
+    {
+        body = EthernetStatsBinary((unsigned char *)&stats_buf[length],
+                                   sizeof(stats_buf) - length);
+    }
+    else
+    {
+        body = EthernetStatsText(&stats_buf[length],
+                                 sizeof(stats_buf) - length);
+    }
+
+    // Neither form is sent cut short.  Only a counter added beyond
+    // HTTPD_STATS or with too long a name can bring this about.
+    if(!body)
+    {
+        httpd_send_text(stats_too_long, sizeof(stats_too_long) - 1);
+        return;
+    }
+    length += body;
+
+    httpd_set_content_length(stats_buf, length);
+    httpd_send_text(stats_buf, length);
+}
+
+//*****************************************************************************
+// Hash one 64 byte block into the SHA-1 state.
+//*****************************************************************************
+static void
+httpd_sha1_block(unsigned long *hash, const u8_t *block)
+{
+    unsigned long w[16];
+    unsigned long a, b, c, d, e, f, k, t;
+    int i;
+
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = (((unsigned long)block[i * 4] << 24) |
+                ((unsigned long)block[i * 4 + 1] << 16) |
+                ((unsigned long)block[i * 4 + 2] << 8) |
+                (unsigned long)block[i * 4 + 3]);
+    }
+
+    a = hash[0];
+    b = hash[1];
+    c = hash[2];
+    d = hash[3];
+    e = hash[4];
+    for(i = 0; i < 80; i++)
+    {
+        if(i >= 16)
+        {
+            t = (w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^
+                 w[i & 15]);
+            w[i & 15] = (t << 1) | (t >> 31);
+        }
+        if(i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if(i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if(i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = ((a << 5) | (a >> 27)) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = t;
+    }
+
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+}
+
+//*****************************************************************************
+// The SHA-1 digest of a message of up to 119 bytes, which is all the
+// WebSocket handshake needs.
+//*****************************************************************************
+static void
+httpd_sha1(u8_t *digest, const u8_t *message, int length)
+{
+    unsigned long hash[5];
+    u8_t block[128];
+    int blocks;
+    int i;
+
+    hash[0] = 0x67452301;
+    hash[1] = 0xefcdab89;
+    hash[2] = 0x98badcfe;
+    hash[3] = 0x10325476;
+    hash[4] = 0xc3d2e1f0;
+
+    // Pad with a one bit, zeros, and the length in bits.
+    memset(block, 0, sizeof(block));
+    memcpy(block, message, length);
+    block[length] = 0x80;
+    blocks = (length < 56) ? 1 : 2;
+    block[(blocks * 64) - 2] = (length * 8) >> 8;
+    block[(blocks * 64) - 1] = (length * 8) & 0xff;
+
+    for(i = 0; i < blocks; i++)
+    {
+        httpd_sha1_block(hash, &block[i * 64]);
+    }
+
+    for(i = 0; i < 20; i++)
+    {
+        digest[i] = hash[i / 4] >> (24 - ((i % 4) * 8));
+    }
+}
+
+//*****************************************************************************
+// Encode data in base64.  Returns the length of the text, which is not
+// terminated.
+//*****************************************************************************
+static int
+httpd_base64(char *text, const u8_t *data, int length)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned long group;
+    int out;
+    int i;
+
+    out = 0;
+    for(i = 0; i < length; i += 3)
+    {
+        group = (unsigned long)data[i] << 16;
+        if((i + 1) < length)
+        {
+            group |= (unsigned long)data[i + 1] << 8;
+        }
+        if((i + 2) < length)
+        {
+            group |= data[i + 2];
+        }
+        text[out++] = digits[(group >> 18) & 0x3f];
+        text[out++] = digits[(group >> 12) & 0x3f];
+        text[out++] = ((i + 1) < length) ? digits[(group >> 6) & 0x3f] : '=';
+        text[out++] = ((i + 2) < length) ? digits[group & 0x3f] : '=';
+    }
+
+    return(out);
+}
+
+//*****************************************************************************
+// Returns true if the connection is an open WebSocket, for the state frames
+// pushed from enet_uip.c.
+//*****************************************************************************
+int
+httpd_websocket(struct uip_conn *conn)
+{
+    return(((struct httpd_state *)&conn->appstate)->state == HTTP_WEBSOCKET);
+}
+
+//*****************************************************************************
+// Find a free WebSocket slot.  A slot is free once its connection has
+// closed, or has been taken over by another client, whether or not uIP told
+// us about it.
+//*****************************************************************************
+static int
+httpd_ws_slot(void)
+{
+    struct uip_conn *conn;
+    int slot;
+
+    for(slot = 0; slot < HTTPD_WS_CONNS; slot++)
+    {
+        conn = ws_slot[slot].conn;
+        if(!conn || ((conn->tcpstateflags & UIP_TS_MASK) != UIP_ESTABLISHED) ||
+           (((struct httpd_state *)&conn->appstate)->ws != (slot + 1)))
+        {
+            return(slot);
+        }
+    }
+
+    return(-1);
+}
+
+//*****************************************************************************
+// Give up the connection's WebSocket slot, if it has one.
+//*****************************************************************************
+static void
+httpd_ws_release(void)
+{
+    if(hs->ws && (ws_slot[hs->ws - 1].conn == uip_conn))
+    {
+        ws_slot[hs->ws - 1].conn = 0;
+    }
+    hs->ws = 0;
+}
+
+//*****************************************************************************
+// Answer a WebSocket upgrade request.  The handshake goes out through the
+// slot's buffer, and the connection becomes a WebSocket once it is acked.
+//*****************************************************************************
+static void
+httpd_ws_upgrade(void)
+{
+    struct httpd_ws_slot *slot;
+    u8_t message[WS_KEY_LEN + sizeof(ws_guid) - 1];
+    u8_t digest[20];
+    char *text;
+    int index;
+
+    if((hs->request.flags & (REQ_UPGRADE | REQ_WS_KEY)) !=
+       (REQ_UPGRADE | REQ_WS_KEY))
+    {
+        hs->close = 1;
+        httpd_send_page(not_found_page);
+        return;
+    }
+
+    // All the operators' slots are taken.
+    index = httpd_ws_slot();
+    if(index < 0)
+    {
+        hs->close = 1;
+        httpd_send_text(ws_busy, sizeof(ws_busy) - 1);
+        return;
+    }
+
+    slot = &ws_slot[index];
+    slot->conn = uip_conn;
+    slot->ping_len = 0;
+    hs->ws = index + 1;
+    hs->ws_flags = WS_SEND_STATE;
+
+    memcpy(message, hs->request.ws_key, WS_KEY_LEN);
+    memcpy(&message[WS_KEY_LEN], ws_guid, sizeof(ws_guid) - 1);
+    httpd_sha1(digest, message, sizeof(message));
+
+    text = (char *)slot->tx;
+    strcpy(text, "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: ");
+    text += strlen(text);
+    text += httpd_base64(text, digest, sizeof(digest));
+    strcpy(text, "\r\n\r\n");
+    text += 4;
+
+    httpd_send_text((char *)slot->tx, text - (char *)slot->tx);
+}
+
+//*****************************************************************************
+// Send the next frame the WebSocket has waiting, if there is nothing in
+// flight: the close, a pong, or the state.
+//*****************************************************************************
+static void
+httpd_ws_send(void)
+{
+    struct httpd_ws_slot *slot;
+    u8_t *frame;
+
+    slot = &ws_slot[hs->ws - 1];
+    frame = slot->tx;
+    if(hs->sent)
+    {
+        return;
+    }
+
+    if(hs->ws_flags & WS_SEND_CLOSE)
+    {
+        frame[0] = WS_FIN | WS_OP_CLOSE;
+        frame[1] = 0;
+        hs->sent = 2;
+        hs->ws_flags = WS_CLOSING;
+    }
+    else if(hs->ws_flags & WS_SEND_PONG)
+    {
+        frame[0] = WS_FIN | WS_OP_PONG;
+        frame[1] = slot->ping_len;
+        memcpy(&frame[2], slot->ping, slot->ping_len);
+        hs->sent = 2 + slot->ping_len;
+        hs->ws_flags &= ~WS_SEND_PONG;
+    }
+    else if(hs->ws_flags & WS_SEND_STATE)
+    {
+        frame[0] = WS_FIN | WS_OP_BINARY;
+        frame[1] = EthernetStateGet(&frame[2], WS_CONTROL_MAX);
+        hs->sent = 2 + frame[1];
+        hs->ws_flags &= ~WS_SEND_STATE;
+    }
+    else
+    {
+        return;
+    }
+
+    uip_send(frame, hs->sent);
+}
+
+//*****************************************************************************
+// Take the frames of a WebSocket message off the connection.  Returns 0 if
+// the connection has to be dropped.
+//*****************************************************************************
+static int
+httpd_ws_input(void)
+{
+    struct httpd_ws_slot *slot;
+    u8_t *frame;
+    u8_t *payload;
+    u8_t *end;
+    int length;
+    int i;
+
+    slot = &ws_slot[hs->ws - 1];
+    frame = BUF_APPDATA;
+    end = frame + uip_datalen();
+    while(frame < end)
+    {
+        // Only whole, masked frames of up to 64 kbytes are taken.
+        if((end - frame) < 2)
+        {
+            return(0);
+        }
+        length = frame[1] & 0x7f;
+        payload = &frame[2];
+        if(length == 127)
+        {
+            return(0);
+        }
+        if(length == 126)
+        {
+            if((end - frame) < 4)
+            {
+                return(0);
+            }
+            length = (frame[2] << 8) | frame[3];
+            payload = &frame[4];
+        }
+        payload += 4;
+        if(!(frame[0] & WS_FIN) || !(frame[1] & WS_MASK) ||
+           (payload > end) || (length > (end - payload)))
+        {
+            return(0);
+        }
+        for(i = 0; i < length; i++)
+        {
+            payload[i] ^= payload[(i & 3) - 4];
+        }
+
+        switch(frame[0] & 0x0f)
+        {
+        case WS_OP_BINARY:
+            EthernetCmdRun(payload, length);
+            hs->ws_flags |= WS_SEND_STATE;
+            break;
+
+        case WS_OP_PING:
+            if(length > WS_CONTROL_MAX)
+            {
+                return(0);
+            }
+            memcpy(slot->ping, payload, length);
+            slot->ping_len = length;
+            hs->ws_flags |= WS_SEND_PONG;
+            break;
+
+        case WS_OP_CLOSE:
+            hs->ws_flags |= WS_SEND_CLOSE;
+            return(1);
+
+        case WS_OP_TEXT:
+        case WS_OP_PONG:
+            break;
+
+        default:
+            return(0);
+        }
+
+        frame = payload + length;
+    }
+
+    return(1);
+}
+
+//*****************************************************************************
+// Serve an open WebSocket.
+//*****************************************************************************
+static void
+httpd_ws_appcall(void)
+{
+    if(hs->ws_flags & WS_CLOSING)
+    {
+        if(uip_acked())
+        {
+            uip_close();
+        }
+        else if(uip_rexmit())
+        {
+            uip_send(ws_slot[hs->ws - 1].tx, hs->sent);
+        }
+        return;
+    }
+
+    if(uip_acked())
+    {
+        hs->sent = 0;
+    }
+
+    if(uip_newdata() && !httpd_ws_input())
+    {
+        httpd_ws_release();
+        uip_abort();
+        return;
+    }
+
+    if(uip_rexmit())
+    {
+        uip_send(ws_slot[hs->ws - 1].tx, hs->sent);
+        return;
+    }
+
+    if(uip_poll())
+    {
+        hs->ws_flags |= WS_SEND_STATE;
+    }
+    httpd_ws_send();
+}
+
+//*****************************************************************************
+// Start on a new request.
+//*****************************************************************************
+static void
+httpd_request_reset(void)
+{
+    hs->request.state = REQ_METHOD;
+    hs->request.len = 0;
+    hs->request.flags = 0;
+    hs->request.path = PATH_OTHER;
+    hs->request.header = HDR_OTHER;
+    hs->request.param = PARAM_NONE;
+    hs->request.set = 0;
+    httpd_clear_command();
+}
+
+//*****************************************************************************
+// Add a character to the token being collected.  One that does not fit is
+// dropped, and the token marked as overflowed.
+//*****************************************************************************
+static void
+httpd_token_add(struct httpd_request *request, char c)
+{
+    if(request->len < (HTTPD_TOKEN_LEN - 1))
+    {
+        request->token[request->len++] = c;
+    }
+    else
+    {
+        request->flags |= REQ_OVERFLOW;
+    }
+}
+
+//*****************************************************************************
+// The token is complete: terminate it, and say whether it fitted.
+//*****************************************************************************
+static int
+httpd_token_end(struct httpd_request *request)
+{
+    int fitted;
+
+    request->token[request->len] = 0;
+    request->len = 0;
+    fitted = !(request->flags & REQ_OVERFLOW);
+    request->flags &= ~REQ_OVERFLOW;
+
+    return(fitted);
+}
+
+//*****************************************************************************
+// The path is complete.
+//*****************************************************************************
+static void
+httpd_path_end(struct httpd_request *request)
+{
+    static const char * const paths[] =
+    {
+        "/", "/cmd", "/ws", "/stats", "/stats.bin"
+    };
+    int path;
+
+    if(!httpd_token_end(request))
+    {
+        return;
+    }
+    for(path = 0; path < (sizeof(paths) / sizeof(paths[0])); path++)
+    {
+        if(!strcmp(request->token, paths[path]))
+        {
+            request->path = PATH_ROOT + path;
+        }
+    }
+}
+
+//*****************************************************************************
+// A query key is complete.
+//*****************************************************************************
+static void
+httpd_key_end(struct httpd_request *request)
+{
+    int param;
+
+    request->param = PARAM_NONE;
+    if(!httpd_token_end(request))
+    {
+        return;
+    }
+    if(!request->token[0])
+    {
+        request->param = PARAM_LEGACY;
+        return;
+    }
+    for(param = 0; param < HTTPD_PARAMS; param++)
+    {
+        if(!strcmp(request->token, param_name[param][0]) ||
+           !strcmp(request->token, param_name[param][1]))
+        {
+            request->param = param;
+        }
+    }
+}
+
+//*****************************************************************************
+// A query value is complete.  A value that is not a number fails the whole
+// request, so that none of its parameters is set.
+//*****************************************************************************
+static void
+httpd_value_end(struct httpd_request *request)
+{
+    unsigned long start;
+    int number;
+
+    if(!httpd_token_end(request) && (request->param != PARAM_NONE))
+    {
+        request->flags |= REQ_BAD;
+        return;
+    }
+
+    if(request->param == PARAM_LEGACY)
+    {
+        httpd_parse_command_word(request->token);
+    }
+    else if(request->param != PARAM_NONE)
+    {
+        start = TimebaseCycles();
+        number = httpd_q16(request->token, &request->value[request->param]);
+        httpd_value_cycles = TimebaseCycles() - start;
+        if(!number)
+        {
+            request->flags |= REQ_BAD;
+            return;
+        }
+        request->set |= 1 << request->param;
+    }
+    request->param = PARAM_NONE;
+}
+
+//*****************************************************************************
+// A header name is complete.
+//*****************************************************************************
+static void
+httpd_name_end(struct httpd_request *request)
+{
+    request->header = HDR_OTHER;
+    if(!httpd_token_end(request))
+    {
+        return;
+    }
+    if(!strcmp(request->token, "connection"))
+    {
+        request->header = HDR_CONNECTION;
+    }
+    else if(!strcmp(request->token, "upgrade"))
+    {
+        request->header = HDR_UPGRADE;
+    }
+    else if(!strcmp(request->token, "sec-websocket-key"))
+    {
+        request->header = HDR_WS_KEY;
+    }
+}
+
+//*****************************************************************************
+// A header value is complete.  Those of Connection and Upgrade are kept in
+// lower case, so far as they fit, the WebSocket key as it is.
+//*****************************************************************************
+static void
+httpd_hvalue_end(struct httpd_request *request)
+{
+    int length;
+
+    length = request->len;
+    if(!httpd_token_end(request) && (request->header == HDR_WS_KEY))
+    {
+        return;
+    }
+
+    switch(request->header)
+    {
+    case HDR_CONNECTION:
+        if(strstr(request->token, "close"))
+        {
+            request->flags |= REQ_CLOSE;
+        }
+        if(strstr(request->token, "keep-alive"))
+        {
+            request->flags |= REQ_KEEPALIVE;
+        }
+        break;
+
+    case HDR_UPGRADE:
+        if(strstr(request->token, "websocket"))
+        {
+            request->flags |= REQ_UPGRADE;
+        }
+        break;
+
+    case HDR_WS_KEY:
+        if(length == HTTPD_WS_KEY_LEN)
+        {
+            memcpy(request->ws_key, request->token, HTTPD_WS_KEY_LEN);
+            request->flags |= REQ_WS_KEY;
+        }
+        break;
+    }
+}
+
+//*****************************************************************************
+// Take one character of the request.  Carriage returns are dropped and a line
+// ends at the line feed.
+//*****************************************************************************
+static void
+httpd_parse(struct httpd_request *request, char c)
+{
+    if(c == '\r')
+    {
+        return;
+    }
+
+    switch(request->state)
+    {
+    case REQ_METHOD:
+        if(c == ' ')
+        {
+            if(!httpd_token_end(request) || strcmp(request->token, "GET"))
+            {
+                request->flags |= REQ_BAD;
+            }
+            request->state = REQ_PATH;
+        }
+        else
+        {
+            httpd_token_add(request, c);
+        }
+        break;
+
+    case REQ_PATH:
+        if((c == '?') || (c == ' '))
+        {
+            httpd_path_end(request);
+            request->state = (c == '?') ? REQ_KEY : REQ_VERSION;
+        }
+        else
+        {
+            httpd_token_add(request, c);
+        }
+        break;
+
+    case REQ_KEY:
+        if(c == '=')
+        {
+            httpd_key_end(request);
+            request->state = REQ_VALUE;
+        }
+        else if((c == '&') || (c == ' '))
+        {
+            httpd_token_end(request);
+            request->state = (c == '&') ? REQ_KEY : REQ_VERSION;
+        }
+        else
+        {
+            httpd_token_add(request, tolower(c));
+        }
+        break;
+
+    case REQ_VALUE:
+        if((c == '&') || (c == ' '))
+        {
+            httpd_value_end(request);
+            request->state = (c == '&') ? REQ_KEY : REQ_VERSION;
+        }
+        else
+        {
+            httpd_token_add(request, c);
+        }
+        break;
+
+    case REQ_VERSION:
+        if(c == '\n')
+        {
+            if(httpd_token_end(request) &&
+               !strcmp(request->token, "http/1.0"))
+            {
+                request->flags |= REQ_HTTP10;
+            }
+            request->state = REQ_NAME;
+        }
+        else
+        {
+            httpd_token_add(request, tolower(c));
+        }
+        break;
+
+    case REQ_NAME:
+        if(c == '\n')
+        {
+            // A blank line ends the headers, and the request.  A line with
+            // no colon is skipped.
+            if(!request->len && !(request->flags & REQ_OVERFLOW))
+            {
+                request->state = REQ_DONE;
+            }
+            httpd_token_end(request);
+        }
+        else if(c == ':')
+        {
+            httpd_name_end(request);
+            request->state = REQ_HVALUE;
+        }
+        else
+        {
+            httpd_token_add(request, tolower(c));
+        }
+        break;
+
+    case REQ_HVALUE:
+        if(c == '\n')
+        {
+            httpd_hvalue_end(request);
+            request->state = REQ_NAME;
+        }
+        else if((c != ' ') || request->len)
+        {
+            httpd_token_add(request, (request->header == HDR_WS_KEY) ?
+                                     c : tolower(c));
+        }
+        break;
+    }
+}
+
+//*****************************************************************************
+// Carry out the parameters of a "/cmd" query, as one update of shared RAM.
+//*****************************************************************************
+static void
+httpd_apply(void)
+{
+    struct httpd_request *request;
+    int command_word;
+    int param;
+
+    request = &hs->request;
+    if(request->set)
+    {
+        Shared_Ram_updateBegin_m3();
+        for(param = 0; param < HTTPD_PARAMS; param++)
+        {
+            if(request->set & (1 << param))
+            {
+                *param_value[param] = request->value[param];
+                EthernetProcessCMD(param_command[param]);
+            }
+        }
+        Shared_Ram_updateEnd_m3();
+    }
+
+    if(httpd_get_command(&command_word))
+    {
+        httpd_clear_command();
+        EthernetProcessCMD(command_word);
+    }
+}
+
+//*****************************************************************************
+// Handle a request once it is complete.  HTTP/1.1 connections stay open
+// afterwards unless the client sends "Connection: close", HTTP/1.0 ones only
+// if it asks for keep-alive.
+//*****************************************************************************
+static void
+httpd_request(void)
+{
+    struct httpd_request *request;
+
+    request = &hs->request;
+    hs->close = (request->flags & REQ_CLOSE) ||
+                ((request->flags & REQ_HTTP10) &&
+                 !(request->flags & REQ_KEEPALIVE));
+
+    // Check to see what we should send.
+    switch(request->path)
+    {
+    case PATH_ROOT:
+        httpd_send_page(default_page);
+        break;
+
+    case PATH_CMD:
+        // Carry out the command straight away, so that the reply, which
+        // goes out with the ACK of the request, carries its result.  A
+        // query with a value that is not a number sets nothing.
+        if(!(request->flags & REQ_BAD))
+        {
+            httpd_apply();
+        }
+        httpd_clear_command();
+        httpd_send_cmd_response();
+        break;
+
+    case PATH_WS:
+        httpd_ws_upgrade();
+        break;
+
+    case PATH_STATS:
+    case PATH_STATS_BIN:
+        // Counters, as text for "/stats" or binary for "/stats.bin".
+        httpd_send_stats(request->path == PATH_STATS_BIN);
+        break;
+
+    default:
+        httpd_send_page(not_found_page);
+        break;
+    }
+}
+
+//*****************************************************************************
+// Take the data that has arrived, and handle the request once it is
+// complete.  Requests are not pipelined: uIP keeps nothing of a segment once
+// it has been handed over, so anything after the request but line ends
+// could not be parsed once the response is through, and the client is cut
+// off as it is in httpd_appcall(), without the request being carried out.
+//*****************************************************************************
+static void
+httpd_input(void)
+{
+    struct httpd_request *request;
+    u16_t i;
+
+    request = &hs->request;
+    for(i = 0; (i < uip_datalen()) && (request->state != REQ_DONE); i++)
+    {
+        httpd_parse(request, BUF_APPDATA[i]);
+
+        // Only GET is served.
+        if((request->state == REQ_PATH) && (request->flags & REQ_BAD))
+        {
+            uip_abort();
+            return;
+        }
+    }
+
+    if(request->state == REQ_DONE)
+    {
+        for(; i < uip_datalen(); i++)
+        {
+            if((BUF_APPDATA[i] != '\r') && (BUF_APPDATA[i] != '\n'))
+            {
+                uip_abort();
+                return;
+            }
+        }
+        httpd_request();
+        httpd_request_reset();
+    }
+}
+
+//*****************************************************************************
+// HTTP Application Callback Function
+//*****************************************************************************
+void
+httpd_appcall(void)
+{
+    switch(uip_conn->lport)
+    {
+    // This is the web server:
+    case HTONS(80):
+    {
+
+        // Pick out the application state from the uip_conn structure.
+        hs = (struct httpd_state *)&(uip_conn->appstate);
+
+        // We use the uip_ test functions to deduce why we were
+        // called. If uip_connected() is non-zero, we were called
+        // because a remote host has connected to us. If
+        // uip_newdata() is non-zero, we were called because the
+        // remote host has sent us new data, and if uip_acked() is
+        // non-zero, the remote host has acknowledged the data we
+        // previously sent to it. */
+        if(uip_connected())
+        {
+            // Since we have just been connected with the remote host, we
+            // reset the state for this connection. The ->count variable
+            // counts the polls the connection has been idle for, and the
+            // ->state is set to HTTP_NOGET to signal that we are waiting
+            // for an HTTP GET request on this connection.
+            httpd_conn_accepted++;
+            hs->state = HTTP_NOGET;
+            hs->count = 0;
+            hs->close = 0;
+            hs->ws = 0;
+            hs->ws_flags = 0;
+            hs->len = 0;
+            hs->sent = 0;
+            hs->snd_una = 0;
+            hs->snd_nxt = 0;
+            hs->segs = 0;
+            hs->resend = 0;
+            httpd_request_reset();
+            return;
+        }
+
+        // A WebSocket gives up its slot when the connection goes.
+        if(uip_closed() || uip_aborted() || uip_timedout())
+        {
+            httpd_ws_release();
+            return;
+        }
+
+        // The acknowledgement of the end of a response often arrives with
+        // the next request, so deal with it first.
+        if(uip_acked() && (hs->state != HTTP_NOGET) &&
+           (hs->state != HTTP_WEBSOCKET))
+        {
+            httpd_acked();
+        }
+
+        if(hs->state == HTTP_WEBSOCKET)
+        {
+            httpd_ws_appcall();
+            return;
+        }
+
+        if(uip_newdata())
+        {
+            // Requests are not pipelined, a client that sends one before
+            // the last response is through is cut off.
+            if(hs->state != HTTP_NOGET)
+            {
+                uip_abort();
+                return;
+            }
+            hs->count = 0;
+            httpd_input();
+        }
+        else if(uip_rexmit() && (hs->state != HTTP_NOGET))
+        {
+            httpd_rexmit();
+        }
+        else if(uip_poll() && (hs->state == HTTP_NOGET))
+        {
+            // If we are polled ten times between requests, we abort the
+            // connection. This is because we don't want connections
+            // lingering indefinitely in the system.  When connections run
+            // short, idle ones are aborted sooner.
+            if(hs->count++ >= (EthernetConnLow() ? HTTP_IDLE_POLLS_LOW :
+                                                   HTTP_IDLE_POLLS))
+            {
+                uip_abort();
             }
         }
 
@@ -18,13 +18,80 @@ void httpd_init(void);
 void httpd_appcall(void);
 void httpd_test(void);
 
+//*****************************************************************************
+// The most counters the statistics pages may report, and the longest name
+// one may have.  The pages are formatted into a buffer sized from these, so
+// a counter added to g_ppcStatNames in enet_uip.c has to stay within them.
+//*****************************************************************************
+#define HTTPD_STATS             88
+#define HTTPD_STATS_NAME_LEN    20
+
+//*****************************************************************************
+// The request parser's state.  A request is taken a byte at a time as it
+// arrives, however the client's TCP splits it into segments.  A token holds
+// the longest thing kept from it, the WebSocket key.
+//*****************************************************************************
+#define HTTPD_TOKEN_LEN         28
+#define HTTPD_WS_KEY_LEN        24
+#define HTTPD_PARAMS            10
+
+struct httpd_request
+{
+    u8_t state;
+    u8_t len;
+    u8_t flags;
+    u8_t path;
+    u8_t header;
+    u8_t param;
+    u16_t set;
+    char token[HTTPD_TOKEN_LEN];
+    char ws_key[HTTPD_WS_KEY_LEN];
+    long value[HTTPD_PARAMS];
+};
+
+//*****************************************************************************
+// A response is sent with up to HTTPD_FLIGHT segments in flight, as the
+// peer's window allows.  uIP keeps track of a single segment per connection,
+// so the web server keeps its own record of what is in flight: the sequence
+// numbers of the first byte not yet acknowledged and of the next byte to
+// send, and for each segment where its data is and when it was last sent.
+// enet_uip.c turns each ACK within the record into one uIP takes (see
+// EthernetTcpAckCheck()), and sends the segments beyond the one uIP builds
+// (see EthernetSendMore()).
+//*****************************************************************************
+#ifndef HTTPD_FLIGHT
+#define HTTPD_FLIGHT            4
+#endif
+
+struct httpd_flight
+{
+    const char *data;
+    u16_t len;
+    u16_t ms;
+};
+
 //*****************************************************************************
 // Web Server Application State Variable Definition.
 //*****************************************************************************
 struct httpd_state
 {
     u8_t state;
+    u8_t close;
+    u8_t ws;
+    u8_t ws_flags;
     u16_t count;
+    const struct httpd_segment *segment;
+    const char *data;
+    u16_t len;
+    u16_t sent;
+    unsigned long snd_una;
+    unsigned long snd_nxt;
+    u16_t wnd;
+    u8_t segs;
+    u8_t resend;
+    u16_t resend_ms;
+    struct httpd_flight flight[HTTPD_FLIGHT];
+    struct httpd_request request;
 };
 
 #endif // __HTTPD_H__
@@ -0,0 +1,81 @@
+//###########################################################################
+// FILE:   httpd_q16.c
+// TITLE:  Decimal text to Q16 fixed point for the web server
+//###########################################################################
+//
+// Kept apart from httpd.c, with nothing but the C library to depend on, so
+// that host/q16_test.c can check it against strtod() and time it against
+// atof().
+//
+//###########################################################################
+
+#include <ctype.h>
+
+#include "httpd_q16.h"
+
+//*****************************************************************************
+// Convert a decimal number, with an optional sign and point, to Q16 fixed
+// point, rounded to the nearest.  Returns 0, leaving *value alone, if text
+// is not a number or is outside the range of Q16, -32768 to 32767.99998.
+// The M3 has no FPU, so this keeps to integer arithmetic: the fraction is
+// built from its last digit back, a tenth at a time, with one bit to spare
+// for the rounding.
+//*****************************************************************************
+int
+httpd_q16(const char *text, long *value)
+{
+    const char *point;
+    const char *digit;
+    unsigned long whole;
+    unsigned long fraction;
+    unsigned long result;
+    int negative;
+    int digits;
+
+    negative = (*text == '-');
+    if((*text == '-') || (*text == '+'))
+    {
+        text++;
+    }
+
+    whole = 0;
+    digits = 0;
+    while(isdigit((unsigned char)*text))
+    {
+        whole = (whole * 10) + (*text++ - '0');
+        if(whole > 32768)
+        {
+            return(0);
+        }
+        digits++;
+    }
+
+    fraction = 0;
+    if(*text == '.')
+    {
+        point = text++;
+        while(isdigit((unsigned char)*text))
+        {
+            text++;
+            digits++;
+        }
+        for(digit = text - 1; digit != point; digit--)
+        {
+            fraction = (fraction + ((unsigned long)(*digit - '0') << 17)) / 10;
+        }
+    }
+
+    if(!digits || *text)
+    {
+        return(0);
+    }
+
+    result = (whole << 16) + ((fraction + 1) >> 1);
+    if(result > (negative ? 0x80000000 : 0x7fffffff))
+    {
+        return(0);
+    }
+    *value = negative ? (long)(0 - result) : (long)result;
+
+    return(1);
+}
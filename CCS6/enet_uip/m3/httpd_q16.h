@@ -0,0 +1,15 @@
+//###########################################################################
+// FILE:   httpd_q16.h
+// TITLE:  Decimal text to Q16 fixed point for the web server
+//###########################################################################
+
+#ifndef __HTTPD_Q16_H__
+#define __HTTPD_Q16_H__
+
+//*****************************************************************************
+// Convert the decimal number in text to Q16 fixed point in *value.  Returns
+// 1 on success, 0 if text is not a number or is out of range.
+//*****************************************************************************
+extern int httpd_q16(const char *text, long *value);
+
+#endif // __HTTPD_Q16_H__
@@ -38,8 +38,21 @@ typedef unsigned short uip_stats_t;
 // UDP Maximum Connections
 #define UIP_CONF_UDP_CONNS          4
 
+// TCP connection profile
+// The size of the TCP connection table: 8, 16 or 32 connections.  The state
+// of each connection, uIP's and the web server's, is allocated with the
+// table, so the memory used grows with the profile.
+#ifndef UIP_CONF_CONN_PROFILE
+#define UIP_CONF_CONN_PROFILE       8
+#endif
+
+#if (UIP_CONF_CONN_PROFILE != 8) && (UIP_CONF_CONN_PROFILE != 16) &&         \
+    (UIP_CONF_CONN_PROFILE != 32)
+#error "UIP_CONF_CONN_PROFILE must be 8, 16 or 32"
+#endif
+
 // Maximum number of TCP connections.
-#define UIP_CONF_MAX_CONNECTIONS    2
+#define UIP_CONF_MAX_CONNECTIONS    UIP_CONF_CONN_PROFILE
 
 // Maximum number of listening TCP ports.
 #define UIP_CONF_MAX_LISTENPORTS    4
@@ -63,7 +76,12 @@ typedef unsigned short uip_stats_t;
 #define UIP_CONF_LOGGING            0
 
 // Broadcast Support
-#define UIP_CONF_BROADCAST          0
+// uIP takes every datagram while the host address is 0.0.0.0, so this only
+// matters once there is an address.  When a lease runs out the uIP DHCP
+// client starts over with the old address still set, and asks for its
+// answers to be broadcast; this lets them in, as the receive classifier
+// does for broadcasts to UDP port 68 (see enet_uip.c).
+#define UIP_CONF_BROADCAST          1
 
 // Link-Level Header length
 #define UIP_CONF_LLH_LEN            14
@@ -71,9 +89,13 @@ typedef unsigned short uip_stats_t;
 // CPU byte order.
 #define UIP_CONF_BYTE_ORDER         LITTLE_ENDIAN
 
+// Checksum functions provided by the application (see enet_uip.c)
+#define UIP_ARCH_CHKSUM             1
+
 // Here we include the header file for the application we are using in
-// this example
-#include "httpd/httpd.h"
+// this example.  This is the web server in this directory, whose connection
+// state is a fraction of the size of the one in the uIP apps.
+#include "httpd.h"
 
 // Define the uIP Application State type, based on the httpd.h state variable.
 typedef struct httpd_state uip_tcp_appstate_t;
@@ -89,6 +111,12 @@ typedef struct httpd_state uip_tcp_appstate_t;
 // this example
 #include "dhcpc/dhcpc.h"
 
+// UIP_UDP_APPCALL: the DHCP client shares UDP with the command channel, so
+// datagrams go to enet_uip.c first, which passes those for DHCP on.
+#undef UIP_UDP_APPCALL
+#define UIP_UDP_APPCALL EthernetUdpAppcall
+void EthernetUdpAppcall(void);
+
 #endif // __UIP_CONF_H_
 
 
@@ -99,13 +99,38 @@ void movecar(float,float);
 
 
 float c28_r_array[2048];     // mapped to S2 of shared RAM owned by M3
-//long int c28_r_w_array[2048];   // mapped to S0 of shared RAM owned by c28
 
 #pragma DATA_SECTION(c28_r_array,"SHARERAMS2");
-//#pragma DATA_SECTION(c28_r_w_array,"SHARERAMS0");
+
+// Set points 0 to 9 from the M3, in Q16 fixed point since the M3 has no
+// FPU, and the M3's count of changes to them, odd while it is writing them.
+#define SHARED_SETPOINTS 10
+#define SHARED_SETPOINT(n) (((volatile long *)c28_r_array)[n])
+#define SHARED_SEQ_WORD (((volatile unsigned long *)c28_r_array)[10])
+#define Q16_TO_FLOAT (1.0f / 65536.0f)
+
+// Telemetry for the M3, which streams it over UDP: every cpu_timer2_isr
+// period a sample of wl, wr, speed, rotate, SpeedRpm_fr and SpeedRpm_pr is
+// written to slot count % TELEM_RING, and then count is incremented.  The
+// layout is the M3's tTelemRing in enet_uip.c, which reads it from the start
+// of S0, so the ring has to be the only thing in SHARERAMS0.
+#define TELEM_FIELDS 6
+#define TELEM_RING 64
+typedef struct
+{
+	volatile unsigned long count;
+	volatile unsigned long reserved;
+	volatile float sample[TELEM_RING][TELEM_FIELDS];
+} TELEM_RING_T;
+
+TELEM_RING_T telem_ring;     // mapped to S0 of shared RAM owned by c28
+#pragma DATA_SECTION(telem_ring,"SHARERAMS0");
+
+// The speeds measured by the eQEP, published in the telemetry.
+POSSPEED qep_posspeed_r = POSSPEED_DEFAULTS_1;
 
 void Shared_Ram_dataRead_c28(); // function to read data from shared RAM owned by M3
-//void Shared_Ram_dataWrite_c28(int);// function to write data from shared RAM owned by c28
+void Shared_Ram_telemWrite_c28(); // function to write telemetry to shared RAM owned by c28
 
 
 void linetracking();
@@ -328,6 +353,7 @@ __interrupt void cpu_timer2_isr(void) {	//car control
 		computespeed();
 	}
 	grip();
+	Shared_Ram_telemWrite_c28();
 	// The CPU acknowledges the interrupt.
 
 
@@ -413,20 +439,56 @@ void Shared_Ram_dataRead_c28()
     {
         c28_r_w_array[index] = c28_r_array[index];
     }*/
-	v = c28_r_array[0];
-	w = c28_r_array[1];
-	l = c28_r_array[2];
-	r = c28_r_array[3];
-	forward = c28_r_array[4];
-	theta = c28_r_array[5];
-	radius = c28_r_array[6];
-	Xg = c28_r_array[7];
-	Yg = c28_r_array[8];
-	Tg = c28_r_array[9];
+	unsigned long seq;
+	long set[SHARED_SETPOINTS];
+	int i;
+
+	// Take the set points only as a whole update: skip this period if the
+	// M3 is part way through one, or starts one while they are copied.
+	seq = SHARED_SEQ_WORD;
+	if (seq & 1)
+	{
+		return;
+	}
+	for (i = 0; i < SHARED_SETPOINTS; i++)
+	{
+		set[i] = SHARED_SETPOINT(i);
+	}
+	if (SHARED_SEQ_WORD != seq)
+	{
+		return;
+	}
+
+	v = set[0] * Q16_TO_FLOAT;
+	w = set[1] * Q16_TO_FLOAT;
+	l = set[2] * Q16_TO_FLOAT;
+	r = set[3] * Q16_TO_FLOAT;
+	forward = set[4] * Q16_TO_FLOAT;
+	theta = set[5] * Q16_TO_FLOAT;
+	radius = set[6] * Q16_TO_FLOAT;
+	Xg = set[7] * Q16_TO_FLOAT;
+	Yg = set[8] * Q16_TO_FLOAT;
+	Tg = set[9] * Q16_TO_FLOAT;
 	//left = c28_r_array[6];
 
 }
 
+void Shared_Ram_telemWrite_c28()
+{
+	volatile float *slot;
+
+	// The M3 takes a sample once count has moved past it, so the sample is
+	// written first.
+	slot = telem_ring.sample[telem_ring.count % TELEM_RING];
+	slot[0] = wl;
+	slot[1] = wr;
+	slot[2] = speed;
+	slot[3] = rotate;
+	slot[4] = (float)qep_posspeed_r.SpeedRpm_fr;
+	slot[5] = (float)qep_posspeed_r.SpeedRpm_pr;
+	telem_ring.count++;
+}
+
 void turn_left()
 {
 	changeDuty1(100);